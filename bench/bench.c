@@ -0,0 +1,513 @@
+// Micro-benchmarks of the protocol kernels.
+// Runs the framing, FCS and packet code of the link and application layers
+// on their own, over fixed input corpora, and prints the CPU time each one
+// takes per input byte. The corpora are generated from fixed seeds (the
+// compressed one is a file tiled up to the corpus size), so runs on the
+// same machine and build can be compared to catch regressions.
+//
+// Usage: bench [-f frame_size] [-n corpus_bytes] [-t secs] [-k kernel] [-c corpus] [-z file] [-v]
+
+#include "link_frame.h"
+#include "link_layer.h"
+#include "packet_helper.h"
+#include "serial_port.h"
+#include "serial_transport.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_FRAME_SIZE 1024     // Information field: a 1021-byte DATA packet
+#define DEFAULT_CORPUS_SIZE 1048576
+#define DEFAULT_MIN_TIME 0.2        // Seconds of measurement per kernel and corpus
+#define DEFAULT_COMPRESSED "penguin.gif"
+#define SEED 0x9E3779B97F4A7C15ULL
+
+typedef struct
+{
+    const char *name;
+    unsigned char *data;
+    size_t size;
+} Corpus;
+
+// State shared by the kernels for the corpus being measured
+typedef struct
+{
+    const Corpus *corpus;
+    int frameSize;
+    unsigned char *out;    // Frame or packet being built
+    unsigned char *stream; // Input prepared by setup: frames or packets back to back
+    size_t streamLen;
+    int *packetLen;        // Size of each packet in stream
+    int nPackets;
+    unsigned long long outBytes; // Bytes produced by the last pass, for out/in
+    LinkContext link;      // Receiver fed by the deframing kernels
+    volatile unsigned sink; // Keeps the results from being optimized away
+} Bench;
+
+typedef struct
+{
+    const char *name;
+    int (*setup)(Bench *b); // Optional; returns -1 if the kernel cannot run
+    size_t (*pass)(Bench *b); // One pass over the corpus; returns the input bytes consumed
+} Kernel;
+
+////////////////////////////////////////////////
+// CORPORA
+////////////////////////////////////////////////
+
+static uint64_t nextRandom(uint64_t *x)
+{
+    *x ^= *x >> 12;
+    *x ^= *x << 25;
+    *x ^= *x >> 27;
+    return *x * 0x2545F4914F6CDD1DULL;
+}
+
+static void makeRandom(unsigned char *data, size_t size)
+{
+    uint64_t x = SEED;
+    for (size_t i = 0; i < size; i++)
+        data[i] = nextRandom(&x) >> 56;
+}
+
+// Words with the letter frequencies of English prose, in sentences and lines
+static void makeText(unsigned char *data, size_t size)
+{
+    static const char *words[] = {
+        "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be",
+        "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have",
+        "an", "had", "they", "you", "were", "their", "one", "all", "we", "can", "her", "has",
+        "there", "been", "if", "more", "when", "will", "would", "who", "so", "no", "frame",
+        "serial", "port", "receiver", "transmitter", "packet", "timeout", "retransmission",
+    };
+    int nWords = sizeof(words) / sizeof(words[0]);
+    uint64_t x = SEED;
+    size_t pos = 0, line = 0;
+    bool capital = true;
+
+    while (pos < size) {
+        const char *w = words[nextRandom(&x) % nWords];
+        for (int i = 0; w[i] != '\0' && pos < size; i++, line++)
+            data[pos++] = capital && i == 0 ? w[i] - 'a' + 'A' : w[i];
+        capital = false;
+
+        uint64_t r = nextRandom(&x) % 16;
+        if (r == 0 && pos < size) {
+            data[pos++] = '.';
+            capital = true;
+        } else if (r == 1 && pos < size) {
+            data[pos++] = ',';
+        }
+        if (pos < size) {
+            data[pos++] = line > 72 ? '\n' : ' ';
+            if (line > 72)
+                line = 0;
+        }
+    }
+}
+
+// The file repeated up to size bytes. Returns -1 if it cannot be read.
+static int makeFromFile(unsigned char *data, size_t size, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    size_t n = fread(data, 1, size, f);
+    fclose(f);
+    if (n == 0)
+        return -1;
+    for (size_t i = n; i < size; i++)
+        data[i] = data[i - n];
+    return 0;
+}
+
+////////////////////////////////////////////////
+// KERNELS
+////////////////////////////////////////////////
+
+// Size of the chunk at off, as the application cuts the file
+static size_t chunkAt(const Bench *b, size_t off, size_t max)
+{
+    size_t left = b->corpus->size - off;
+    return left < max ? left : max;
+}
+
+// I-frames of the corpus as llwrite builds them (Ns alternating)
+static size_t buildFrames(Bench *b, unsigned char *out, bool cobs, unsigned char fcs)
+{
+    size_t total = 0;
+    unsigned char C = fcs == LL_FCS_CRC16 ? 0x20 : 0x00;
+    int ns = 0;
+    for (size_t off = 0; off < b->corpus->size; off += b->frameSize) {
+        int n = (int)chunkAt(b, off, b->frameSize);
+        unsigned char *frame = out != NULL ? out + total : b->out;
+        int len = cobs ? buildCobsFrame(frame, C | 0x10 | (ns << 6), b->corpus->data + off, n, fcs)
+                       : buildFrame(frame, C | (ns << 6), b->corpus->data + off, n, fcs);
+        b->sink += frame[len / 2];
+        total += len;
+        ns = 1 - ns;
+    }
+    b->outBytes = total;
+    return total;
+}
+
+static size_t passStuffBcc2(Bench *b)
+{
+    buildFrames(b, NULL, false, LL_FCS_XOR8);
+    return b->corpus->size;
+}
+
+static size_t passStuffCrc16(Bench *b)
+{
+    buildFrames(b, NULL, false, LL_FCS_CRC16);
+    return b->corpus->size;
+}
+
+static size_t passCobsCrc16(Bench *b)
+{
+    buildFrames(b, NULL, true, LL_FCS_CRC16);
+    return b->corpus->size;
+}
+
+// The frames of a deframing kernel, built once
+static int setupFrames(Bench *b, bool cobs, unsigned char fcs)
+{
+    size_t frames = (b->corpus->size + b->frameSize - 1) / b->frameSize;
+    b->stream = malloc(frames * STUFFED_SIZE(b->frameSize));
+    if (b->stream == NULL)
+        return -1;
+    b->streamLen = buildFrames(b, b->stream, cobs, fcs);
+    b->outBytes = 0; // Set by building the frames, which is not what is measured
+    return 0;
+}
+
+static int setupDeframeBcc2(Bench *b)
+{
+    return setupFrames(b, false, LL_FCS_XOR8);
+}
+
+static int setupDeframeCrc16(Bench *b)
+{
+    return setupFrames(b, false, LL_FCS_CRC16);
+}
+
+static int setupDeframeCobs(Bench *b)
+{
+    return setupFrames(b, true, LL_FCS_CRC16);
+}
+
+// Feed the frames to a connected receiver, as llread does with what it
+// reads from the port: destuffing, FCS check, RR
+static size_t passDeframe(Bench *b)
+{
+    static unsigned char packet[MAX_INFO_SIZE];
+    b->link.expectedNs = 0;
+
+    size_t delivered = 0;
+    for (size_t i = 0; i < b->streamLen;) {
+        int len = 0;
+        LlRxEvent event;
+        i += llrxPushBuffer(&b->link, b->stream + i, (int)(b->streamLen - i), packet, &len, &event);
+        if (event == LL_RX_DATA)
+            delivered += len;
+    }
+    if (delivered != b->corpus->size) {
+        fprintf(stderr, "bench: the receiver delivered %zu of %zu bytes\n", delivered, b->corpus->size);
+        exit(1);
+    }
+    return b->corpus->size;
+}
+
+static size_t passDataBuild(Bench *b)
+{
+    size_t total = 0;
+    for (size_t off = 0; off < b->corpus->size; off += b->frameSize - 3) {
+        int len = buildDataPacket(b->out, b->corpus->data + off, (uint16_t)chunkAt(b, off, b->frameSize - 3));
+        b->sink += b->out[len - 1];
+        total += len;
+    }
+    b->outBytes = total;
+    return b->corpus->size;
+}
+
+// START packets whose file names are taken from the corpus
+static void controlName(const Bench *b, size_t off, char *name)
+{
+    size_t n = chunkAt(b, off, MAX_FILENAME_SIZE);
+    for (size_t i = 0; i < n; i++)
+        name[i] = b->corpus->data[off + i] != 0 ? (char)b->corpus->data[off + i] : '_';
+    name[n] = '\0';
+}
+
+static size_t passControlBuild(Bench *b)
+{
+    ControlInfo info;
+    memset(&info, 0, sizeof(info));
+    info.hasDigest = true;
+    char name[MAX_FILENAME_SIZE + 1];
+    size_t total = 0;
+    for (size_t off = 0; off < b->corpus->size; off += MAX_FILENAME_SIZE) {
+        controlName(b, off, name);
+        int len = buildControlPacket(b->out, CF_START, off + UINT32_MAX, name, &info);
+        b->sink += b->out[len - 1];
+        total += len;
+    }
+    b->outBytes = total;
+    return b->corpus->size;
+}
+
+// The packets of a parsing kernel, built once
+static int setupPackets(Bench *b, bool control)
+{
+    size_t step = control ? MAX_FILENAME_SIZE : (size_t)b->frameSize - 3;
+    size_t n = (b->corpus->size + step - 1) / step;
+    b->stream = malloc(n * (step + 64));
+    b->packetLen = malloc(n * sizeof(int));
+    if (b->stream == NULL || b->packetLen == NULL)
+        return -1;
+
+    ControlInfo info;
+    memset(&info, 0, sizeof(info));
+    info.hasDigest = true;
+    char name[MAX_FILENAME_SIZE + 1];
+    b->streamLen = 0;
+    b->nPackets = 0;
+    for (size_t off = 0; off < b->corpus->size; off += step) {
+        int len;
+        if (control) {
+            controlName(b, off, name);
+            len = buildControlPacket(b->out, CF_START, off + UINT32_MAX, name, &info);
+        } else {
+            len = buildDataPacket(b->out, b->corpus->data + off, (uint16_t)chunkAt(b, off, step));
+        }
+        memcpy(b->stream + b->streamLen, b->out, len);
+        b->streamLen += len;
+        b->packetLen[b->nPackets++] = len;
+    }
+    return 0;
+}
+
+static int setupDataParse(Bench *b)
+{
+    return setupPackets(b, false);
+}
+
+static int setupControlParse(Bench *b)
+{
+    return setupPackets(b, true);
+}
+
+// What receivePacket does with each packet llread returns
+static size_t passParse(Bench *b)
+{
+    static uint8_t data[MAX_PACKET_SIZE];
+    char name[MAX_FILENAME_SIZE + 1];
+    ControlInfo info;
+    uint8_t controlType;
+    uint64_t fileSize = 0;
+    size_t pos = 0;
+    for (int i = 0; i < b->nPackets; i++) {
+        int n = parsePacket(b->stream + pos, b->packetLen[i], &controlType, data, &fileSize, name, &info);
+        b->sink += n + (unsigned)fileSize;
+        pos += b->packetLen[i];
+    }
+    return b->corpus->size;
+}
+
+static const Kernel kernels[] = {
+    {"stuff+bcc2", NULL, passStuffBcc2},
+    {"stuff+crc16", NULL, passStuffCrc16},
+    {"cobs+crc16", NULL, passCobsCrc16},
+    {"destuff+bcc2", setupDeframeBcc2, passDeframe},
+    {"destuff+crc16", setupDeframeCrc16, passDeframe},
+    {"uncobs+crc16", setupDeframeCobs, passDeframe},
+    {"data-build", NULL, passDataBuild},
+    {"data-parse", setupDataParse, passParse},
+    {"tlv-build", NULL, passControlBuild},
+    {"tlv-parse", setupControlParse, passParse},
+};
+
+////////////////////////////////////////////////
+// MAIN
+////////////////////////////////////////////////
+
+static double nowSeconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// The receiver's answers (RR) go nowhere
+static int discardWrite(SerialPort *port, const unsigned char *bytes, int nBytes)
+{
+    (void)port;
+    (void)bytes;
+    return nBytes;
+}
+
+static const SerialTransport discardTransport = {
+    .prefix = "discard:",
+    .write = discardWrite,
+};
+
+// The receiver used by the deframing kernels, connected as after a SET
+static void openReceiver(Bench *b)
+{
+    memset(&b->link, 0, sizeof(b->link));
+    b->link.params.role = LlRx;
+    b->link.params.maxInfo = b->frameSize;
+    b->link.port.fd = -1;
+    b->link.port.transport = &discardTransport;
+    b->link.connected = TRUE;
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n"
+           "  -f, --frame-size N   information field of the frames (default %d)\n"
+           "  -n, --size N         bytes per corpus (default %d)\n"
+           "  -t, --time SECS      minimum time measured per kernel and corpus (default %.1f)\n"
+           "  -k, --kernel NAME    only the kernels whose name contains NAME\n"
+           "  -c, --corpus NAME    only the corpora whose name contains NAME\n"
+           "                       (random, all-FLAG, text, compressed)\n"
+           "  -z, --compressed F   file tiled into the compressed corpus (default " DEFAULT_COMPRESSED ")\n"
+           "  -v, --verbose        show the output of the link layer, but for the messages\n"
+           "                       about each frame, which are compiled out\n",
+           prog, DEFAULT_FRAME_SIZE, DEFAULT_CORPUS_SIZE, DEFAULT_MIN_TIME);
+}
+
+int main(int argc, char *argv[])
+{
+    int frameSize = DEFAULT_FRAME_SIZE;
+    long corpusSize = DEFAULT_CORPUS_SIZE;
+    double minTime = DEFAULT_MIN_TIME;
+    const char *kernelFilter = "", *corpusFilter = "";
+    const char *compressed = DEFAULT_COMPRESSED;
+    bool verbose = false;
+
+    static const struct option longOptions[] = {
+        {"frame-size", required_argument, NULL, 'f'},
+        {"size", required_argument, NULL, 'n'},
+        {"time", required_argument, NULL, 't'},
+        {"kernel", required_argument, NULL, 'k'},
+        {"corpus", required_argument, NULL, 'c'},
+        {"compressed", required_argument, NULL, 'z'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:n:t:k:c:z:vh", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'f': frameSize = atoi(optarg); break;
+            case 'n': corpusSize = atol(optarg); break;
+            case 't': minTime = atof(optarg); break;
+            case 'k': kernelFilter = optarg; break;
+            case 'c': corpusFilter = optarg; break;
+            case 'z': compressed = optarg; break;
+            case 'v': verbose = true; break;
+            default: usage(argv[0]); exit(1);
+        }
+    }
+    if (optind != argc || frameSize < 16 || frameSize > MAX_INFO_SIZE || corpusSize < 1 || minTime <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    Corpus corpora[] = {
+        {"random", malloc(corpusSize), corpusSize},
+        {"all-FLAG", malloc(corpusSize), corpusSize},
+        {"text", malloc(corpusSize), corpusSize},
+        {"compressed", malloc(corpusSize), corpusSize},
+    };
+    int nCorpora = sizeof(corpora) / sizeof(corpora[0]);
+    for (int i = 0; i < nCorpora; i++) {
+        if (corpora[i].data == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    makeRandom(corpora[0].data, corpusSize);
+    memset(corpora[1].data, FLAG, corpusSize);
+    makeText(corpora[2].data, corpusSize);
+    if (makeFromFile(corpora[3].data, corpusSize, compressed) < 0) {
+        perror(compressed);
+        exit(1);
+    }
+
+    Bench b;
+    memset(&b, 0, sizeof(b));
+    b.frameSize = frameSize;
+    b.out = malloc(STUFFED_SIZE(MAX_INFO_SIZE));
+    if (b.out == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    openReceiver(&b);
+
+    // The link layer talks a lot; the results go to the real stdout
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!verbose) {
+        fflush(stdout);
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    }
+
+    fprintf(report, "%ld bytes per corpus, frames of %d bytes; times per input byte\n", corpusSize, frameSize);
+    fprintf(report, "%-14s %-10s %9s %8s %7s\n", "kernel", "corpus", "ns/byte", "GB/s", "out/in");
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        const Kernel *kernel = &kernels[k];
+        if (strstr(kernel->name, kernelFilter) == NULL)
+            continue;
+
+        for (int c = 0; c < nCorpora; c++) {
+            if (strstr(corpora[c].name, corpusFilter) == NULL)
+                continue;
+
+            b.corpus = &corpora[c];
+            b.outBytes = 0;
+            if (kernel->setup != NULL && kernel->setup(&b) < 0) {
+                fprintf(report, "%-14s %-10s   (cannot run)\n", kernel->name, corpora[c].name);
+                continue;
+            }
+
+            // One pass to warm up, then whole passes for at least minTime
+            kernel->pass(&b);
+            double start = nowSeconds(), elapsed;
+            double bytes = 0;
+            do {
+                bytes += kernel->pass(&b);
+                elapsed = nowSeconds() - start;
+            } while (elapsed < minTime);
+
+            fprintf(report, "%-14s %-10s %9.3f %8.3f", kernel->name, corpora[c].name, elapsed * 1e9 / bytes,
+                    bytes / elapsed / 1e9);
+            if (b.outBytes > 0)
+                fprintf(report, " %7.4f", (double)b.outBytes / corpora[c].size);
+            fprintf(report, "\n");
+            fflush(report);
+
+            free(b.stream);
+            free(b.packetLen);
+            b.stream = NULL;
+            b.packetLen = NULL;
+        }
+    }
+
+    fclose(report);
+    llabort_r(&b.link);
+    for (int i = 0; i < nCorpora; i++)
+        free(corpora[i].data);
+    free(b.out);
+    return 0;
+}
@@ -1,16 +1,21 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates a pair of virtual Tx / Rx serial ports (pseudo-terminals).
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
 
+#include <errno.h>
 #include <fcntl.h>
-#include <math.h>
-#include <sched.h>
+#include <limits.h>
+#include <poll.h>
+#include <pty.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
@@ -19,8 +24,6 @@
 
 #define TXDEV "/dev/ttyS10"
 #define RXDEV "/dev/ttyS11"
-#define TX_EMULATOR "/dev/emulatorTx"
-#define RX_EMULATOR "/dev/emulatorRx"
 
 // Baudrate settings are defined in <asm/termbits.h>, which is
 // included by <termios.h>
@@ -32,60 +35,140 @@
 
 #define BUF_SIZE 2048
 
+// Same range as the serial port code accepts
+#define MIN_BAUDRATE 50
+#define MAX_BAUDRATE 4000000
+
+// Byte times one direction may run ahead of the other in the log
+#define LOG_RING 4096
+
+// One direction of the cable, run by its own thread: every byte time it
+// takes at most one byte from "from" and puts out on "to" the byte taken
+// the propagation delay before. With nothing in flight it sleeps in poll
+// until a byte arrives.
+struct Direction {
+    int from;
+    int to;
+    char *ring;        // Bytes in flight, one slot per byte time
+    char *ringValid;   // TRUE if corresponding entry holds a byte
+    long ringIdx;      // Input index for the ring
+    long inFlight;     // Bytes in the ring
+    long long tick;    // Next byte time to run, counted from par.epoch
+    int active;        // FALSE while idle in poll
+    pthread_t thread;
+};
+
+// What one direction took in and put out in one byte time, half a log line
+struct LogHalf {
+    long long tick;
+    char in[3];
+    char out[3];
+};
+
 // Current running parameters
 struct Parameters {
+    pthread_mutex_t lock; // Held by the direction threads while they run a byte time
     int cableOn;
     double byteER;   // Byte error rate
-    struct timespec byteDelay;
+    unsigned long baud;
+    long long byteDelay;       // ns
+    long long epoch;           // Start of byte time 0 (CLOCK_MONOTONIC ns)
     unsigned long propDelay;   // Desired propagation delay in usec
     int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
+    struct Direction dir[2];   // Tx->Rx, Rx->Tx
+    int stop;
+    int wakeFd;                // Readable once the directions must stop
+    int unreliableRate;
     FILE *logfile;
+    long idleTicks;    // Byte times of the current idle stretch, not logged yet
+    long long logNext; // Next byte time to log
+    long long logLast[2];      // Last byte time each direction has a half line for
+    struct LogHalf logHalves[2][LOG_RING];
 };
 
 struct Parameters par = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
     .cableOn = TRUE,
     .byteER = 0.0,
     .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
     .logfile = NULL};
 
-// Returns: serial port file descriptor (fd).
-int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
+// Set up the slave end "slave" of a new pseudo-terminal pair and link
+// "link" to it; a symlink already there is replaced.
+// Returns 0 on success, -1 on failure
+int linkPtySlave(int slave, const char *link)
 {
-    int fd = open(serialPort, O_RDWR | O_NONBLOCK | O_NOCTTY);
-
-    if (fd < 0)
+    // Raw until the application configures the port, as with a real one
+    struct termios tio;
+    memset(&tio, 0, sizeof(tio));
+    tio.c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
+    tio.c_iflag = IGNPAR;
+    tio.c_oflag = 0;
+    tio.c_lflag = 0;
+    tio.c_cc[VTIME] = 0; // Inter-character timer unused (polling mode)
+    tio.c_cc[VMIN] = 0;  // Read without blocking
+    if (tcsetattr(slave, TCSANOW, &tio) == -1 || fchmod(slave, 0666) == -1)
         return -1;
 
-    // Save current port settings
-    if (tcgetattr(fd, oldtio) == -1)
+    const char *name = ttyname(slave);
+    if (name == NULL)
         return -1;
 
-    memset(newtio, 0, sizeof(*newtio));
-    newtio->c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio->c_iflag = IGNPAR;
-    newtio->c_oflag = 0;
-    newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 0; // Inter-character timer unused (polling mode)
-    newtio->c_cc[VMIN] = 0;  // Read without blocking
-    tcflush(fd, TCIOFLUSH);
+    // Never remove anything but a link, such as one left by a killed cable
+    struct stat st;
+    if (lstat(link, &st) == 0)
+    {
+        if (!S_ISLNK(st.st_mode))
+        {
+            errno = EEXIST;
+            return -1;
+        }
+        if (unlink(link) == -1)
+            return -1;
+    }
+    return symlink(name, link);
+}
+
 
-    if (tcsetattr(fd, TCSANOW, newtio) == -1)
+// Create a pseudo-terminal pair with its slave end, the serial port the
+// application opens, at "link". The slave stays open in "slave" so that
+// the master does not hang up while the application has the port closed.
+// Returns: file descriptor (fd) of the master end, -1 on error.
+int openPtyPair(const char *link, int *slave)
+{
+    int fd;
+    if (openpty(&fd, slave, NULL, NULL, NULL) == -1)
         return -1;
 
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1 || linkPtySlave(*slave, link) == -1)
+    {
+        int err = errno;
+        close(fd);
+        close(*slave);
+        errno = err;
+        return -1;
+    }
     return fd;
 }
 
 
+// Remove the link made by openPtyPair, if it still points to the slave
+void closePtyPair(const char *link, int fd, int slave)
+{
+    char target[PATH_MAX];
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    const char *name = ttyname(slave);
+    if (len > 0 && name != NULL)
+    {
+        target[len] = '\0';
+        if (strcmp(target, name) == 0)
+            unlink(link);
+    }
+    close(fd);
+    close(slave);
+}
+
+
 // Add noise to a buffer, by flipping the byte in the "errorIndex" position.
 void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
 {
@@ -93,110 +176,284 @@ void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
+// Current time (CLOCK_MONOTONIC) in ns
+long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+// Start of byte time "tick". Computed from the epoch rather than by adding
+// byte delays, so that rounding errors do not build up.
+long long tick_deadline(long long tick)
+{
+    // 10 bit times per byte
+    return par.epoch + tick / par.baud * 10000000000LL + tick % par.baud * 10000000000LL / par.baud;
+}
+
+
+// Byte time now running
+long long tick_now(void)
+{
+    long long elapsed = now_ns() - par.epoch;
+    return elapsed / 10000000000LL * par.baud + elapsed % 10000000000LL * par.baud / 10000000000LL;
+}
+
+
+// Initialize the ring buffers that implement the propagation delay, and
+// restart the byte clock. Any pending log lines must have been written.
 // Returns 0 on success, -1 on failure
 int init_ring_buffers(void)
 {
     long nsecPropDelay = 1000 * par.propDelay;
-    long bytesInFlight = nsecPropDelay / par.byteDelay.tv_nsec;
+    long bytesInFlight = nsecPropDelay / par.byteDelay;
     // Round instead of truncating
-    if (nsecPropDelay % par.byteDelay.tv_nsec > par.byteDelay.tv_nsec / 2)
+    if (nsecPropDelay % par.byteDelay > par.byteDelay / 2)
     {
         ++bytesInFlight;
     }
-    long actualPropDelay = bytesInFlight * par.byteDelay.tv_nsec / 1000; // usec
+    long actualPropDelay = bytesInFlight * par.byteDelay / 1000; // usec
     par.bufSize = bytesInFlight + 1;
-    par.tx2rx = realloc(par.tx2rx, par.bufSize);
-    par.tx2rxValid = realloc(par.tx2rxValid, par.bufSize);
-    par.rx2tx = realloc(par.rx2tx, par.bufSize);
-    par.rx2txValid = realloc(par.rx2txValid, par.bufSize);
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+    for (int d = 0; d < 2; d++)
     {
-        return -1;
+        struct Direction *dir = &par.dir[d];
+        dir->ring = realloc(dir->ring, par.bufSize);
+        dir->ringValid = realloc(dir->ringValid, par.bufSize);
+        if (dir->ring == NULL || dir->ringValid == NULL)
+        {
+            return -1;
+        }
+        bzero(dir->ringValid, par.bufSize);
+        dir->ringIdx = 0;
+        dir->inFlight = 0;
+        dir->tick = 0;
+        for (int i = 0; i < LOG_RING; i++)
+        {
+            par.logHalves[d][i].tick = -1;
+        }
+        par.logLast[d] = -1;
     }
-    bzero(par.tx2rxValid, par.bufSize);
-    bzero(par.rx2txValid, par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
+    par.epoch = now_ns();
+    par.logNext = 0;
     printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
     return 0;
 }
 
 
-// Set the byte delay corresponding to the selected baud rate
-void set_baud_rate(unsigned long baud)
+// An idle stretch is logged as a single line with its length in byte times
+// once it is over, so that the log keeps the timing of the transfer.
+void logIdle(void)
 {
-    // 10 bit times per byte; delay in nanoseconds
-    double delay = 1.0e10 / baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
-    printf("BAUD RATE: %lu\n", baud);
-    init_ring_buffers();
+    if (par.logfile != NULL && par.idleTicks > 0)
+    {
+        fprintf(par.logfile, "--------------- %ld\n", par.idleTicks);
+    }
+    par.idleTicks = 0;
 }
 
 
-// Make the program use RT priority to improve precision in timing
-void set_rt_priority(void) {
-    struct sched_param sp = { .sched_priority = 50 };
-    if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
-      perror("Could not set realtime priority");
-    }
+// Half line logged by direction d for byte time "tick", NULL if it had
+// nothing to log
+const struct LogHalf *log_half(int d, long long tick)
+{
+    const struct LogHalf *half = &par.logHalves[d][tick % LOG_RING];
+    return half->tick == tick ? half : NULL;
 }
 
 
-// Compute the difference between two timespecs
-struct timespec timespec_diff(const struct timespec *t2, const struct timespec *t1)
+// Write the log lines of the byte times before "limit", by which both
+// directions are done with them.
+void log_flush(long long limit)
 {
-    struct timespec diff = { .tv_sec = t2->tv_sec - t1->tv_sec,
-                             .tv_nsec = t2->tv_nsec - t1->tv_nsec };
-    if (diff.tv_nsec < 0) {
-        diff.tv_nsec += 1000000000;
-        --diff.tv_sec;
+    if (par.logfile == NULL)
+    {
+        return;
+    }
+    for (; par.logNext < limit; par.logNext++)
+    {
+        if (par.logNext > par.logLast[0] && par.logNext > par.logLast[1])
+        {
+            // Nothing more to log, the rest is idle
+            par.idleTicks += limit - par.logNext;
+            par.logNext = limit;
+            break;
+        }
+        const struct LogHalf *tx2rx = log_half(0, par.logNext);
+        const struct LogHalf *rx2tx = log_half(1, par.logNext);
+        if (tx2rx == NULL && rx2tx == NULL)
+        {
+            par.idleTicks++;
+        }
+        else
+        {
+            logIdle();
+            fprintf(par.logfile, "%s  %s | %s  %s\n",
+                    tx2rx != NULL ? tx2rx->in : "  ", tx2rx != NULL ? tx2rx->out : "  ",
+                    rx2tx != NULL ? rx2tx->in : "  ", rx2tx != NULL ? rx2tx->out : "  ");
+        }
     }
-    return diff;
 }
 
 
-// Compute the sum of two timespecs
-struct timespec timespec_sum(const struct timespec *t1, const struct timespec *t2)
+// First byte time a direction may still log: the next one of the slower
+// running direction, or the current one if both are idle.
+long long log_limit(void)
 {
-    struct timespec sum = { .tv_sec = t1->tv_sec + t2->tv_sec,
-                             .tv_nsec = t1->tv_nsec + t2->tv_nsec };
-    if (sum.tv_nsec >= 1000000000) {
-        sum.tv_nsec -= 1000000000;
-        ++sum.tv_sec;
+    long long limit = LLONG_MAX;
+    for (int d = 0; d < 2; d++)
+    {
+        if (par.dir[d].active && par.dir[d].tick < limit)
+        {
+            limit = par.dir[d].tick;
+        }
     }
-    return sum;
+    return limit != LLONG_MAX ? limit : tick_now();
 }
 
 
-// Compare two timespecs returning -1, 0 or 1 if t1 is less than, equal or
-// greater than t2, respectively
-int timespec_comp(const struct timespec *t1, const struct timespec *t2)
+// Set the byte delay corresponding to the selected baud rate
+void set_baud_rate(unsigned long baud)
 {
-    if (t1->tv_sec < t2->tv_sec) {
-        return -1;
+    // Log what went by at the old rate
+    log_flush(log_limit());
+    par.baud = baud;
+    // 10 bit times per byte; delay in nanoseconds
+    par.byteDelay = 10000000000LL / baud;
+    printf("BAUD RATE: %lu\n", baud);
+    if (par.logfile != NULL)
+    {
+        logIdle();
+        fprintf(par.logfile, "BAUD RATE: %lu\n", baud);
     }
-    else if (t1->tv_sec > t2->tv_sec) {
-        return 1;
+    init_ring_buffers();
+}
+
+
+// Run byte time dir->tick of direction d: take in at most one byte and put
+// out the one taken in the propagation delay before.
+// Returns TRUE if the direction has nothing left to do until more input.
+int run_tick(int d)
+{
+    struct Direction *dir = &par.dir[d];
+    struct LogHalf half = { .tick = dir->tick, .in = "  ", .out = "  " };
+
+    int bytesIn = read(dir->from, dir->ring + dir->ringIdx, 1);
+    // Ignore what was read if the cable is off
+    dir->ringValid[dir->ringIdx] = bytesIn > 0 && par.cableOn;
+    if (dir->ringValid[dir->ringIdx])
+    {
+        dir->inFlight++;
+        sprintf(half.in, "%02hhX", dir->ring[dir->ringIdx]);
     }
-    else if (t1->tv_nsec < t2->tv_nsec) {
-        return -1;
+
+    // Advance index to next position
+    dir->ringIdx = (dir->ringIdx + 1) % par.bufSize;
+
+    if (dir->ringValid[dir->ringIdx])
+    {
+        dir->ringValid[dir->ringIdx] = FALSE;
+        dir->inFlight--;
+        if (par.cableOn)
+        {
+            // Add error, if applicable
+            if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
+            {
+                // At most one wrong bit per byte, good enough if ber < 0.02
+                dir->ring[dir->ringIdx] ^= (char) 1 << rand() % 8;
+            }
+            write(dir->to, dir->ring + dir->ringIdx, 1);
+        }
+        sprintf(half.out, "%02hhX", dir->ring[dir->ringIdx]);
     }
-    else if (t1->tv_nsec > t2->tv_nsec) {
-        return 1;
+
+    if (par.logfile != NULL && (*half.in != ' ' || *half.out != ' '))
+    {
+        // Make room if the other direction fell that far behind
+        if (dir->tick - par.logNext >= LOG_RING)
+        {
+            log_flush(dir->tick - LOG_RING + 1);
+        }
+        if (dir->tick >= par.logNext)
+        {
+            par.logHalves[d][dir->tick % LOG_RING] = half;
+            par.logLast[d] = dir->tick;
+        }
     }
-    return 0;
+
+    dir->tick++;
+    log_flush(log_limit());
+    return bytesIn <= 0 && dir->inFlight == 0;
+}
+
+
+// Sleep until input arrives on a direction or the cable stops
+void wait_for_input(const struct Direction *dir)
+{
+    struct pollfd fds[2] = { { .fd = dir->from, .events = POLLIN },
+                             { .fd = par.wakeFd, .events = POLLIN } };
+    poll(fds, 2, -1);
 }
 
 
-int timespec_is_negative(const struct timespec *t)
+// Thread running one direction of the cable. Byte times are kept with
+// absolute deadlines on the monotonic clock, so a late wakeup is made up
+// for on the next byte instead of slowing the line down.
+void *run_direction(void *arg)
 {
-    if (t->tv_sec < 0 || t->tv_nsec < 0)
+    int d = *(int *) arg;
+    struct Direction *dir = &par.dir[d];
+
+    pthread_mutex_lock(&par.lock);
+    while (!par.stop)
     {
-        return TRUE;
+        if (!dir->active)
+        {
+            pthread_mutex_unlock(&par.lock);
+            wait_for_input(dir);
+            pthread_mutex_lock(&par.lock);
+            if (par.stop)
+            {
+                break;
+            }
+            // Log the idle stretch, and start at the current byte time
+            log_flush(log_limit());
+            long long tick = tick_now();
+            if (tick < par.logNext)
+            {
+                tick = par.logNext;
+            }
+            if (tick > dir->tick)
+            {
+                dir->tick = tick;
+            }
+            dir->active = TRUE;
+        }
+
+        if (now_ns() - tick_deadline(dir->tick) >= 1000000000LL && par.unreliableRate == FALSE)
+        {
+            printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
+                   "No further warnings will be issued\n");
+            par.unreliableRate = TRUE;
+        }
+
+        if (run_tick(d))
+        {
+            dir->active = FALSE;
+            continue;
+        }
+
+        long long deadline = tick_deadline(dir->tick);
+        pthread_mutex_unlock(&par.lock);
+        struct timespec ts = { .tv_sec = deadline / 1000000000LL, .tv_nsec = deadline % 1000000000LL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        {
+        }
+        pthread_mutex_lock(&par.lock);
     }
-    return FALSE;
+    pthread_mutex_unlock(&par.lock);
+    return NULL;
 }
 
 
@@ -204,6 +461,8 @@ void endlog(void)
 {
     if (par.logfile != NULL)
     {
+        log_flush(log_limit());
+        logIdle();
         fclose(par.logfile);
         par.logfile = NULL;
     }
@@ -217,6 +476,9 @@ void startlog(const char *filename)
     if (par.logfile != NULL)
     {
         fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
+        fprintf(par.logfile, "BAUD RATE: %lu\n", par.baud);
+        par.idleTicks = 0;
+        par.logNext = tick_now();
         printf("LOGGING TO FILE %s\n", filename);
     }
     else
@@ -227,18 +489,18 @@ void startlog(const char *filename)
 
 
 // Show help
-void help()
+void help(const char *txDev, const char *rxDev)
 {
     printf("\n\n"
-           "Transmitter must open " TXDEV "\n"
-           "Receiver must open " RXDEV "\n"
+           "Transmitter must open %s\n"
+           "Receiver must open %s\n"
            "\n"
            "The cable program is sensible to the following interactive commands:\n"
            "--- help         : show this help\n"
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
            "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
+           "--- baud <rate>  : set baud rate, between 50 and 4000000 (default=9600)\n"
            "                   note that 10 bits are sent per byte (8-N-1)\n"
            "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
            "                   will be approximated to an integer multiple of the byte\n"
@@ -249,48 +511,50 @@ void help()
            "\n"
            "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
            "           ongoing will result in losses.\n"
-           "\n");
+           "\n", txDev, rxDev);
 }
 
 int main(int argc, char *argv[])
 {
-    printf("\n");
-
-    system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=" TX_EMULATOR ",mode=777,raw,echo=0 &");
-    sleep(1);
-    printf("\n");
-
-    system("socat -dd PTY,link=" RXDEV ",mode=777,raw,echo=0 PTY,link=" RX_EMULATOR ",mode=777,raw,echo=0 &");
-    sleep(1);
-
-    help();
-
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
+    if (argc != 1 && argc != 3)
+    {
+        printf("Usage: %s [<TxSerialPort> <RxSerialPort>]\n"
+               "  The serial ports are created as links to pseudo-terminals\n"
+               "  (default " TXDEV " " RXDEV ")\n", argv[0]);
+        exit(1);
+    }
+    const char *txDev = argc == 3 ? argv[1] : TXDEV;
+    const char *rxDev = argc == 3 ? argv[2] : RXDEV;
 
-    int fdTx = openSerialPort(TX_EMULATOR, &oldtioTx, &newtioTx);
+    // Create serial ports
+    int slaveTx;
+    int fdTx = openPtyPair(txDev, &slaveTx);
 
     if (fdTx < 0)
     {
-        perror("Opening Tx emulator serial port");
+        perror(txDev);
         exit(-1);
     }
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
-
-    int fdRx = openSerialPort(RX_EMULATOR, &oldtioRx, &newtioRx);
+    int slaveRx;
+    int fdRx = openPtyPair(rxDev, &slaveRx);
 
     if (fdRx < 0)
     {
-        perror("Opening Rx emulator serial port");
+        perror(rxDev);
+        closePtyPair(txDev, fdTx, slaveTx);
         exit(-1);
     }
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+    help(txDev, rxDev);
+
+    // Wakes the directions up from poll when the program ends
+    par.wakeFd = eventfd(0, 0);
+    if (par.wakeFd < 0)
+    {
+        perror("eventfd");
+        exit(-1);
+    }
 
     char rxStdin[BUF_SIZE] = {0};
 
@@ -298,264 +562,136 @@ int main(int argc, char *argv[])
 
     set_baud_rate(DEFAULT_BAUDRATE);
 
-    set_rt_priority();
-
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
-
-    printf("\nCable ready\n\n");
-
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
-
-    while (STOP == FALSE)
+    // Tx->Rx and Rx->Tx
+    static int dirIndex[2] = {0, 1};
+    par.dir[0].from = fdTx;
+    par.dir[0].to = fdRx;
+    par.dir[1].from = fdRx;
+    par.dir[1].to = fdTx;
+    for (int d = 0; d < 2; d++)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
-        {
-            if (unreliableRate == FALSE)
-            {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
-            }
-        }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
+        if (pthread_create(&par.dir[d].thread, NULL, run_direction, &dirIndex[d]) != 0)
         {
-            skipWait = TRUE;
+            perror("pthread_create");
+            exit(-1);
         }
-        else
-        {
-            skipWait = FALSE;
-        }
-
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
+    }
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
+    printf("\nCable ready\n\n");
 
-        if (!par.cableOn)
-        {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
-        }
+    // Read commands from STDIN to control the cable mode
+    while (STOP == FALSE && fgets(rxStdin, BUF_SIZE, stdin) != NULL)
+    {
+        rxStdin[strcspn(rxStdin, "\n")] = '\0';
 
-        if (par.logfile != NULL)  // Currently logging
+        pthread_mutex_lock(&par.lock);
+        if (strcmp(rxStdin, "off") == 0)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxTx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
+            printf("CONNECTION OFF\n");
+            if (par.cableOn && par.logfile != NULL)
             {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
+                log_flush(log_limit());
+                logIdle();
+                fputs("CABLE OFF\n", par.logfile);
             }
-            else
+            par.cableOn = FALSE;
+        }
+        else if (strcmp(rxStdin, "on") == 0)
+        {
+            printf("CONNECTION ON\n");
+            if (!par.cableOn && par.logfile != NULL)
             {
-                memcpy(rx2txTx, "  ", 3);
+                log_flush(log_limit());
+                logIdle();
+                fputs("CABLE ON\n", par.logfile);
             }
+            par.cableOn = TRUE;
         }
-
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
-
-        if (par.cableOn)
+        else if (strncmp(rxStdin, "ber ", 4) == 0)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
+            double ber;
+            sscanf(rxStdin + 4, "%lf", &ber);
+            // Compute pow(1 - ber, 8) without libm
+            double acc = 1 - ber;
+            acc *= acc;   // Squared
+            acc *= acc;   // To the fourth
+            acc *= acc;   // To the eighth
+            par.byteER = 1.0 - acc;
+            //printf("Byte Error Rate is %lf\n", par.byteER);
+            if (ber >= 0.0 && ber < 1.0)
             {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
+                printf("BER SET TO %lf\n", ber);
+                if (ber > 0.01)
                 {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
+                    printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
                 }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
             }
-
-            if (par.rx2txValid[par.rx2txIdx])
+            else
             {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
+                printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
             }
         }
-
-        if (par.logfile != NULL)  // Currently logging
+        else if (strncmp(rxStdin, "baud ", 5) == 0)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
+            unsigned long baud = 0;
+            sscanf(rxStdin + 5, "%lu", &baud);
+            if (baud >= MIN_BAUDRATE && baud <= MAX_BAUDRATE)
+                set_baud_rate(baud);
             else
+                printf("UNSUPPORTED BAUD RATE: must be between %d and %d\n", MIN_BAUDRATE, MAX_BAUDRATE);
+        }
+        else if (strncmp(rxStdin, "prop ", 5) == 0)
+        {
+            unsigned long propDelay;
+            if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
             {
-                memcpy(tx2rxRx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txRx, "  ", 3);
-            }
-
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
-            {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
+                printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
             }
             else
             {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
+                log_flush(log_limit());
+                par.propDelay = propDelay;
+                init_ring_buffers();
             }
         }
-
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
+        else if (strncmp(rxStdin, "log ", 4) == 0)
         {
-            rxStdin[fromStdin - 1] = '\0';
-
-            if (strcmp(rxStdin, "off") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
-                {
-                    fputs("CABLE OFF\n", par.logfile);
-                }
-                par.cableOn = FALSE;
-            }
-            else if (strcmp(rxStdin, "on") == 0)
-            {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
-            }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
-            {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eighth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
-                {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
-                    {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
-                    }
-                }
-                else
-                {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
-                }
-            }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
-            {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
-                }
-            }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
-            {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
-                {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
-                }
-                else
-                {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
-                }
-            }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
-            {
-                startlog(rxStdin + 4);
-            }
-            else if (strcmp(rxStdin, "endlog") == 0)
-            {
-                endlog();
-                printf("NOT LOGGING\n");
-            }
-            else if (strcmp(rxStdin, "quit") == 0)
-            {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
-            }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
-            }
+            startlog(rxStdin + 4);
         }
-
-        if (skipWait == FALSE) {
-            nanosleep(&nextWait, NULL);
+        else if (strcmp(rxStdin, "endlog") == 0)
+        {
+            endlog();
+            printf("NOT LOGGING\n");
+        }
+        else if (strcmp(rxStdin, "quit") == 0)
+        {
+            endlog();
+            printf("END OF THE PROGRAM\n");
+            STOP = TRUE;
+            par.stop = TRUE;
         }
+        else if (strcmp(rxStdin, "help") == 0) {
+            help(txDev, rxDev);
+        }
+        else {
+            printf("BAD COMMAND OR MISSING PARAMETERS\n");
+        }
+        pthread_mutex_unlock(&par.lock);
     }
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+    // Without commands (end of input) the cable runs until killed
+    uint64_t wake = 1;
+    if (STOP == TRUE)
     {
-        perror("tcsetattr");
-        exit(-1);
+        write(par.wakeFd, &wake, sizeof(wake));
     }
-
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
+    for (int d = 0; d < 2; d++)
     {
-        perror("tcsetattr");
-        exit(-1);
+        pthread_join(par.dir[d].thread, NULL);
     }
 
-    close(fdTx);
-    close(fdRx);
-
-    system("killall socat");
+    closePtyPair(txDev, fdTx, slaveTx);
+    closePtyPair(rxDev, fdRx, slaveRx);
 
     return 0;
 }
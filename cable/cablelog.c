@@ -0,0 +1,545 @@
+// Analyzer for the logs written by the virtual cable ("log <file>").
+// Rebuilds the frames sent in each direction from the hex columns, classifies
+// them, finds retransmissions and frames corrupted on the line, and reports
+// how busy the line was, how long acks took and where the time went.
+//
+// Usage: cablelog [-b baudrate] [-v] logfile
+
+#include "link_frame.h"
+#include "link_layer.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_BAUDRATE 9600 // For logs that do not say
+
+#define MAX_FRAME (MAX_INFO_SIZE + 5) // A, C, BCC1, largest information field, FCS
+
+enum
+{
+    K_SET,
+    K_UA,
+    K_DISC,
+    K_RR,
+    K_REJ,
+    K_I,
+    K_OTHER,
+    K_COUNT
+};
+
+static const char *kindNames[K_COUNT] = {"SET", "UA", "DISC", "RR", "REJ", "I", "?"};
+
+// Where the time of the Tx->Rx line went
+enum
+{
+    T_NEW,     // New I-frames on the line
+    T_RETX,    // Retransmitted I-frames
+    T_CONTROL, // SET, DISC, UA
+    T_ACK,     // Waiting for the answer to an I-frame
+    T_TIMEOUT, // Waiting for a timer before sending the same frame again
+    T_IDLE,    // Any other gap
+    T_COUNT
+};
+
+static const char *timeNames[T_COUNT] = {"new I-frames", "retransmitted I-frames", "SET/DISC/UA",
+                                         "waiting for acks", "waiting for timeouts", "other idle"};
+
+// A frame rebuilt from one column
+typedef struct
+{
+    int kind;
+    bool valid; // BCC1 and FCS check
+    int ns;     // I, RR and REJ
+    int dataLen;
+    unsigned long long hash; // Of the information field, to spot retransmissions
+    double start;            // Opening flag
+    double end;              // End of the closing flag
+} Frame;
+
+typedef struct
+{
+    bool synced; // Seen a flag
+    bool esc;
+    bool badEscape;
+    bool cobs; // Past the header of a COBS I-frame: bytes are stored as sent
+    unsigned char buf[MAX_FRAME];
+    int len;
+    bool overflow;
+    double start;
+} Deframer;
+
+typedef struct
+{
+    unsigned long count;
+    double sum;
+    double min;
+    double max;
+} Stat;
+
+// One direction of the cable: what the sender wrote and what the other
+// end received (after noise)
+typedef struct
+{
+    const char *name;
+    Deframer sent;
+    Deframer delivered;
+    unsigned long frames[K_COUNT];
+    unsigned long retransmissions; // I-frames sent again
+    unsigned long retries;         // SET and DISC sent again
+    unsigned long corrupted;       // Frames that arrived damaged
+    unsigned long lineBytes;
+    unsigned long long payload;    // Information bytes of new I-frames
+    double busy;                   // Time with frames on the line
+    Frame last;                    // Last frame sent
+    bool haveLast;
+    Frame lastI;                   // Last I-frame sent
+    bool haveLastI;
+    Stat newFrameTime;             // Airtime of new I-frames
+    Stat ackFrameTime;             // Airtime of RR/REJ
+} Direction;
+
+static struct
+{
+    double tick; // Seconds per byte time
+    bool verbose;
+    bool idleUnknown; // Log from a cable that did not count idle byte times
+    double now;
+    double first; // First byte on the line, -1 before
+    double last;  // End of the last frame seen
+    Direction dir[2];
+    double times[T_COUNT];
+    // Answers of the receiver
+    double iDeliveredAt; // End of the last I-frame delivered, -1 once answered
+    double iSentAt;      // End of the last I-frame sent, -1 once acknowledged
+    bool rejSinceLastI;  // A REJ arrived since the last I-frame was sent
+    Stat turnaround;     // I-frame delivered -> RR/REJ starts
+    Stat roundTrip;      // I-frame sent -> RR/REJ delivered
+    Stat gaps;           // Idle gaps on the Tx->Rx line
+    double prop;         // First byte sent to first byte delivered, -1 before
+    unsigned long cableOff;
+} an = {.first = -1, .iDeliveredAt = -1, .iSentAt = -1, .prop = -1};
+
+static void statAdd(Stat *s, double v)
+{
+    if (s->count == 0 || v < s->min)
+        s->min = v;
+    if (s->count == 0 || v > s->max)
+        s->max = v;
+    s->sum += v;
+    s->count++;
+}
+
+static double statAvg(const Stat *s)
+{
+    return s->count > 0 ? s->sum / s->count : 0;
+}
+
+static void printStat(const char *name, const Stat *s)
+{
+    if (s->count == 0)
+        printf("%-32s -\n", name);
+    else
+        printf("%-32s n=%lu  min %.2f  avg %.2f  max %.2f ms\n", name, s->count, s->min * 1e3,
+               statAvg(s) * 1e3, s->max * 1e3);
+}
+
+// Undo the COBS encoding of the data field of d into out (header included).
+// Returns the frame length, or -1 if the encoding is broken.
+static int cobsDecode(const Deframer *d, unsigned char *out)
+{
+    memcpy(out, d->buf, 3);
+    int len = decodeCobs(out + 3, d->buf + 3, d->len - 3);
+    return len < 0 ? -1 : len + 3;
+}
+
+// Make sense of a destuffed frame (A C BCC1 [data FCS])
+static void classify(const Deframer *d, Frame *f)
+{
+    static unsigned char decoded[MAX_FRAME];
+    const unsigned char *b = d->buf;
+    int len = d->len;
+    bool broken = false;
+    if (d->cobs)
+    {
+        len = cobsDecode(d, decoded);
+        b = decoded;
+        broken = len < 0;
+        if (broken)
+            len = 3;
+    }
+    memset(f, 0, sizeof(*f));
+    f->kind = K_OTHER;
+    f->ns = -1;
+    if (len < 3 || d->overflow)
+        return;
+
+    unsigned char C = b[1];
+    bool header = (b[0] ^ C) == b[2] && !d->badEscape && !broken;
+    if (C == C1) f->kind = K_SET;
+    else if (C == C2) f->kind = K_UA;
+    else if (C == DISC) f->kind = K_DISC;
+    else if (C == C_RR(0) || C == C_RR(1)) f->kind = K_RR, f->ns = C >> 7;
+    else if (C == C_REJ(0) || C == C_REJ(1)) f->kind = K_REJ, f->ns = C >> 7;
+    else if ((C & ~(C_I_NS | C_I_CRC | C_I_COBS)) == 0) f->kind = K_I, f->ns = (C & C_I_NS) != 0;
+
+    // Data, if any, is followed by BCC2 or a CRC-16 (I-frames marked so)
+    int fcsLen = f->kind == K_I && (C & C_I_CRC) ? 2 : 1;
+    bool fcs = true;
+    if (len > 3)
+    {
+        f->dataLen = len - 3 - fcsLen;
+        if (f->dataLen < 0)
+        {
+            f->dataLen = 0;
+            fcs = false;
+        }
+        else if (fcsLen == 2)
+        {
+            fcs = crc16(b + 3, f->dataLen) == (b[len - 2] << 8 | b[len - 1]);
+        }
+        else
+        {
+            unsigned char bcc = 0;
+            for (int i = 0; i < f->dataLen; i++)
+                bcc ^= b[3 + i];
+            fcs = bcc == b[len - 1];
+        }
+    }
+    f->valid = header && fcs && (f->kind != K_I || len > 3) && f->kind != K_OTHER;
+
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 3; i < len; i++)
+        h = (h ^ b[i]) * 1099511628211ULL;
+    f->hash = h;
+}
+
+static void frameSent(int which, Frame *f)
+{
+    Direction *dir = &an.dir[which];
+    double airtime = f->end - f->start;
+    dir->frames[f->kind]++;
+    dir->busy += airtime;
+
+    bool repeat = false;
+    if (f->kind == K_I)
+    {
+        repeat = dir->haveLastI && dir->lastI.ns == f->ns && dir->lastI.hash == f->hash;
+        if (repeat)
+            dir->retransmissions++;
+        else
+        {
+            dir->payload += f->dataLen;
+            statAdd(&dir->newFrameTime, airtime);
+        }
+    }
+    else if ((f->kind == K_SET || f->kind == K_DISC) && dir->haveLast && dir->last.kind == f->kind)
+    {
+        repeat = true;
+        dir->retries++;
+    }
+    else if (f->kind == K_RR || f->kind == K_REJ)
+    {
+        statAdd(&dir->ackFrameTime, airtime);
+    }
+
+    if (which == 0)
+    {
+        // Tx->Rx: the gap since the previous frame, then the frame itself
+        if (dir->haveLast)
+        {
+            double gap = f->start - dir->last.end;
+            if (gap > 0)
+            {
+                statAdd(&an.gaps, gap);
+                int cause = T_IDLE;
+                if (dir->last.kind == K_I)
+                    cause = repeat && !an.rejSinceLastI ? T_TIMEOUT : T_ACK;
+                else if (repeat)
+                    cause = T_TIMEOUT;
+                an.times[cause] += gap;
+            }
+        }
+        an.times[f->kind == K_I ? (repeat ? T_RETX : T_NEW) : T_CONTROL] += airtime;
+        if (f->kind == K_I)
+        {
+            an.iSentAt = f->end;
+            an.rejSinceLastI = false;
+        }
+    }
+    else if ((f->kind == K_RR || f->kind == K_REJ) && an.iDeliveredAt >= 0)
+    {
+        // Rx->Tx: how long the receiver took to answer
+        statAdd(&an.turnaround, f->start - an.iDeliveredAt);
+        an.iDeliveredAt = -1;
+    }
+
+    if (an.verbose)
+    {
+        printf("%10.4f  %s  sent       %-4s", f->start, dir->name, kindNames[f->kind]);
+        if (f->ns >= 0)
+            printf(" %d", f->ns);
+        if (f->dataLen > 0)
+            printf("  %5d bytes", f->dataLen);
+        printf("%s\n", f->kind == K_I && repeat ? "  (retransmission)" : repeat ? "  (retry)" : "");
+    }
+
+    if (f->kind == K_I)
+    {
+        dir->lastI = *f;
+        dir->haveLastI = true;
+    }
+    dir->last = *f;
+    dir->haveLast = true;
+}
+
+static void frameDelivered(int which, Frame *f)
+{
+    Direction *dir = &an.dir[which];
+    if (!f->valid)
+    {
+        dir->corrupted++;
+        if (an.verbose)
+            printf("%10.4f  %s  corrupted  %-4s\n", f->start, dir->name, kindNames[f->kind]);
+    }
+
+    if (which == 0 && f->kind == K_I)
+    {
+        an.iDeliveredAt = f->end;
+    }
+    else if (which == 1 && f->valid && (f->kind == K_RR || f->kind == K_REJ))
+    {
+        if (f->kind == K_REJ)
+            an.rejSinceLastI = true;
+        if (an.iSentAt >= 0)
+        {
+            statAdd(&an.roundTrip, f->end - an.iSentAt);
+            an.iSentAt = -1;
+        }
+    }
+}
+
+// Feed one byte of a column; delivered selects what the far end received
+static void deframe(int which, bool delivered, unsigned char byte)
+{
+    Deframer *d = delivered ? &an.dir[which].delivered : &an.dir[which].sent;
+
+    if (byte == FLAG)
+    {
+        if (d->synced && d->len > 0)
+        {
+            Frame f;
+            classify(d, &f);
+            f.start = d->start;
+            f.end = an.now + an.tick;
+            if (delivered)
+                frameDelivered(which, &f);
+            else
+                frameSent(which, &f);
+            if (f.end > an.last)
+                an.last = f.end;
+        }
+        d->synced = true;
+        d->esc = d->badEscape = d->overflow = d->cobs = false;
+        d->len = 0;
+        d->start = an.now;
+        return;
+    }
+
+    if (!d->synced)
+        return;
+    if (d->cobs)
+    {
+        // Decoded once the frame is complete
+    }
+    else if (d->esc)
+    {
+        if (byte != (FLAG ^ 0x20) && byte != (ESC ^ 0x20))
+            d->badEscape = true;
+        byte ^= 0x20;
+        d->esc = false;
+    }
+    else if (byte == ESC)
+    {
+        d->esc = true;
+        return;
+    }
+
+    if (d->len < MAX_FRAME)
+        d->buf[d->len++] = byte;
+    else
+        d->overflow = true;
+
+    if (d->len == 3 && (d->buf[1] & ~(C_I_NS | C_I_CRC | C_I_COBS)) == 0 && (d->buf[1] & C_I_COBS) &&
+        (d->buf[0] ^ d->buf[1]) == d->buf[2])
+        d->cobs = true;
+}
+
+// "XX" or blank
+static int parseByte(const char *s)
+{
+    unsigned int v;
+    if (s[0] == ' ' || sscanf(s, "%2x", &v) != 1)
+        return -1;
+    return v;
+}
+
+static void printReport(const char *filename)
+{
+    Direction *tx = &an.dir[0], *rx = &an.dir[1];
+    double duration = an.first >= 0 ? an.last - an.first : 0;
+
+    printf("%s: %.3f s from the first byte to the end of the last frame\n", filename, duration);
+    if (an.idleUnknown)
+        printf("Note: this cable did not record the length of idle periods; times and gaps leave them out\n");
+    if (an.cableOff > 0)
+        printf("Cable unplugged %lu time(s)\n", an.cableOff);
+    if (an.prop >= 0)
+        printf("Propagation delay: %.2f ms\n", an.prop * 1e3);
+
+    printf("\n%-32s %12s %12s\n", "", tx->name, rx->name);
+    for (int k = 0; k < K_COUNT; k++)
+        if (tx->frames[k] > 0 || rx->frames[k] > 0)
+            printf("%-32s %12lu %12lu\n", kindNames[k], tx->frames[k], rx->frames[k]);
+    printf("%-32s %12lu %12lu\n", "I-frames retransmitted", tx->retransmissions, rx->retransmissions);
+    printf("%-32s %12lu %12lu\n", "SET/DISC retried", tx->retries, rx->retries);
+    printf("%-32s %12lu %12lu\n", "Frames corrupted on the line", tx->corrupted, rx->corrupted);
+    printf("%-32s %12lu %12lu\n", "Bytes on the line", tx->lineBytes, rx->lineBytes);
+    if (duration > 0)
+        printf("%-32s %11.1f%% %11.1f%%\n", "Line utilization", 100 * tx->busy / duration,
+               100 * rx->busy / duration);
+
+    printf("\n");
+    printStat("Ack turnaround at the receiver", &an.turnaround);
+    printStat("Ack round trip at the sender", &an.roundTrip);
+    printStat("Idle gaps on Tx->Rx", &an.gaps);
+
+    if (duration <= 0)
+        return;
+    printf("\nWhere the time went (Tx->Rx line):\n");
+    for (int t = 0; t < T_COUNT; t++)
+        printf("  %-30s %10.3f s %6.1f%%\n", timeNames[t], an.times[t], 100 * an.times[t] / duration);
+
+    // Payload airtime over the whole transfer, against what stop-and-wait
+    // could reach with these frames and this line
+    double payloadTime = tx->payload * an.tick;
+    printf("\nEfficiency: %.1f%% (%llu payload bytes in %.3f s)\n", 100 * payloadTime / duration, tx->payload,
+           duration);
+    if (tx->newFrameTime.count > 0 && tx->payload > 0)
+    {
+        double frame = statAvg(&tx->newFrameTime);
+        double ack = statAvg(&rx->ackFrameTime);
+        double prop = an.prop >= 0 ? an.prop : 0;
+        double useful = payloadTime / tx->newFrameTime.count;
+        double bound = useful / (frame + ack + 2 * prop + statAvg(&an.turnaround));
+        printf("Stop-and-wait bound with these frames: %.1f%% (%.1f ms per frame, %.1f ms per ack)\n",
+               100 * bound, frame * 1e3, ack * 1e3);
+    }
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-b baudrate] [-v] logfile\n"
+           "  -b  baud rate of the cable, for logs that do not record it (default %d)\n"
+           "  -v  list every frame\n",
+           prog, DEFAULT_BAUDRATE);
+}
+
+int main(int argc, char *argv[])
+{
+    long baud = DEFAULT_BAUDRATE;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:vh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            baud = atol(optarg);
+            break;
+        case 'v':
+            an.verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1 || baud <= 0)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    FILE *log = fopen(argv[optind], "r");
+    if (log == NULL)
+    {
+        perror(argv[optind]);
+        exit(1);
+    }
+
+    an.tick = 10.0 / baud;
+    an.dir[0].name = "Tx->Rx";
+    an.dir[1].name = "Rx->Tx";
+
+    char line[256];
+    while (fgets(line, sizeof(line), log) != NULL)
+    {
+        long n;
+        if (strncmp(line, "Tx->Rx", 6) == 0)
+            continue;
+        if (sscanf(line, "BAUD RATE: %ld", &n) == 1 && n > 0)
+        {
+            an.tick = 10.0 / n;
+            continue;
+        }
+        if (strncmp(line, "CABLE OFF", 9) == 0)
+        {
+            an.cableOff++;
+            continue;
+        }
+        if (strncmp(line, "CABLE ON", 8) == 0)
+            continue;
+        if (strncmp(line, "---", 3) == 0)
+        {
+            // "--------------- N": N byte times with nothing on the line
+            if (sscanf(line, "%*[-] %ld", &n) == 1)
+                an.now += n * an.tick;
+            else
+            {
+                an.now += an.tick;
+                an.idleUnknown = true;
+            }
+            continue;
+        }
+        if (strlen(line) < 15 || line[7] != '|')
+            continue;
+
+        // "SS  DD | SS  DD": sent and delivered, in each direction
+        int bytes[4] = {parseByte(line), parseByte(line + 4), parseByte(line + 9), parseByte(line + 13)};
+        for (int i = 0; i < 4; i++)
+        {
+            if (bytes[i] < 0)
+                continue;
+            int which = i / 2;
+            bool delivered = i % 2 == 1;
+            if (!delivered)
+            {
+                an.dir[which].lineBytes++;
+                if (an.first < 0)
+                    an.first = an.now;
+            }
+            else if (an.prop < 0 && an.first >= 0)
+            {
+                an.prop = an.now - an.first;
+            }
+            deframe(which, delivered, bytes[i]);
+        }
+        an.now += an.tick;
+    }
+    fclose(log);
+
+    printReport(argv[optind]);
+    return 0;
+}
@@ -0,0 +1,324 @@
+// Multi-port receiver daemon.
+// Watches a set of serial ports with epoll and receives files on all of them
+// at once, in a single process. Every session (SET ... DISC/UA) gets its own
+// output directory, named after the port, the start time and a counter.
+//
+// Usage: rxd [-b baudrate] [-o outdir] [-i idle_timeout] [-f frame_size] [-l] port...
+
+#include "link_layer.h"
+#include "packet_helper.h"
+#include "serial_port.h"
+#include "sparse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PORTS 256
+#define READ_CHUNK 4096
+#define DEFAULT_OUTDIR "received"
+#define DEFAULT_IDLE_TIMEOUT 30 // seconds without traffic before a session is dropped
+
+typedef struct
+{
+    LinkContext link;
+    const char *name;       // Port name without the directory
+    bool active;            // Between SET and the final UA (or idle timeout)
+    unsigned sessionCount;
+    char dir[512];          // Output directory of the current session
+    FILE *out;
+    uint64_t fileSize;
+    uint64_t bytesReceived;
+    Sha256 digest;          // Of the bytes received so far
+    char filename[MAX_FILENAME_SIZE + 1];
+    time_t lastActivity;
+    unsigned char *packet;  // Data of the frame being received, as large as the frames offered
+} Session;
+
+static volatile sig_atomic_t stop = FALSE;
+
+static void onSignal(int signo)
+{
+    (void)signo;
+    stop = TRUE;
+}
+
+// Keep only the last path component of a name announced by the peer.
+static const char *safeName(const char *name)
+{
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    if (*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0)
+        return "received.bin";
+    return base;
+}
+
+static void sessionStart(Session *s, const char *outdir)
+{
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+    s->sessionCount++;
+    snprintf(s->dir, sizeof(s->dir), "%s/%s-%s-%u", outdir, s->name, stamp, s->sessionCount);
+    if (mkdir(s->dir, 0755) == -1 && errno != EEXIST)
+        perror(s->dir);
+
+    s->active = TRUE;
+    s->out = NULL;
+    s->fileSize = 0;
+    s->bytesReceived = 0;
+    s->filename[0] = '\0';
+    printf("[rxd] %s: session %u started, output in %s\n", s->name, s->sessionCount, s->dir);
+}
+
+static void sessionEnd(Session *s, const char *reason)
+{
+    if (s->out != NULL) {
+        fclose(s->out);
+        s->out = NULL;
+        if (s->fileSize == FILE_SIZE_UNKNOWN)
+            printf("[rxd] %s: %s incomplete (%" PRIu64 " bytes of a stream)\n",
+                   s->name, s->filename, s->bytesReceived);
+        else
+            printf("[rxd] %s: %s incomplete (%" PRIu64 " of %" PRIu64 " bytes)\n",
+                   s->name, s->filename, s->bytesReceived, s->fileSize);
+    }
+    printf("[rxd] %s: session %u ended (%s)\n", s->name, s->sessionCount, reason);
+    s->active = FALSE;
+}
+
+// Application layer for one received packet.
+static void sessionPacket(Session *s, const unsigned char *packet, int len)
+{
+    uint8_t controlType;
+    const uint8_t *data;
+    ControlInfo expected;
+    int n = parsePacketInPlace(packet, len, &controlType, &data, &s->fileSize, s->filename, &expected);
+    if (n < 0)
+        return;
+
+    if (controlType == CF_START) {
+        if (s->out != NULL)
+            fclose(s->out);
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", s->dir, safeName(s->filename));
+        s->out = fopen(path, "wb");
+        if (s->out == NULL)
+            perror(path);
+        s->bytesReceived = 0;
+        sha256Init(&s->digest);
+    }
+    else if (controlType == CF_DATA && s->out != NULL) {
+        fwrite(data, 1, n, s->out);
+        sha256Update(&s->digest, data, n);
+        s->bytesReceived += n;
+    }
+    else if (controlType == CF_HOLE && s->out != NULL) {
+        uint64_t holeSize;
+        if (parseHole(data, n, &holeSize) == 0 && sparseSkip(s->out, holeSize) == 0) {
+            sparseHashZeros(&s->digest, holeSize);
+            s->bytesReceived += holeSize;
+        }
+        else {
+            printf("[rxd] %s: could not leave a hole in %s\n", s->name, s->filename);
+        }
+    }
+    else if (controlType == CF_END && s->out != NULL) {
+        sparseFinish(s->out);
+        fclose(s->out);
+        s->out = NULL;
+
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256Final(&s->digest, digest);
+        const char *check = !expected.hasDigest ? "not verified"
+                            : memcmp(digest, expected.sha256, SHA256_DIGEST_SIZE) == 0 ? "digest verified"
+                                                                                     : "DIGEST MISMATCH";
+        printf("[rxd] %s: received %s (%" PRIu64 " bytes, %s)\n",
+               s->name, s->filename, s->bytesReceived, check);
+    }
+}
+
+static void sessionInput(Session *s, const char *outdir)
+{
+    unsigned char buf[READ_CHUNK];
+
+    // Transports such as UDP may hold back part of what they received, so
+    // read until there is nothing left rather than once per wakeup
+    int r;
+    while ((r = serialPortRead(&s->link.port, buf, sizeof(buf), 0)) > 0) {
+        s->lastActivity = time(NULL);
+
+        for (int i = 0; i < r;) {
+            int len = 0;
+            LlRxEvent event;
+            i += llrxPushBuffer(&s->link, buf + i, r - i, s->packet, &len, &event);
+            switch (event) {
+                case LL_RX_SET:
+                    // A transmitter that vanished without DISC was replaced
+                    // by a new one: what the old one sent is incomplete
+                    if (s->active && s->filename[0] != '\0')
+                        sessionEnd(s, "restarted by peer");
+                    if (!s->active)
+                        sessionStart(s, outdir);
+                    break;
+                case LL_RX_DATA:
+                    if (s->active)
+                        sessionPacket(s, s->packet, len);
+                    break;
+                case LL_RX_CLOSED:
+                    if (s->active)
+                        sessionEnd(s, "closed by peer");
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-b baudrate] [-o outdir] [-i idle_timeout] [-f frame_size] [-l] port...\n"
+           "  -l  low-latency serial configuration\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int baudRate = 9600;
+    int frameSize = 0;
+    const char *outdir = DEFAULT_OUTDIR;
+    int idleTimeout = DEFAULT_IDLE_TIMEOUT;
+    SerialConfig serial = {0};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:o:i:f:lh")) != -1) {
+        switch (opt) {
+            case 'b': baudRate = atoi(optarg); break;
+            case 'f': frameSize = atoi(optarg); break;
+            case 'o': outdir = optarg; break;
+            case 'i': idleTimeout = atoi(optarg); break;
+            case 'l': serial.lowLatency = true; break;
+            default: usage(argv[0]); exit(1);
+        }
+    }
+
+    // START and END packets are never split
+    if (frameSize != 0 && (frameSize < MAX_CONTROL_PACKET_SIZE || frameSize > MAX_INFO_SIZE)) {
+        printf("Frame size must be between %d and %d\n", MAX_CONTROL_PACKET_SIZE, MAX_INFO_SIZE);
+        exit(1);
+    }
+
+    int nPorts = argc - optind;
+    if (nPorts <= 0 || nPorts > MAX_PORTS) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (mkdir(outdir, 0755) == -1 && errno != EEXIST) {
+        perror(outdir);
+        exit(1);
+    }
+
+    Session *sessions = calloc(nPorts, sizeof(Session));
+    if (sessions == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    int nOpen = 0;
+    for (int i = 0; i < nPorts; i++) {
+        Session *s = &sessions[i];
+        const char *port = argv[optind + i];
+        const char *slash = strrchr(port, '/');
+        s->name = slash ? slash + 1 : port;
+
+        s->link.params.role = LlRx;
+        s->link.params.baudRate = baudRate;
+        s->link.params.maxInfo = frameSize;
+        s->link.params.serial = serial;
+        snprintf(s->link.params.serialPort, sizeof(s->link.params.serialPort), "%s", port);
+        s->packet = malloc(frameSize > 0 ? frameSize : DEFAULT_INFO_SIZE);
+        if (s->packet == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+
+        if (serialPortOpenConfig(&s->link.port, port, baudRate, &serial) < 0)
+            continue;
+        fcntl(s->link.port.fd, F_SETFL, fcntl(s->link.port.fd, F_GETFL) | O_NONBLOCK);
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->link.port.fd, &ev) == -1) {
+            perror("epoll_ctl");
+            serialPortClose(&s->link.port);
+            continue;
+        }
+        nOpen++;
+    }
+
+    if (nOpen == 0) {
+        fprintf(stderr, "[rxd] No port could be opened\n");
+        exit(1);
+    }
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = onSignal;
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+
+    printf("[rxd] Listening on %d port(s), writing to %s\n", nOpen, outdir);
+
+    struct epoll_event events[64];
+    while (!stop) {
+        int n = epoll_wait(epfd, events, 64, 1000);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+            sessionInput(events[i].data.ptr, outdir);
+
+        // Drop sessions whose peer went away without closing
+        time_t now = time(NULL);
+        for (int i = 0; i < nPorts; i++) {
+            Session *s = &sessions[i];
+            if (s->active && now - s->lastActivity > idleTimeout) {
+                sessionEnd(s, "idle timeout");
+                s->link.connected = FALSE;
+                s->link.disconnecting = FALSE;
+            }
+        }
+    }
+
+    printf("[rxd] Shutting down\n");
+    for (int i = 0; i < nPorts; i++) {
+        Session *s = &sessions[i];
+        if (s->active)
+            sessionEnd(s, "daemon stopped");
+        if (s->link.port.fd >= 0 && s->name != NULL)
+            serialPortClose(&s->link.port);
+        free(s->packet);
+    }
+
+    close(epfd);
+    free(sessions);
+    return 0;
+}
@@ -4,6 +4,22 @@
 #ifndef _APPLICATION_LAYER_H_
 #define _APPLICATION_LAYER_H_
 
+#include <stdbool.h>
+
+#include "serial_port.h"
+
+// Optional settings of the application. Zero means default.
+typedef struct
+{
+    int frameSize;          // Largest I-frame information field to offer (up to 65535)
+    bool dedup;             // tx: only send the chunks the receiver does not have
+    const char *chunkStore; // rx: chunk store directory (DEFAULT_CHUNK_STORE if NULL)
+    int recoveryTime;       // tx: seconds to spend re-establishing a lost link (0: give up)
+    bool cobs;              // tx: offer COBS framing instead of byte stuffing
+    const char *traceFile;  // Chrome trace JSON of the session (NULL: no trace)
+    const char *histogramFile; // CSV of the link's latency histograms, written at the end (NULL: none)
+    SerialConfig serial;    // Port tuning
+} AppOptions;
 
 // Application layer main function.
 // Arguments:
@@ -16,4 +32,9 @@
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename);
 
+// Same as applicationLayer, with optional settings (may be NULL).
+void applicationLayerWithOptions(const char *serialPort, const char *role, int baudRate,
+                                 int nTries, int timeout, const char *filename,
+                                 const AppOptions *options);
+
 #endif // _APPLICATION_LAYER_H_
@@ -0,0 +1,45 @@
+// Chunk deduplication header.
+// Files are split into content-defined chunks, so an insertion or deletion
+// only changes the chunks around it. The receiver keeps every chunk it has
+// seen in a chunk store (one file per chunk, named after its SHA-256) and
+// only the chunks it does not have go over the link.
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sha256.h"
+
+#define CDC_MIN_SIZE 1024   // No cut before this many bytes
+#define CDC_AVG_BITS 12     // Cut probability 1/4096 per byte after the minimum
+#define CDC_MAX_SIZE 16384  // Forced cut
+
+#define DEFAULT_CHUNK_STORE "chunk-store"
+
+typedef struct
+{
+    uint64_t offset;                    // Position in the file (transmitter only)
+    uint32_t size;                      // 1..CDC_MAX_SIZE
+    uint8_t hash[SHA256_DIGEST_SIZE];   // SHA-256 of the chunk
+} ChunkRef;
+
+// Split the rest of file into chunks, from its current position to the end.
+// On success *chunks holds a malloc'd array, fileDigest the SHA-256 of the
+// whole file, and the position is back where it was.
+// Returns the number of chunks or -1 on error.
+int cdcChunkFile(FILE *file, ChunkRef **chunks, uint8_t fileDigest[SHA256_DIGEST_SIZE]);
+
+// Create the chunk store directory if needed. Returns 0 or -1 on error.
+int chunkStoreOpen(const char *dir);
+
+// Read the chunk into data (chunk->size bytes) if the store has it with the
+// right contents. Returns 0 on success or -1 if it is missing or damaged.
+int chunkStoreGet(const char *dir, const ChunkRef *chunk, uint8_t *data);
+
+// Add a chunk to the store. Returns 0 on success or -1 on error.
+int chunkStorePut(const char *dir, const ChunkRef *chunk, const uint8_t *data);
+
+#endif // _DEDUP_H_
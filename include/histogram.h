@@ -0,0 +1,43 @@
+// Histogram header.
+// Log-linear (HDR-style) histograms: each power of two is split into
+// HISTOGRAM_SUB_BUCKETS buckets, so any value is known to within about 6%
+// and recording one is a few instructions, whatever its magnitude.
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40 // Larger values are counted as 2^40 - 1
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Must be zeroed before use.
+typedef struct
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total; // Values recorded
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+} Histogram;
+
+void histogramRecord(Histogram *h, uint64_t value);
+
+// Value that percentile (0 to 100) of the recorded values do not exceed,
+// rounded up to the end of its bucket. 0 if nothing was recorded.
+uint64_t histogramPercentile(const Histogram *h, double percentile);
+
+// Print a one-line summary (count, mean, min, p50, p90, p99, p99.9, max),
+// values followed by unit. Nothing is printed for an empty histogram.
+void histogramPrint(const Histogram *h, const char *name, const char *unit);
+
+// Add the values recorded in from to h.
+void histogramMerge(Histogram *h, const Histogram *from);
+
+// Write the non-empty buckets as CSV lines "name,low,high,count".
+void histogramExport(const Histogram *h, const char *name, FILE *out);
+
+#endif // _HISTOGRAM_H_
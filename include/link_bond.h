@@ -0,0 +1,27 @@
+// Link aggregation header.
+// A bonded link stripes the packets written to it over several serial ports
+// connected to the same peer, and puts them back in order on the receiver.
+
+#ifndef _LINK_BOND_H_
+#define _LINK_BOND_H_
+
+#include "link_layer.h"
+
+#define BOND_MAX_PORTS 8
+#define BOND_HEADER_SIZE 5   // Type + 32-bit bond sequence number
+#define BOND_QUEUE_SIZE 16   // Packets waiting for a member link (tx)
+#define BOND_WINDOW 64       // Max distance between oldest and newest packet in flight
+
+// Open a bonded link over the comma-separated list of ports in serialPorts
+// (e.g. "/dev/ttyS10,/dev/ttyS12"). The other fields of connectionParameters
+// apply to every port. Both sides must list the same number of ports.
+// Return 1 on success or -1 if no port could be opened.
+int llopenBonded(LinkContext *link, LinkLayer connectionParameters, const char *serialPorts);
+
+// Called by llwrite_r/llread_r/llclose_r when link->bond is set.
+int bondWrite(struct LinkBond *bond, const struct iovec *iov, int iovcnt);
+int bondRead(struct LinkBond *bond, unsigned char *packet);
+// bondClose adds the histograms of every member to histograms.
+int bondClose(struct LinkBond *bond, LinkHistograms *histograms);
+
+#endif // _LINK_BOND_H_
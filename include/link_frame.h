@@ -0,0 +1,67 @@
+// Frame encoding header.
+// Building frames with byte stuffing or COBS, and the FCS functions the
+// deframer in link_layer.c shares with them. Apart from the link layer so
+// that the benchmarks can drive them on their own.
+
+#ifndef _LINK_FRAME_H_
+#define _LINK_FRAME_H_
+
+#include <sys/uio.h>
+
+#include "link_layer.h"
+
+// Byte stuffing: FLAG and ESC in a frame are sent as ESC, byte ^ 0x20
+#define ESC 0x7D
+
+// Control field of the supervision frames acknowledging (RR) or
+// rejecting (REJ) I-frame n; SET, UA and DISC are in link_layer.h
+#define C_RR(n)  ((n) ? 0x85 : 0x05)
+#define C_REJ(n) ((n) ? 0x81 : 0x01)
+
+// Control field of an I-frame: these bits, all others clear
+#define C_I_NS   0x40 // Sequence number
+#define C_I_CRC  0x20 // CRC-16 instead of BCC2
+#define C_I_COBS 0x10 // COBS-encoded data field
+
+// Room needed for a stuffed frame carrying n data bytes
+#define STUFFED_SIZE(n) (2 * ((n) + 5) + 2)
+
+// COBS (Consistent Overhead Byte Stuffing) removes the zeros from the data
+// field at the cost of one byte per block of up to 254, whatever the data.
+// The encoded bytes are XORed with FLAG, so that FLAG is the value that
+// never appears and frames keep their delimiters.
+#define COBS_MASK 0x7E
+#define COBS_BLOCK 0xFF // Code of a block of 254 bytes with no zero after it
+
+// CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF)
+extern const unsigned short crc16Table[256];
+unsigned short crc16(const unsigned char *data, int n);
+// Continue a CRC-16 over n more bytes
+unsigned short crc16Update(unsigned short crc, const unsigned char *data, int n);
+
+// BCC2: XOR of the data bytes
+unsigned char xor8(const unsigned char *data, int n);
+
+// Undo the COBS encoding of the n bytes at in (data field and FCS of a
+// COBS I-frame, as sent) into out. Returns the decoded size, or -1 if the
+// encoding is broken.
+int decodeCobs(unsigned char *out, const unsigned char *in, int n);
+
+// Build a stuffed frame FLAG A C BCC1 [data FCS] FLAG into "out", which must
+// hold STUFFED_SIZE(n) bytes. The FCS is BCC2 (XOR) unless fcs is
+// LL_FCS_CRC16. Returns the frame size.
+int buildFrame(unsigned char *out, unsigned char C, const unsigned char *data, int n, unsigned char fcs);
+
+// Same as buildFrame with a COBS-encoded data field (C should have bit 4
+// set). Never longer than STUFFED_SIZE(n).
+int buildCobsFrame(unsigned char *out, unsigned char C, const unsigned char *data, int n,
+                   unsigned char fcs);
+
+// Same as above with the data field gathered from iovcnt segments, encoded
+// straight from where they are. buildFrameV builds a frame without data
+// field when iov is NULL.
+int buildFrameV(unsigned char *out, unsigned char C, const struct iovec *iov, int iovcnt, unsigned char fcs);
+int buildCobsFrameV(unsigned char *out, unsigned char C, const struct iovec *iov, int iovcnt,
+                    unsigned char fcs);
+
+#endif // _LINK_FRAME_H_
@@ -2,6 +2,11 @@
 // DO NOT CHANGE THIS FILE
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include "histogram.h"
+#include "serial_port.h"
 
 #ifndef _LINK_LAYER_H_
 #define _LINK_LAYER_H_
@@ -14,20 +19,11 @@
 #define BAUDRATE  B38400
 #define BUF_SIZE 5
 
-extern int fd;
-extern struct termios oldtio;
-
-extern volatile int TIMEOUT;
-extern volatile int UA_received;
-extern volatile int alarmCount;
-
-// Protótipo da função
-void alarmHandler(int signo);
-
 extern const unsigned char FLAG;
 extern const unsigned char A1;
 extern const unsigned char C1;
 extern const unsigned char C2;
+extern const unsigned char DISC;
 extern const unsigned char BCC1;
 extern const unsigned char BCC2;
 
@@ -47,34 +43,191 @@ typedef struct
     int baudRate;
     int nRetransmissions;
     int timeout;
+    int maxInfo;       // Largest I-frame information field to offer (0: DEFAULT_INFO_SIZE)
+    int recoveryTime;  // Seconds llwrite keeps probing a lost link before giving up (0: no recovery)
+    bool cobs;         // Offer COBS framing of I-frames (receivers always accept it)
+    const char *traceFile; // Chrome trace JSON of the session, written when it closes (NULL: no trace)
+    const volatile bool *cancelOpen; // Receiver: llopen_r gives up once it is set (NULL: waits for SET forever)
+    SerialConfig serial; // Port tuning (all zero: defaults)
 } LinkLayer;
 
 // Size of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer.
 #define MAX_PAYLOAD_SIZE 1000
 
+// Information field size used by default and with peers that predate the
+// capability exchange: an application packet plus the header added by
+// bonded links.
+#define DEFAULT_INFO_SIZE 1040
+
+// Largest information field that can be negotiated (jumbo frames).
+#define MAX_INFO_SIZE 65535
+
+// FCS types, as a mask of what a side supports
+#define LL_FCS_XOR8  0x01 // BCC2: XOR of the data bytes
+#define LL_FCS_CRC16 0x02 // CRC-16/CCITT, marked by bit 5 of the I-frame C field
+
+// Optional features, as a mask
+#define LL_FEAT_COBS 0x04 // I-frame data field COBS-encoded, marked by bit 4 of C
+
+// Link configuration agreed in the SET/UA exchange.
+typedef struct
+{
+    int maxInfo;            // Largest I-frame information field
+    int window;             // I-frames that may be unacknowledged (1 = stop-and-wait)
+    unsigned char fcs;      // LL_FCS_* in use (a mask while being offered)
+    unsigned char features; // LL_FEAT_* both sides support
+} LinkCaps;
+
+// Transmission statistics, printed by llclose.
+typedef struct
+{
+    unsigned long framesSent;      // I-frames written, including retransmissions
+    unsigned long framesReceived;  // I-frames accepted by llread
+    unsigned long retransmissions; // I-frames written again after timeout or REJ
+    unsigned long timeouts;        // Timer expirations
+    unsigned long rejSent;         // REJ frames sent by llread
+    unsigned long rejReceived;     // REJ frames received by llwrite
+    unsigned long duplicates;      // Duplicate I-frames discarded by llread
+    unsigned long bytesSent;       // Payload bytes acknowledged
+    unsigned long bytesReceived;   // Payload bytes delivered
+    unsigned long recoveries;      // Sessions resumed after the retry budget ran out
+} LinkStats;
+
+// Latency distributions, printed by llclose. Times are in microseconds.
+typedef struct
+{
+    Histogram ackRtt;          // From the transmission of an I-frame that got acknowledged to its RR
+    Histogram delivery;        // From llwrite taking a packet to its RR, retransmissions included
+    Histogram retransmissions; // Retransmissions of each I-frame delivered
+    Histogram frameGap;        // Between I-frames accepted by llread
+} LinkHistograms;
+
+// State of one link. Every function taking a LinkContext only touches the
+// context it is given, so a process can run as many links as it has ports.
+// Must be zeroed before the first llopen_r.
+typedef struct
+{
+    SerialPort port;
+    LinkLayer params;
+    bool connected;
+    int ns;                // Sequence number of the next I-frame to send
+    int expectedNs;        // Sequence number of the next I-frame to accept
+    long long deadline;    // Timer expiry (monotonic ms), 0 when not armed
+    bool timeout;          // Set once the armed timer has expired
+    int alarmCount;        // Timer expirations/attempts in the current exchange
+    LinkStats stats;
+    LinkHistograms histograms;
+    long long lastDataNs;  // When llread last accepted an I-frame, 0 before the first
+    int overrunsAtOpen;    // Port overrun counter when opened, -1 if unknown
+    LinkCaps caps;         // Configuration in use
+    bool extended;         // Peer takes part in the capability exchange
+    struct LinkBond *bond; // Member links when opened with llopenBonded, else NULL
+    struct Trace *trace;   // Events of the session when params.traceFile is set, else NULL
+
+    // Frame buffers, sized for the largest frame this side offers
+    unsigned char *txFrame; // Stuffed I-frame being sent
+    int txCapacity;
+    unsigned char *rxFrame; // Destuffed A, C, BCC1, data, FCS (llrxPush)
+    int rxCapacity;
+
+    // Input read ahead from the port, not yet deframed
+    unsigned char inBuf[256];
+    int inPos;
+    int inLen;
+
+    // Receiver deframing state (llrxPush)
+    int rxIndex;           // Bytes of the current frame in rxFrame
+    unsigned char rxState; // Deframer state
+    unsigned char rxBcc;   // BCC2 and CRC-16 accumulated over the data field
+    unsigned short rxCrc;
+    bool rxDamaged;        // Bad escape seen in the current frame
+    int rxCobsLeft;        // Bytes left in the current COBS block
+    bool rxCobsZero;       // The current COBS block ends in a zero
+    long long rxStartNs;   // When the current frame started arriving (traced links only)
+    bool disconnecting;    // DISC answered, waiting for the final UA
+
+    // Receiver position reported in the UA of a resynchronisation (llwrite)
+    bool resumed;
+    int peerExpectedNs;
+    unsigned long long peerOffset; // Payload bytes the receiver has accepted
+} LinkContext;
+
+// Events reported by llrxPush.
+typedef enum
+{
+    LL_RX_NONE,      // No complete frame yet
+    LL_RX_DATA,      // New I-frame accepted, RR sent
+    LL_RX_DUPLICATE, // Repeated I-frame, RR sent again
+    LL_RX_REJECTED,  // I-frame with a bad BCC2, REJ sent
+    LL_RX_SET,       // SET received, UA sent: a new session starts
+    LL_RX_RESUMED,   // SET resuming the session after an outage, UA sent
+    LL_RX_UA,        // UA received (answer to a SET)
+    LL_RX_DISC,      // DISC received (sent back by the receiver)
+    LL_RX_CLOSED,    // UA received after DISC, link closed
+    LL_RX_RR,        // RR received (answer to an I-frame)
+    LL_RX_REJ,       // REJ received (answer to an I-frame)
+} LlRxEvent;
+
+
 // MISC
 #define FALSE 0
 #define TRUE 1
 
-bool stateMachine(unsigned char controll);
-bool Close_stateMachine(unsigned char controll, LinkLayer connectionParameters);
 
 
 // Open a connection using the "port" parameters defined in struct linkLayer.
 // Return 0 on success or -1 on error.
-int llopen(LinkLayer connectionParameters);
+int llopen_r(LinkContext *link, LinkLayer connectionParameters);
 
 // Send data in buf with size bufSize.
 // Return number of chars written, or -1 on error.
-int llwrite(const unsigned char *buf, int bufSize);
+int llwrite_r(LinkContext *link, const unsigned char *buf, int bufSize);
+
+// Same as llwrite_r for data gathered from iovcnt segments (e.g. a packet
+// header and a payload in the caller's buffer), encoded straight into the
+// frame without being copied together first.
+int llwritev_r(LinkContext *link, const struct iovec *iov, int iovcnt);
 
 // Receive data in packet.
 // Return number of chars read, or -1 on error.
-int llread(unsigned char *packet);
+int llread_r(LinkContext *link, unsigned char *packet);
+
+// Same as llread_r, giving up after timeoutMs (negative waits forever).
+// On timeout return -1 with link->timeout set.
+int llreadTimeout_r(LinkContext *link, unsigned char *packet, int timeoutMs);
+
+// Same as llreadTimeout_r without copying the data out: *data points into
+// the link's frame buffer, valid until the next call on the link.
+int llreadInPlace_r(LinkContext *link, const unsigned char **data, int timeoutMs);
+
+// Feed one byte received on link's port to its receiver, for callers that
+// do their own I/O (e.g. an event loop). Answers (UA, RR, REJ, DISC) are sent
+// on the port. On LL_RX_DATA the data is copied to packet and its size
+// stored in *len.
+LlRxEvent llrxPush(LinkContext *link, unsigned char byte, unsigned char *packet, int *len);
+
+// Same as llrxPush for n bytes, stopping after the first byte that produces
+// an event (stored in *event). Returns the number of bytes consumed.
+int llrxPushBuffer(LinkContext *link, const unsigned char *buf, int n,
+                   unsigned char *packet, int *len, LlRxEvent *event);
+
+// Release the port and buffers of a link without running the closing
+// protocol, e.g. after the peer has vanished.
+void llabort_r(LinkContext *link);
+
+// Write the link's histograms to out as CSV lines "name,low,high,count",
+// e.g. to size timeouts. May be called at any time, also after llclose_r.
+void llexportHistograms_r(const LinkContext *link, FILE *out);
 
 // Close previously opened connection and print transmission statistics in the console.
 // Return 0 on success or -1 on error.
-int llclose();
+int llclose_r(LinkContext *link);
+
+// Same as above, on a single link shared by the whole process.
+int llopen(LinkLayer connectionParameters);
+int llwrite(const unsigned char *buf, int bufSize);
+int llread(unsigned char *packet);
+int llclose(void);
 
 #endif // _LINK_LAYER_H_
@@ -3,19 +3,81 @@
 
 #include <stdint.h>
 
+#include "dedup.h"
+#include "link_layer.h"
+#include "sha256.h"
+
 #define CF_START 0x01
 #define CF_DATA  0x02
 #define CF_END   0x03
+#define CF_MANIFEST 0x04 // Chunk list of the file (dedup mode, tx -> rx)
+#define CF_HAVE     0x05 // Chunks the receiver already has (dedup mode, rx -> tx)
+#define CF_HOLE     0x06 // Run of zeros in place of DATA (sparse files)
 
 #define TLV_FILESIZE_T 0x00
 #define TLV_FILENAME_T 0x01
+#define TLV_DIGEST_T   0x02 // SHA-256 of the whole file, END packet only
+#define TLV_CHUNKS_T   0x03 // Number of manifest entries, START packet in dedup mode
 
-#define MAX_PACKET_SIZE 1024
+#define MAX_PACKET_SIZE MAX_INFO_SIZE
 #define MAX_FILENAME_SIZE 255
 
+// Largest START/END packet: C, then the size, name, digest and chunk count TLVs
+#define MAX_CONTROL_PACKET_SIZE (1 + (2 + 8) + (2 + MAX_FILENAME_SIZE) + (2 + SHA256_DIGEST_SIZE) + (2 + 4))
+
+// Size of a stream whose length is not known up front. START packets then
+// carry no size TLV; the END packet carries the number of bytes actually sent.
+#define FILE_SIZE_UNKNOWN UINT64_MAX
+
+#define MANIFEST_ENTRY_SIZE (2 + SHA256_DIGEST_SIZE) // Chunk size, chunk hash
+#define MIN_DEDUP_INFO_SIZE (1 + MANIFEST_ENTRY_SIZE) // Smallest frame a MANIFEST entry fits in
+
+// Optional TLVs of a control packet
+typedef struct
+{
+    bool hasDigest;
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+    uint32_t chunkCount; // Manifest entries that follow START, 0 without dedup
+} ControlInfo;
+
 // Function declarations
-int sendControlPacket(uint8_t controlType, uint32_t fileSize, const char *filename);
-int sendDataPacket(const uint8_t *data, uint16_t dataSize);
-int receivePacket(uint8_t *controlType, uint8_t *dataBuffer, uint32_t *fileSize, char *filename);
+// info may be NULL, both when sending (no optional TLVs) and parsing.
+// The build functions write the packet into packet (MAX_PACKET_SIZE bytes)
+// and return its size, or -1 if the arguments do not fit.
+int buildControlPacket(uint8_t *packet, uint8_t controlType, uint64_t fileSize, const char *filename,
+                       const ControlInfo *info);
+int buildDataPacket(uint8_t *packet, const uint8_t *data, uint16_t dataSize);
+int sendControlPacket(LinkContext *link, uint8_t controlType, uint64_t fileSize, const char *filename,
+                      const ControlInfo *info);
+int sendDataPacket(LinkContext *link, const uint8_t *data, uint16_t dataSize);
+int parsePacket(const uint8_t *packet, int len, uint8_t *controlType, uint8_t *dataBuffer, uint64_t *fileSize,
+                char *filename, ControlInfo *info);
+int receivePacket(LinkContext *link, uint8_t *controlType, uint8_t *dataBuffer, uint64_t *fileSize, char *filename,
+                  ControlInfo *info);
+
+// Same as parsePacket/receivePacket without copying the payload: *payload
+// points into packet (into the link's frame buffer for receivePacketInPlace,
+// valid until the next call on the link), NULL for START and END.
+int parsePacketInPlace(const uint8_t *packet, int len, uint8_t *controlType, const uint8_t **payload,
+                       uint64_t *fileSize, char *filename, ControlInfo *info);
+int receivePacketInPlace(LinkContext *link, uint8_t *controlType, const uint8_t **payload, uint64_t *fileSize,
+                         char *filename, ControlInfo *info);
+
+// Dedup mode. MANIFEST and HAVE packets are returned by parsePacket as their
+// payload (without C) in dataBuffer, and decoded with the functions below.
+// Send up to count manifest entries, as many as fit; return how many were sent
+// or -1 (also if not even one fits, see MIN_DEDUP_INFO_SIZE).
+int sendManifestPacket(LinkContext *link, const ChunkRef *chunks, int count);
+int parseManifest(const uint8_t *payload, int len, ChunkRef *chunks, int maxChunks);
+// Send the have-bits of chunks first.. as fit; return how many were covered
+// or -1 (also if not even one fits).
+int sendHavePacket(LinkContext *link, uint32_t first, const bool *have, int count);
+int parseHave(const uint8_t *payload, int len, bool *have, int nChunks);
+
+// Sparse files. A HOLE packet stands for length zero bytes at the current
+// position of the file; parsePacket returns its payload like MANIFEST.
+int sendHolePacket(LinkContext *link, uint64_t length);
+// Returns 0 with the hole size in *length, or -1 if the payload is malformed.
+int parseHole(const uint8_t *payload, int len, uint64_t *length);
 
 #endif
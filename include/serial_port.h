@@ -4,6 +4,115 @@
 #ifndef _SERIAL_PORT_H_
 #define _SERIAL_PORT_H_
 
+#include <stdbool.h>
+#include <termios.h>
+
+// Range of baud rates accepted. The classic rates up to 115200 use the
+// termios constants; any other rate is set through termios2 (BOTHER), if
+// the driver supports it.
+#define SERIAL_MIN_BAUDRATE 50
+#define SERIAL_MAX_BAUDRATE 4000000
+
+// Line emulation applied to the writes of the in-process and UDP transports
+typedef struct
+{
+    int rate;            // Bits per second, 10 per byte (0: as fast as possible)
+    double loss;         // Probability that a byte is dropped
+    double error;        // Probability that a byte gets one bit flipped
+    unsigned long long seed; // Random state (xorshift64*)
+    long long busyUntil; // When the bytes written so far are all out (monotonic ns)
+} SerialShaping;
+
+// Handle for one open serial port. Each link owns its own handle, so a
+// process can drive several ports at the same time.
+typedef struct
+{
+    int fd;                // File descriptor for open serial port (poll/epoll on it)
+    const struct SerialTransport *transport; // How the port is driven (serial_transport.h)
+    void *backend;         // Transport state
+    SerialShaping shaping;
+    int baudRate;          // Rate of a tty, to time the bytes still to go out
+    long long txBusyUntil; // When the bytes written to a tty are all out at that rate (monotonic ns)
+    struct termios oldtio; // Serial port settings to restore on closing
+    int oldSerialFlags;    // Driver flags to restore (TIOCSSERIAL), -1 if untouched
+    int oldLatencyTimer;   // USB adapter latency timer (ms) to restore, -1 if untouched
+    char latencyPath[96];
+} SerialPort;
+
+// Optional port tuning. All zero gives the historical configuration.
+typedef struct
+{
+    bool lowLatency; // Ask the driver to hand over bytes at once (ASYNC_LOW_LATENCY,
+                     // and a 1 ms latency timer on USB adapters that have one)
+    bool rtsCts;     // Hardware flow control (CRTSCTS)
+    int vmin;        // Bytes a read waits for (0: 1)
+    int vtime;       // Inter-byte timeout of a read, in 0.1 s (forced to 1 if vmin > 1)
+} SerialConfig;
+
+// What the driver reports about a port; -1 where it does not say.
+typedef struct
+{
+    int fifoSize;  // Transmit FIFO of the UART
+    int inQueued;  // Bytes received, not read yet
+    int outQueued; // Bytes written, not sent yet
+    int overruns;  // Bytes lost by the UART or the driver since boot
+} SerialPortInfo;
+
+// Open and configure the serial port into "port".
+// Besides a tty, the name can select an emulated line:
+//   mem:NAME              the two ends of an in-process channel, for links
+//                         running in the same process (threads, simulations)
+//   udp:LOCAL:REMOTE      UDP datagrams from/to those ports on localhost
+//                         (udp:LOCAL:HOST:REMOTE for another host)
+//   sim:NAME              one end of the simulated line (serial_sim.h)
+// followed by options such as "?rate=115200&loss=0.001&error=0.0001".
+// Returns a positive number if the port was opened successfully or -1 on error.
+int serialPortOpen(SerialPort *port, const char *serialPort, int baudRate);
+
+// Same as serialPortOpen, with optional tuning (may be NULL).
+int serialPortOpenConfig(SerialPort *port, const char *serialPort, int baudRate,
+                         const SerialConfig *config);
+
+// Restore original port settings and close the serial port.
+// Returns 0 if the port was closed successfully or -1 on error.
+int serialPortClose(SerialPort *port);
+
+// Query buffer sizes and error counters of an open port.
+void serialPortInfo(SerialPort *port, SerialPortInfo *info);
+
+// Wait up to timeoutMs milliseconds (forever if negative) for a byte received
+// from the serial port.
+// Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
+int serialPortReadByte(SerialPort *port, unsigned char *byte, int timeoutMs);
+
+// Wait up to timeoutMs milliseconds (forever if negative) for data received
+// from the serial port and read up to nBytes of what is available.
+// Returns -1 on error, otherwise the number of bytes read (0 on timeout).
+int serialPortRead(SerialPort *port, unsigned char *bytes, int nBytes, int timeoutMs);
+
+// Write up to numBytes to the serial port (must check how many were actually
+// written in the return value).
+// Returns -1 on error, otherwise the number of bytes written.
+int serialPortWrite(SerialPort *port, const unsigned char *bytes, int nBytes);
+
+// Time until the bytes written so far have all left the port, in ns (0 when
+// they have or the transport cannot tell). On a tty it follows the driver's
+// output queue (TIOCOUTQ) and, for drivers that do not report it (ptys),
+// the time the bytes take at the port's baud rate.
+long long serialPortDrainNs(SerialPort *port);
+
+// Current time on the port's line in nanoseconds: CLOCK_MONOTONIC, or the
+// virtual clock of a simulated line. Timers on the port must use it.
+long long serialPortNowNs(const SerialPort *port);
+
+// Set any baud rate on an open port through the Linux termios2 interface.
+// Returns the rate the driver actually uses, or -1 if it rejects baudRate.
+// (serial_baud.c)
+int serialPortSetBaudRate(int fd, int baudRate);
+
+// The functions below operate on a single default port and are kept for
+// code that only ever needs one link.
+
 // Open and configure the serial port.
 // Returns a positive number if the port was opened successfully or -1 on error.
 int openSerialPort(const char *serialPort, int baudRate);
@@ -0,0 +1,51 @@
+// Simulated serial line header.
+// A line between two "sim:NAME" ports that runs on a virtual clock: time
+// only moves forward when every thread taking part in the simulation is
+// waiting on its port, and then jumps straight to the next event (a byte
+// arriving or a read timing out). The links on both ends run unchanged.
+// One simulation at a time per process.
+
+#ifndef _SERIAL_SIM_H_
+#define _SERIAL_SIM_H_
+
+#include <stdbool.h>
+
+#define SIM_MAX_OUTAGES 16
+
+// Time the line is disconnected, in virtual ns since the simulation started
+typedef struct
+{
+    long long start;
+    long long length;
+} SimOutage;
+
+// The line, modelled as the cable program does: 10 bits per byte, a
+// propagation delay, bytes with one bit flipped at the given bit error rate,
+// and bytes sent while the cable is off are lost.
+typedef struct
+{
+    int baudRate;
+    long long propDelay; // ns
+    double ber;
+    SimOutage outages[SIM_MAX_OUTAGES];
+    int nOutages;
+    unsigned long long seed; // Random state of the errors
+} SimChannel;
+
+// Start a new simulation with an empty line, for nThreads threads that will
+// each open one end of it. Every one of them must call simThreadDone when it
+// has finished with its port.
+void simStart(const SimChannel *channel, int nThreads);
+
+// The calling thread takes no further part in the simulation.
+void simThreadDone(void);
+
+// Wait until every thread is done (returns true), or until all those left
+// are waiting forever on a line with nothing in flight (returns false; they
+// stay blocked in serialPortRead and can be cancelled).
+bool simWait(void);
+
+// Virtual time elapsed since simStart, in ns
+long long simElapsed(void);
+
+#endif // _SERIAL_SIM_H_
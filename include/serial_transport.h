@@ -0,0 +1,36 @@
+// Serial port transports header.
+// serialPortOpen picks a transport from the port name and every other
+// serialPort* call goes to the one the port was opened with. Each transport
+// keeps a file descriptor in port->fd while the port is open. For serial
+// ports, mem: and udp: it becomes readable with data, so callers can poll or
+// epoll on it; the sim: transport's never does, since its bytes arrive on a
+// virtual clock that only serialPortRead advances.
+
+#ifndef _SERIAL_TRANSPORT_H_
+#define _SERIAL_TRANSPORT_H_
+
+#include "serial_port.h"
+
+typedef struct SerialTransport
+{
+    const char *prefix; // Port name prefix selecting the transport ("mem:")
+
+    // Same contracts as the serialPort* functions; open gets the name
+    // without the prefix and the shaping options.
+    int (*open)(SerialPort *port, const char *address, int baudRate, const SerialConfig *config);
+    int (*close)(SerialPort *port);
+    int (*read)(SerialPort *port, unsigned char *bytes, int nBytes, int timeoutMs);
+    int (*write)(SerialPort *port, const unsigned char *bytes, int nBytes);
+    long long (*now)(const SerialPort *port); // Clock of the line in ns (NULL: CLOCK_MONOTONIC)
+    long long (*drain)(SerialPort *port);     // serialPortDrainNs (NULL: writes return once sent)
+} SerialTransport;
+
+extern const SerialTransport serialMemTransport; // serial_mem.c
+extern const SerialTransport serialUdpTransport; // serial_udp.c
+extern const SerialTransport serialSimTransport; // serial_sim.c
+
+// poll/read and write on port->fd, for transports that need nothing more
+int serialFdRead(SerialPort *port, unsigned char *bytes, int nBytes, int timeoutMs);
+int serialFdWrite(SerialPort *port, const unsigned char *bytes, int nBytes);
+
+#endif // _SERIAL_TRANSPORT_H_
@@ -0,0 +1,27 @@
+// SHA-256 header.
+// Streaming digest used to check whole transfers end to end.
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length;       // Bytes hashed so far
+    uint8_t block[64];     // Partial input block
+    size_t blockLen;
+} Sha256;
+
+void sha256Init(Sha256 *ctx);
+void sha256Update(Sha256 *ctx, const void *data, size_t len);
+void sha256Final(Sha256 *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// Write the digest as 64 lowercase hex characters plus '\0' into hex.
+void sha256Hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[2 * SHA256_DIGEST_SIZE + 1]);
+
+#endif // _SHA256_H_
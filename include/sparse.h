@@ -0,0 +1,37 @@
+// Sparse file header.
+// Holes of a file (and runs of zeros) cross the link as HOLE packets that
+// only carry their length; the receiver leaves a hole of that length in the
+// output instead of writing zeros, so a mostly empty image takes the time
+// of its data.
+
+#ifndef _SPARSE_H_
+#define _SPARSE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sha256.h"
+
+// Find the first data region of fd at or after offset, up to end. On
+// success [*dataStart, *dataEnd) is that region, and both are end if only a
+// hole is left. Filesystems that cannot tell report everything as data.
+// Returns 0 or -1 on error.
+int sparseNextData(int fd, uint64_t offset, uint64_t end, uint64_t *dataStart, uint64_t *dataEnd);
+
+// True if the len bytes at data are all zero.
+bool sparseIsZero(const uint8_t *data, size_t len);
+
+// Add len zero bytes to a digest, as if the hole had been read.
+void sparseHashZeros(Sha256 *ctx, uint64_t len);
+
+// Receiver: move len bytes on in out, leaving a hole. Data the file already
+// had there is punched out; outputs that cannot seek get zeros written.
+// Returns 0 or -1 on error.
+int sparseSkip(FILE *out, uint64_t len);
+
+// Receiver: extend out to its current position, so a trailing hole is kept.
+// Returns 0 or -1 on error.
+int sparseFinish(FILE *out);
+
+#endif // _SPARSE_H_
@@ -0,0 +1,46 @@
+// Event trace header.
+// A link can record timestamped spans (frame build, serial write, ack wait,
+// file I/O, ...) in a buffer allocated when it opens, written out as Chrome
+// trace JSON when it closes, to be opened in Perfetto or chrome://tracing.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "serial_port.h"
+
+// Events a trace holds; later ones are dropped and counted
+#define TRACE_EVENTS 131072
+
+// Tracks (threads in the trace viewer) events are shown on
+typedef enum
+{
+    TRACE_APP = 1, // Application layer: packets, file I/O
+    TRACE_LINK,    // Link layer: frames, timers, serial I/O
+} TraceTrack;
+
+typedef struct Trace Trace;
+
+// Allocate a trace of capacity events, timed by clock's port (so that a
+// simulated line traces on its virtual clock).
+// Returns NULL if out of memory.
+Trace *traceCreate(int capacity, const SerialPort *clock);
+
+// Current time of the trace's clock in ns, 0 when trace is NULL. Every
+// trace function accepts a NULL trace and then does nothing.
+long long traceNow(const Trace *trace);
+
+// Record a span from startNs (from traceNow) until now. argName, if not
+// NULL, labels arg in the event's details. Names must be string literals.
+void traceSpan(Trace *trace, TraceTrack track, const char *name, long long startNs,
+               const char *argName, long long arg);
+
+// Record an instant event.
+void traceInstant(Trace *trace, TraceTrack track, const char *name, const char *argName, long long arg);
+
+// Write the events to path as Chrome trace JSON, under processName.
+// Returns 0 or -1 on error.
+int traceWrite(const Trace *trace, const char *path, const char *processName);
+
+void traceFree(Trace *trace);
+
+#endif // _TRACE_H_
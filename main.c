@@ -1,48 +1,145 @@
 // Main file of the serial port project.
 // DO NOT CHANGE THIS FILE
 
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "application_layer.h"
+#include "dedup.h"
+#include "packet_helper.h"
+#include "serial_port.h"
 
 #define N_TRIES 3
 #define TIMEOUT 4
 
+static void usage(const char *prog)
+{
+    printf("Usage: %s /dev/ttySxx baudrate tx|rx filename|- [options]\n"
+           "Options:\n"
+           "  -f, --frame-size N     largest frame payload to offer, up to 65535 (default 1040)\n"
+           "  -d, --dedup            tx: only send the parts of the file the receiver does not have\n"
+           "  -s, --chunk-store DIR  rx: where to keep chunks for dedup (default " DEFAULT_CHUNK_STORE ")\n"
+           "  -r, --recover SECS     tx: keep trying to re-establish a lost link for SECS seconds\n"
+           "                         and resume the transfer where it stopped\n"
+           "  -l, --low-latency      low-latency serial driver settings, where supported\n"
+           "  -c, --rtscts           RTS/CTS hardware flow control\n"
+           "      --vmin N           bytes the driver gathers per read (default 1)\n"
+           "      --vtime N          inter-byte timeout of a read, in 0.1 s\n"
+           "      --cobs             tx: COBS framing, at most 0.4%% overhead whatever the data\n"
+           "      --trace FILE       write a Chrome/Perfetto trace of the session to FILE\n"
+           "                         (bonded ports: one file each, named after the port)\n"
+           "      --histograms FILE  write the latency histograms of the link to FILE (CSV)\n",
+           prog);
+}
+
 // Arguments:
 //   $1: /dev/ttySxx
 //   $2: baud rate
 //   $3: tx | rx
 //   $4: filename
+// Options may appear anywhere on the command line.
 int main(int argc, char *argv[])
 {
-    if (argc < 5)
+    AppOptions options;
+    memset(&options, 0, sizeof(options));
+
+    static const struct option longOptions[] = {
+        {"frame-size", required_argument, NULL, 'f'},
+        {"dedup", no_argument, NULL, 'd'},
+        {"chunk-store", required_argument, NULL, 's'},
+        {"recover", required_argument, NULL, 'r'},
+        {"low-latency", no_argument, NULL, 'l'},
+        {"rtscts", no_argument, NULL, 'c'},
+        {"vmin", required_argument, NULL, 'm'},
+        {"vtime", required_argument, NULL, 't'},
+        {"cobs", no_argument, NULL, 'o'},
+        {"trace", required_argument, NULL, 'T'},
+        {"histograms", required_argument, NULL, 'H'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:ds:r:lch", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            options.frameSize = atoi(optarg);
+            // START and END packets are never split
+            if (options.frameSize < MAX_CONTROL_PACKET_SIZE || options.frameSize > 65535)
+            {
+                printf("Frame size must be between %d and 65535\n", MAX_CONTROL_PACKET_SIZE);
+                exit(4);
+            }
+            break;
+        case 'd':
+            options.dedup = true;
+            break;
+        case 's':
+            options.chunkStore = optarg;
+            break;
+        case 'r':
+            options.recoveryTime = atoi(optarg);
+            if (options.recoveryTime <= 0)
+            {
+                printf("Recovery time must be a positive number of seconds\n");
+                exit(4);
+            }
+            break;
+        case 'l':
+            options.serial.lowLatency = true;
+            break;
+        case 'c':
+            options.serial.rtsCts = true;
+            break;
+        case 'o':
+            options.cobs = true;
+            break;
+        case 'T':
+            options.traceFile = optarg;
+            break;
+        case 'H':
+            options.histogramFile = optarg;
+            break;
+        case 'm':
+        case 't':
+        {
+            int value = atoi(optarg);
+            if (value < 0 || value > 255)
+            {
+                printf("VMIN and VTIME must be between 0 and 255\n");
+                exit(4);
+            }
+            if (opt == 'm')
+                options.serial.vmin = value;
+            else
+                options.serial.vtime = value;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (argc - optind < 4)
     {
-        printf("Usage: %s /dev/ttySxx baudrate tx|rx filename\n", argv[0]);
+        usage(argv[0]);
         exit(1);
     }
 
-    const char *serialPort = argv[1];
-    const int baudrate = atoi(argv[2]);
-    const char *role = argv[3];
-    const char *filename = argv[4];
+    const char *serialPort = argv[optind];
+    const int baudrate = atoi(argv[optind + 1]);
+    const char *role = argv[optind + 2];
+    const char *filename = argv[optind + 3];
 
-    // Validate baud rate
-    switch (baudrate)
+    // Validate baud rate; whether the port can do it is only known once open
+    if (baudrate < SERIAL_MIN_BAUDRATE || baudrate > SERIAL_MAX_BAUDRATE)
     {
-    case 1200:
-    case 1800:
-    case 2400:
-    case 4800:
-    case 9600:
-    case 19200:
-    case 38400:
-    case 57600:
-    case 115200:
-        break;
-    default:
-        printf("Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200)\n");
+        printf("Unsupported baud rate (must be between %d and %d)\n", SERIAL_MIN_BAUDRATE, SERIAL_MAX_BAUDRATE);
         exit(2);
     }
 
@@ -59,15 +156,17 @@ int main(int argc, char *argv[])
            "  - Baudrate: %d\n"
            "  - Number of tries: %d\n"
            "  - Timeout: %d\n"
-           "  - Filename: %s\n",
+           "  - Filename: %s\n"
+           "  - Frame size: %d\n",
            serialPort,
            role,
            baudrate,
            N_TRIES,
            TIMEOUT,
-           filename);
+           filename,
+           options.frameSize > 0 ? options.frameSize : 1040);
 
-    applicationLayer(serialPort, role, baudrate, N_TRIES, TIMEOUT, filename);
+    applicationLayerWithOptions(serialPort, role, baudrate, N_TRIES, TIMEOUT, filename, &options);
 
     return 0;
 }
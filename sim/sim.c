@@ -0,0 +1,357 @@
+// Protocol simulator.
+// Sends a file between two threads running the link layer and the packet
+// format of the application, joined by a simulated line on a virtual clock
+// (serial_sim.h). A transfer that takes minutes through the cable takes
+// milliseconds here, so whole sweeps over the link settings can be run
+// offline. Every combination of the values given is simulated and printed
+// as one line.
+//
+// Usage: sim [-b bauds] [-f frame_sizes] [-t timeouts] [-e bers] [-p props]
+//            [-n tries] [-o start:length]... [-r secs] [-R runs] [-s seed] [-v] file
+
+#include "link_layer.h"
+#include "packet_helper.h"
+#include "serial_sim.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_VALUES 32
+#define DEFAULT_CHUNK_SIZE 1021 // As the application sends without jumbo frames
+
+// Values of a swept parameter
+typedef struct
+{
+    double v[MAX_VALUES];
+    int n;
+} Sweep;
+
+// One simulated transfer
+typedef struct
+{
+    LinkLayer params;
+    const unsigned char *data;
+    size_t size;
+    LinkContext tx;
+    LinkContext rx;
+    bool txDone;         // Threads that finished on their own
+    bool rxDone;
+    bool delivered;      // The whole file reached the receiver intact
+    long long deliveredAt; // Virtual ns when the END packet arrived
+} Run;
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options] file\n"
+           "Lists are comma-separated; every combination is simulated.\n"
+           "  -b, --baud LIST        baud rates (default 9600)\n"
+           "  -f, --frame-size LIST  largest frame payloads to offer (default 1040)\n"
+           "  -t, --timeout LIST     frame timeouts in seconds (default 4)\n"
+           "  -e, --ber LIST         bit error rates (default 0)\n"
+           "  -p, --prop LIST        propagation delays in usec (default 0)\n"
+           "  -n, --tries N          retransmissions per frame (default 3)\n"
+           "  -o, --outage S:L       cable off for L seconds after S seconds (repeatable)\n"
+           "  -r, --recover SECS     re-establish a lost link for up to SECS seconds\n"
+           "  -c, --cobs             COBS framing instead of byte stuffing\n"
+           "  -R, --runs N           runs per combination, with different seeds (default 1)\n"
+           "  -s, --seed N           first seed (default 1)\n"
+           "  -v, --verbose          show the output of the link layer\n",
+           prog);
+}
+
+static int parseSweep(Sweep *sweep, const char *list)
+{
+    sweep->n = 0;
+    for (const char *p = list; *p != '\0';) {
+        char *end;
+        double v = strtod(p, &end);
+        if (end == p || sweep->n == MAX_VALUES || (*end != ',' && *end != '\0'))
+            return -1;
+        sweep->v[sweep->n++] = v;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return sweep->n > 0 ? 0 : -1;
+}
+
+static unsigned char *loadFile(const char *filename, size_t *size)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    rewind(f);
+    unsigned char *data = len >= 0 ? malloc(len > 0 ? len : 1) : NULL;
+    if (data != NULL && fread(data, 1, len, f) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = len;
+    return data;
+}
+
+static void *transmitter(void *arg)
+{
+    Run *run = arg;
+    LinkContext *link = &run->tx;
+    LinkLayer params = run->params;
+    params.role = LlTx;
+    snprintf(params.serialPort, sizeof(params.serialPort), "sim:tx");
+
+    if (llopen_r(link, params) >= 0) {
+        size_t chunkSize = link->caps.maxInfo - 3; // C L2 L1
+        if (link->caps.maxInfo <= DEFAULT_INFO_SIZE && chunkSize > DEFAULT_CHUNK_SIZE)
+            chunkSize = DEFAULT_CHUNK_SIZE;
+
+        bool sent = sendControlPacket(link, CF_START, run->size, "sim", NULL) >= 0;
+        for (size_t pos = 0; sent && pos < run->size; pos += chunkSize) {
+            size_t n = run->size - pos < chunkSize ? run->size - pos : chunkSize;
+            sent = sendDataPacket(link, run->data + pos, (uint16_t)n) >= 0;
+        }
+        if (sent && sendControlPacket(link, CF_END, run->size, "sim", NULL) >= 0)
+            llclose_r(link);
+        else
+            llabort_r(link);
+    }
+    run->txDone = true;
+    simThreadDone();
+    return NULL;
+}
+
+static void *receiver(void *arg)
+{
+    Run *run = arg;
+    LinkContext *link = &run->rx;
+    LinkLayer params = run->params;
+    params.role = LlRx;
+    snprintf(params.serialPort, sizeof(params.serialPort), "sim:rx");
+
+    if (llopen_r(link, params) >= 0) {
+        uint8_t data[MAX_PACKET_SIZE];
+        char filename[MAX_FILENAME_SIZE + 1];
+        uint64_t fileSize;
+        uint8_t controlType = 0;
+        size_t received = 0;
+        bool intact = true;
+
+        // Until the END packet; a transmitter that gives up leaves this
+        // thread waiting on a silent line, where the simulation cancels it
+        while (controlType != CF_END) {
+            int n = receivePacket(link, &controlType, data, &fileSize, filename, NULL);
+            if (n < 0)
+                continue;
+            if (controlType == CF_DATA) {
+                if (received + n > run->size || memcmp(run->data + received, data, n) != 0)
+                    intact = false;
+                received += n;
+            }
+        }
+        run->delivered = intact && received == run->size;
+        run->deliveredAt = simElapsed();
+        llclose_r(link);
+    }
+    run->rxDone = true;
+    simThreadDone();
+    return NULL;
+}
+
+// Simulate one transfer; the links are left in run for their statistics
+static void simulate(Run *run, const SimChannel *channel)
+{
+    memset(&run->tx, 0, sizeof(run->tx));
+    memset(&run->rx, 0, sizeof(run->rx));
+    run->txDone = run->rxDone = run->delivered = false;
+    run->deliveredAt = 0;
+
+    simStart(channel, 2);
+    pthread_t tx, rx;
+    pthread_create(&rx, NULL, receiver, run);
+    pthread_create(&tx, NULL, transmitter, run);
+
+    // A stalled simulation has threads blocked for good on the line
+    if (!simWait()) {
+        if (!run->txDone)
+            pthread_cancel(tx);
+        if (!run->rxDone)
+            pthread_cancel(rx);
+    }
+    pthread_join(tx, NULL);
+    pthread_join(rx, NULL);
+    if (!run->txDone)
+        llabort_r(&run->tx);
+    if (!run->rxDone)
+        llabort_r(&run->rx);
+    if (!run->delivered)
+        run->deliveredAt = simElapsed();
+}
+
+int main(int argc, char *argv[])
+{
+    Sweep bauds = {{9600}, 1}, frames = {{DEFAULT_INFO_SIZE}, 1}, timeouts = {{4}, 1};
+    Sweep bers = {{0}, 1}, props = {{0}, 1};
+    int tries = 3, recoveryTime = 0, runs = 1;
+    unsigned long long seed = 1;
+    bool verbose = false;
+    bool cobs = false;
+    SimChannel channel;
+    memset(&channel, 0, sizeof(channel));
+
+    static const struct option longOptions[] = {
+        {"baud", required_argument, NULL, 'b'},
+        {"frame-size", required_argument, NULL, 'f'},
+        {"timeout", required_argument, NULL, 't'},
+        {"ber", required_argument, NULL, 'e'},
+        {"prop", required_argument, NULL, 'p'},
+        {"tries", required_argument, NULL, 'n'},
+        {"outage", required_argument, NULL, 'o'},
+        {"recover", required_argument, NULL, 'r'},
+        {"cobs", no_argument, NULL, 'c'},
+        {"runs", required_argument, NULL, 'R'},
+        {"seed", required_argument, NULL, 's'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:f:t:e:p:n:o:r:cR:s:vh", longOptions, NULL)) != -1) {
+        Sweep *sweep = NULL;
+        switch (opt) {
+            case 'b': sweep = &bauds; break;
+            case 'f': sweep = &frames; break;
+            case 't': sweep = &timeouts; break;
+            case 'e': sweep = &bers; break;
+            case 'p': sweep = &props; break;
+            case 'n': tries = atoi(optarg); break;
+            case 'r': recoveryTime = atoi(optarg); break;
+            case 'c': cobs = true; break;
+            case 'R': runs = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 0); break;
+            case 'v': verbose = true; break;
+            case 'o': {
+                double start, length;
+                if (channel.nOutages == SIM_MAX_OUTAGES ||
+                    sscanf(optarg, "%lf:%lf", &start, &length) != 2 || start < 0 || length <= 0) {
+                    printf("Outages are START:LENGTH in seconds, at most %d\n", SIM_MAX_OUTAGES);
+                    exit(1);
+                }
+                channel.outages[channel.nOutages].start = (long long)(start * 1e9);
+                channel.outages[channel.nOutages].length = (long long)(length * 1e9);
+                channel.nOutages++;
+                break;
+            }
+            default: usage(argv[0]); exit(1);
+        }
+        if (sweep != NULL && parseSweep(sweep, optarg) < 0) {
+            printf("Bad list of values \"%s\"\n", optarg);
+            exit(1);
+        }
+    }
+
+    if (argc - optind != 1 || tries < 1 || runs < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+    for (int i = 0; i < bauds.n; i++) {
+        if (bauds.v[i] < SERIAL_MIN_BAUDRATE || bauds.v[i] > SERIAL_MAX_BAUDRATE) {
+            printf("Baud rates must be between %d and %d\n", SERIAL_MIN_BAUDRATE, SERIAL_MAX_BAUDRATE);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < frames.n; i++) {
+        if (frames.v[i] < MAX_CONTROL_PACKET_SIZE || frames.v[i] > MAX_INFO_SIZE) {
+            printf("Frame size must be between %d and %d\n", MAX_CONTROL_PACKET_SIZE, MAX_INFO_SIZE);
+            exit(1);
+        }
+    }
+
+    size_t size;
+    unsigned char *data = loadFile(argv[optind], &size);
+    if (data == NULL) {
+        perror(argv[optind]);
+        exit(1);
+    }
+
+    // The link layer talks a lot; the results go to the real stdout
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!verbose) {
+        fflush(stdout);
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    }
+
+    fprintf(report, "%s: %zu bytes, %d tries, %d run(s) per line\n", argv[optind], size, tries, runs);
+    fprintf(report, "%8s %6s %4s %9s %8s | %6s %10s %7s %7s %7s %6s\n", "baud", "frame", "tmo", "ber",
+            "prop_us", "ok", "time_s", "S", "retx", "tmouts", "rej");
+
+    struct timespec wallStart, wallEnd;
+    clock_gettime(CLOCK_MONOTONIC, &wallStart);
+    int total = 0;
+
+    Run run;
+    memset(&run, 0, sizeof(run));
+    run.data = data;
+    run.size = size;
+
+    for (int b = 0; b < bauds.n; b++)
+    for (int f = 0; f < frames.n; f++)
+    for (int t = 0; t < timeouts.n; t++)
+    for (int e = 0; e < bers.n; e++)
+    for (int p = 0; p < props.n; p++) {
+        memset(&run.params, 0, sizeof(run.params));
+        run.params.baudRate = (int)bauds.v[b];
+        run.params.maxInfo = (int)frames.v[f];
+        run.params.timeout = (int)timeouts.v[t];
+        run.params.nRetransmissions = tries;
+        run.params.recoveryTime = recoveryTime;
+        run.params.cobs = cobs;
+        channel.baudRate = run.params.baudRate;
+        channel.ber = bers.v[e];
+        channel.propDelay = (long long)(props.v[p] * 1000);
+
+        int ok = 0;
+        double seconds = 0;
+        unsigned long retx = 0, timeoutCount = 0, rej = 0;
+        for (int r = 0; r < runs; r++) {
+            channel.seed = seed + r;
+            simulate(&run, &channel);
+            if (run.delivered) {
+                ok++;
+                seconds += run.deliveredAt / 1e9;
+            }
+            retx += run.tx.stats.retransmissions;
+            timeoutCount += run.tx.stats.timeouts;
+            rej += run.rx.stats.rejSent;
+            total++;
+        }
+
+        fprintf(report, "%8d %6d %4d %9.2e %8.0f | %3d/%-2d ", run.params.baudRate, run.params.maxInfo,
+                run.params.timeout, channel.ber, props.v[p], ok, runs);
+        // Time and efficiency (useful bits per second over the line rate)
+        // of the transfers that got through
+        if (ok > 0) {
+            seconds /= ok;
+            fprintf(report, "%10.3f %7.4f", seconds, size * 8.0 / seconds / run.params.baudRate);
+        } else {
+            fprintf(report, "%10s %7s", "-", "-");
+        }
+        fprintf(report, " %7.1f %7.1f %6.1f\n", (double)retx / runs, (double)timeoutCount / runs,
+                (double)rej / runs);
+        fflush(report);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+    fprintf(report, "%d transfers simulated in %.2f s\n", total,
+            wallEnd.tv_sec - wallStart.tv_sec + (wallEnd.tv_nsec - wallStart.tv_nsec) / 1e9);
+    fclose(report);
+    free(data);
+    return 0;
+}
@@ -1,11 +1,19 @@
 // Application layer protocol implementation
 
+#define _FILE_OFFSET_BITS 64 // 64-bit file sizes and offsets on every platform
+
 #include "application_layer.h"
+#include "dedup.h"
 #include "link_layer.h"
+#include "link_bond.h"
 #include "serial_port.h"
 #include "packet_helper.h"
+#include "sha256.h"
+#include "sparse.h"
+#include "trace.h"
 
-#include <stdio.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -13,25 +21,380 @@
 #include <signal.h>
 #include <unistd.h>
 #include <termios.h>
+#include <sys/types.h>
+
+#define DEFAULT_CHUNK_SIZE 1021 // What receivers built before jumbo frames expect
+#define STREAM_NAME "stdin"     // Name announced for data read from a pipe
+
+// Size of a regular file, or FILE_SIZE_UNKNOWN if it cannot be seeked
+// (pipes, FIFOs, character devices). The position is left at the start.
+static uint64_t fileSizeOf(FILE *file)
+{
+    off_t startPos = ftello(file);
+    if (startPos == -1 || fseeko(file, 0, SEEK_END) != 0) {
+        if (errno == ESPIPE)
+            return FILE_SIZE_UNKNOWN;
+        perror("[App] fseek failed");
+        exit(1);
+    }
+
+    off_t endPos = ftello(file);
+    if (endPos == -1) {
+        perror("[App] ftell failed at end");
+        exit(1);
+    }
+
+    if (fseeko(file, startPos, SEEK_SET) != 0) {
+        perror("[App] fseek failed to reset position");
+        exit(1);
+    }
+    return (uint64_t)(endPos - startPos);
+}
+
+// Read up to size bytes. Regular files fill the whole chunk; streams return
+// what is available as soon as there is something, so live data goes out
+// without waiting for a full frame.
+static size_t readChunk(Trace *trace, FILE *file, uint8_t *buffer, size_t size, bool stream)
+{
+    long long start = traceNow(trace);
+    ssize_t n;
+    if (!stream) {
+        n = fread(buffer, 1, size, file);
+    } else {
+        do {
+            n = read(fileno(file), buffer, size);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            perror("[App] read failed");
+            n = 0;
+        }
+    }
+    traceSpan(trace, TRACE_APP, "file read", start, "bytes", n);
+    return (size_t)n;
+}
+
+////////////////////////////////////////////////
+// DEDUP
+////////////////////////////////////////////////
+
+// Transmitter: announce the chunk list, learn which chunks the receiver
+// already has and send the others as DATA packets. A receiver that does not
+// know dedup (e.g. rxd) never answers; it then gets every chunk, in order,
+// which is the plain file.
+// Returns the number of file bytes actually sent.
+static uint64_t sendChunks(LinkContext *link, FILE *file, const ChunkRef *chunks, int nChunks,
+                           size_t packetData, int replyTimeoutMs)
+{
+    for (int i = 0; i < nChunks;) {
+        int sent = sendManifestPacket(link, chunks + i, nChunks - i);
+        if (sent < 0) {
+            fprintf(stderr, "[App] Error sending the chunk list\n");
+            exit(1);
+        }
+        i += sent;
+    }
+
+    bool *have = calloc(nChunks, sizeof(bool));
+    uint8_t *chunk = malloc(CDC_MAX_SIZE);
+    if (!have || !chunk) {
+        perror("[App] malloc");
+        exit(1);
+    }
+
+    int covered = 0;
+    while (covered < nChunks) {
+        const uint8_t *packet, *payload;
+        int len = llreadInPlace_r(link, &packet, replyTimeoutMs);
+        if (len < 0 && link->timeout) {
+            if (covered > 0) {
+                fprintf(stderr, "[App] Receiver stopped answering\n");
+                exit(1);
+            }
+            printf("[App] No answer to the chunk list, sending every chunk\n");
+            break;
+        }
+
+        uint8_t controlType;
+        uint64_t size;
+        char name[MAX_FILENAME_SIZE + 1];
+        int n = len > 0 ? parsePacketInPlace(packet, len, &controlType, &payload, &size, name, NULL) : -1;
+        if (n > 0 && controlType == CF_HAVE)
+            covered += parseHave(payload, n, have, nChunks);
+    }
+
+    int reused = 0;
+    uint64_t reusedBytes = 0, bytesSent = 0;
+    for (int i = 0; i < nChunks; i++) {
+        if (have[i]) {
+            reused++;
+            reusedBytes += chunks[i].size;
+            continue;
+        }
+
+        if (fseeko(file, chunks[i].offset, SEEK_SET) != 0 ||
+            fread(chunk, 1, chunks[i].size, file) != chunks[i].size) {
+            perror("[App] Error reading file");
+            exit(1);
+        }
+        for (uint32_t off = 0; off < chunks[i].size; off += packetData) {
+            uint32_t n = chunks[i].size - off;
+            if (n > packetData)
+                n = packetData;
+            if (sendDataPacket(link, chunk + off, (uint16_t)n) < 0) {
+                fprintf(stderr, "[App] Link lost, transfer aborted\n");
+                exit(1);
+            }
+        }
+        bytesSent += chunks[i].size;
+    }
+
+    printf("[App] Dedup: %d of %d chunks (%" PRIu64 " bytes) already at the receiver, %" PRIu64 " bytes sent\n",
+           reused, nChunks, reusedBytes, bytesSent);
+    free(have);
+    free(chunk);
+    return bytesSent;
+}
+
+// Receiver side of a dedup transfer: chunks come either from the chunk
+// store or, when missing, from DATA packets, and are written in file order.
+typedef struct
+{
+    const char *store;
+    ChunkRef *chunks;
+    bool *have;       // Chunk is in the store (not sent by the transmitter)
+    uint32_t count;
+    uint32_t next;    // Next chunk to write
+    uint8_t *buf;     // Chunk being assembled or read from the store
+    uint32_t filled;
+} ChunkAssembly;
+
+// Write the chunks taken from the store, from a->next up to the next one
+// the transmitter has to send. Returns -1 if the store failed us.
+static int writeStoredChunks(ChunkAssembly *a, FILE *out, Sha256 *digestCtx, uint64_t *bytes)
+{
+    for (; a->next < a->count && a->have[a->next]; a->next++) {
+        const ChunkRef *c = &a->chunks[a->next];
+        if (chunkStoreGet(a->store, c, a->buf) < 0) {
+            fprintf(stderr, "[App] ❌ Chunk %u vanished from the chunk store\n", a->next);
+            return -1;
+        }
+        fwrite(a->buf, 1, c->size, out);
+        sha256Update(digestCtx, a->buf, c->size);
+        *bytes += c->size;
+    }
+    return 0;
+}
+
+// Receive the chunk list announced by START and tell the transmitter which
+// chunks the store already has. Returns 0 or -1 on error.
+static int receiveChunkList(LinkContext *link, ChunkAssembly *a, uint32_t count, const char *store)
+{
+    memset(a, 0, sizeof(*a));
+    a->store = store;
+    a->count = count;
+    a->chunks = malloc(count * sizeof(ChunkRef));
+    a->have = calloc(count, sizeof(bool));
+    a->buf = malloc(CDC_MAX_SIZE);
+    if (!a->chunks || !a->have || !a->buf) {
+        perror("[App] malloc");
+        return -1;
+    }
+    if (chunkStoreOpen(store) < 0)
+        return -1;
+
+    uint32_t received = 0;
+    while (received < count) {
+        uint8_t controlType;
+        const uint8_t *payload;
+        uint64_t size;
+        char name[MAX_FILENAME_SIZE + 1];
+        int len = receivePacketInPlace(link, &controlType, &payload, &size, name, NULL);
+        if (len > 0 && controlType == CF_MANIFEST)
+            received += parseManifest(payload, len, a->chunks + received, count - received);
+    }
+
+    int reused = 0;
+    uint64_t reusedBytes = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (a->chunks[i].size == 0 || a->chunks[i].size > CDC_MAX_SIZE) {
+            fprintf(stderr, "[App] ❌ Invalid chunk size %u in the chunk list\n", a->chunks[i].size);
+            return -1;
+        }
+        a->have[i] = chunkStoreGet(store, &a->chunks[i], a->buf) == 0;
+        if (a->have[i]) {
+            reused++;
+            reusedBytes += a->chunks[i].size;
+        }
+    }
+    printf("[App] Dedup: %d of %u chunks (%" PRIu64 " bytes) found in %s\n", reused, count, reusedBytes, store);
+
+    for (uint32_t i = 0; i < count;) {
+        int sent = sendHavePacket(link, i, a->have + i, count - i);
+        if (sent < 0)
+            return -1;
+        i += sent;
+    }
+    return 0;
+}
+
+// Add DATA to the chunk being assembled; once complete, check it, keep it
+// in the store and write it out with the stored chunks that follow.
+static int receiveChunkData(ChunkAssembly *a, const uint8_t *data, int len, FILE *out,
+                            Sha256 *digestCtx, uint64_t *bytes)
+{
+    if (a->next >= a->count || a->filled + len > a->chunks[a->next].size) {
+        fprintf(stderr, "[App] ❌ DATA does not match the chunk list\n");
+        return -1;
+    }
+    memcpy(a->buf + a->filled, data, len);
+    a->filled += len;
 
-#define DATA_BUFFER_SIZE 1021
+    const ChunkRef *c = &a->chunks[a->next];
+    if (a->filled < c->size)
+        return 0;
+
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    Sha256 ctx;
+    sha256Init(&ctx);
+    sha256Update(&ctx, a->buf, c->size);
+    sha256Final(&ctx, hash);
+    if (memcmp(hash, c->hash, SHA256_DIGEST_SIZE) == 0)
+        chunkStorePut(a->store, c, a->buf);
+    else
+        fprintf(stderr, "[App] ❌ Chunk %u does not match its hash\n", a->next);
+
+    fwrite(a->buf, 1, c->size, out);
+    sha256Update(digestCtx, a->buf, c->size);
+    *bytes += c->size;
+    a->next++;
+    a->filled = 0;
+    return writeStoredChunks(a, out, digestCtx, bytes);
+}
+
+static void freeChunkAssembly(ChunkAssembly *a)
+{
+    free(a->chunks);
+    free(a->have);
+    free(a->buf);
+}
+
+////////////////////////////////////////////////
+// SPARSE FILES
+////////////////////////////////////////////////
+
+// Transmitter: send the data regions of the file as DATA and the holes
+// between them as HOLE packets. Chunks of data that turn out to be all
+// zeros (e.g. preallocated space) join the hole around them.
+// Returns the number of file bytes covered, holes included.
+static uint64_t sendSparse(LinkContext *link, FILE *file, uint64_t fileSize, uint8_t *buffer,
+                           size_t chunkSize, Sha256 *digestCtx)
+{
+    uint64_t offset = 0, hole = 0, holeBytes = 0;
+    while (offset < fileSize || hole > 0) {
+        uint64_t dataStart, dataEnd;
+        if (sparseNextData(fileno(file), offset, fileSize, &dataStart, &dataEnd) < 0 ||
+            fseeko(file, (off_t)dataStart, SEEK_SET) != 0) {
+            perror("[App] Error reading file");
+            exit(1);
+        }
+        hole += dataStart - offset;
+        offset = dataStart;
+
+        // Send the hole before the next chunk that has data, or at the end
+        while (offset < dataEnd || (hole > 0 && dataStart == fileSize)) {
+            size_t n = 0;
+            if (offset < dataEnd) {
+                n = dataEnd - offset < chunkSize ? (size_t)(dataEnd - offset) : chunkSize;
+                if (readChunk(link->trace, file, buffer, n, FALSE) != n) {
+                    fprintf(stderr, "[App] Error reading file (did it shrink?)\n");
+                    exit(1);
+                }
+                offset += n;
+                if (sparseIsZero(buffer, n)) {
+                    hole += n;
+                    continue;
+                }
+            }
+
+            if (hole > 0) {
+                long long sendStart = traceNow(link->trace);
+                if (sendHolePacket(link, hole) < 0) {
+                    fprintf(stderr, "[App] Link lost, transfer aborted\n");
+                    exit(1);
+                }
+                traceSpan(link->trace, TRACE_APP, "send hole", sendStart, "bytes", hole);
+                sparseHashZeros(digestCtx, hole);
+                holeBytes += hole;
+                hole = 0;
+            }
+            if (n > 0) {
+                long long sendStart = traceNow(link->trace);
+                if (sendDataPacket(link, buffer, (uint16_t)n) < 0) {
+                    fprintf(stderr, "[App] Link lost after %" PRIu64 " bytes, transfer aborted\n", offset - n);
+                    exit(1);
+                }
+                traceSpan(link->trace, TRACE_APP, "send packet", sendStart, "bytes", n);
+                sha256Update(digestCtx, buffer, n);
+            }
+        }
+    }
+
+    printf("[App] Sparse: %" PRIu64 " of %" PRIu64 " bytes sent as holes\n", holeBytes, fileSize);
+    return offset;
+}
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename)
 {
+    applicationLayerWithOptions(serialPort, role, baudRate, nTries, timeout, filename, NULL);
+}
+
+void applicationLayerWithOptions(const char *serialPort, const char *role, int baudRate,
+                                 int nTries, int timeout, const char *filename,
+                                 const AppOptions *options)
+{
+    AppOptions defaults;
+    memset(&defaults, 0, sizeof(defaults));
+    if (options == NULL)
+        options = &defaults;
+
+    // "-" streams from stdin (tx) or to stdout (rx). On the receiver the
+    // protocol messages then go to stderr so they do not mix with the data
+    // (including whatever is still buffered in stdout, so no fflush here).
+    bool stream = strcmp(filename, "-") == 0;
+    int dataFd = -1;
+    if (stream && strcmp(role, "rx") == 0) {
+        dataFd = dup(STDOUT_FILENO);
+        if (dataFd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+            perror("[App] dup");
+            exit(1);
+        }
+    }
+
     LinkLayer connectionParameters;
     memset(&connectionParameters, 0, sizeof(connectionParameters));
 
     // Fill connection parameters
-    strcpy(connectionParameters.serialPort, serialPort);
+    snprintf(connectionParameters.serialPort, sizeof(connectionParameters.serialPort), "%s", serialPort);
     connectionParameters.baudRate = baudRate;
     connectionParameters.nRetransmissions = nTries;
     connectionParameters.timeout = timeout;
     connectionParameters.role = (strcmp(role, "tx") == 0) ? LlTx : LlRx;
+    connectionParameters.maxInfo = options->frameSize;
+    connectionParameters.recoveryTime = options->recoveryTime;
+    connectionParameters.cobs = options->cobs;
+    connectionParameters.traceFile = options->traceFile;
+    connectionParameters.serial = options->serial;
 
     // Open the data link layer connection
+    LinkContext link;
+    memset(&link, 0, sizeof(link));
+
     printf("Opening connection on %s as %s...\n", serialPort, role);
-    int status = llopen(connectionParameters);
+    // A comma-separated list of ports selects a bonded link
+    int status = strchr(serialPort, ',') != NULL
+                     ? llopenBonded(&link, connectionParameters, serialPort)
+                     : llopen_r(&link, connectionParameters);
 
     if (status < 0) {
         fprintf(stderr, "Error: Failed to establish link layer connection.\n");
@@ -40,64 +403,128 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
 
     printf("Link layer connection established successfully!\n");
 
+    // SHA-256 of the file contents, computed while the data goes through
+    Sha256 digestCtx;
+    sha256Init(&digestCtx);
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char digestHex[2 * SHA256_DIGEST_SIZE + 1];
+    bool failed = FALSE;
+
     switch (connectionParameters.role) {
         case LlTx: {
             // -------------------
             // TRANSMITTER
             // -------------------
 
-            FILE *file = fopen(filename, "rb");
+            FILE *file = stream ? stdin : fopen(filename, "rb");
             if (!file) {
                 perror("[App] Error opening file");
                 exit(1);
             }
-            printf("[App] Successfully opened file: %s\n", filename);
+            printf("[App] Successfully opened file: %s\n", stream ? STREAM_NAME : filename);
 
-            // Store current position (should be 0)
-            long startPos = ftell(file);
-            if (startPos == -1L) {
-                perror("[App] ftell failed at start");
-                exit(1);
+            // Files that cannot be seeked are sent as a stream too
+            uint64_t fileSize = fileSizeOf(file);
+            if (fileSize == FILE_SIZE_UNKNOWN) {
+                stream = TRUE;
+                printf("[App] File size: unknown, streaming until end of input\n");
+            } else {
+                printf("[App] File size: %" PRIu64 " bytes\n", fileSize);
             }
 
-            // Seek to end
-            if (fseek(file, 0, SEEK_END) != 0) {
-                perror("[App] fseek failed");
-                exit(1);
-            }
+            const char *announcedName = strcmp(filename, "-") == 0 ? STREAM_NAME : filename;
 
-            // Calculate file size
-            long endPos = ftell(file);
-            if (endPos == -1L) {
-                perror("[App] ftell failed at end");
-                exit(1);
+            // DATA packets are as large as the negotiated frames allow.
+            // Without jumbo frames keep the historical chunk size.
+            size_t chunkSize = link.caps.maxInfo - 3; // C L2 L1
+            if (link.caps.maxInfo <= DEFAULT_INFO_SIZE && chunkSize > DEFAULT_CHUNK_SIZE)
+                chunkSize = DEFAULT_CHUNK_SIZE;
+
+            // Dedup needs to read the file twice, a receiver that can
+            // answer and frames a chunk list entry fits in, so not on
+            // streams or bonded links
+            bool dedup = options->dedup && !stream;
+            if (options->dedup &&
+                (!dedup || !link.extended || link.bond != NULL || link.caps.maxInfo < MIN_DEDUP_INFO_SIZE)) {
+                printf("[App] Dedup not available here, sending the whole file\n");
+                dedup = FALSE;
             }
 
-            uint32_t fileSize = (uint32_t)(endPos - startPos);
-            printf("[App] File size: %u bytes\n", fileSize);
+            ControlInfo info;
+            memset(&info, 0, sizeof(info));
+            ChunkRef *chunks = NULL;
+            if (dedup) {
+                int nChunks = cdcChunkFile(file, &chunks, digest);
+                if (nChunks < 0) {
+                    perror("[App] Error reading file");
+                    exit(1);
+                }
+                info.chunkCount = nChunks;
+                printf("[App] File split into %d chunks\n", nChunks);
+            }
 
-            // Return to starting position
-            if (fseek(file, startPos, SEEK_SET) != 0) {
-                perror("[App] fseek failed to reset position");
+            // Send START control packet
+            if (sendControlPacket(&link, CF_START, fileSize, announcedName, &info) < 0) {
+                fprintf(stderr, "[App] Link lost, transfer aborted\n");
                 exit(1);
             }
 
+            // Peers from before the capability exchange predate HOLE
+            // packets too; holes are then sent as zeros
+            bool sparse = !stream && link.extended;
 
-            // Send START control packet
-            sendControlPacket(CF_START, fileSize, filename);
-
-            // Send DATA packets
-            uint8_t buffer[DATA_BUFFER_SIZE];
-            size_t bytesRead;
-            while ((bytesRead = fread(buffer, 1, DATA_BUFFER_SIZE, file)) > 0) {
-                sendDataPacket(buffer, (uint16_t)bytesRead);
-                printf("Sent data packet");
+            uint64_t bytesSent = 0;
+            if (info.chunkCount > 0) {
+                sendChunks(&link, file, chunks, info.chunkCount, chunkSize,
+                           nTries * timeout * 1000);
+                bytesSent = fileSize;
+            }
+            else {
+                // Send DATA packets
+                uint8_t *buffer = malloc(chunkSize);
+                if (!buffer) {
+                    perror("[App] malloc");
+                    exit(1);
+                }
+                if (sparse) {
+                    bytesSent = sendSparse(&link, file, fileSize, buffer, chunkSize, &digestCtx);
+                }
+                else {
+                    size_t bytesRead;
+                    while ((bytesRead = readChunk(link.trace, file, buffer, chunkSize, stream)) > 0) {
+                        // A chunk that did not make it would leave a hole in
+                        // the file; stop here rather than carry on
+                        long long sendStart = traceNow(link.trace);
+                        if (sendDataPacket(&link, buffer, (uint16_t)bytesRead) < 0) {
+                            fprintf(stderr, "[App] Link lost after %" PRIu64 " bytes, transfer aborted\n",
+                                    bytesSent);
+                            exit(1);
+                        }
+                        traceSpan(link.trace, TRACE_APP, "send packet", sendStart, "bytes", bytesRead);
+                        sha256Update(&digestCtx, buffer, bytesRead);
+                        bytesSent += bytesRead;
+                        printf("Sent data packet");
+                    }
+                }
+                free(buffer);
+                sha256Final(&digestCtx, digest);
             }
+            free(chunks);
 
-            // Send END control packet
-            sendControlPacket(CF_END, fileSize, filename);
+            // Send END control packet; for a stream it tells the final size.
+            // The digest lets the receiver check the whole file.
+            sha256Hex(digest, digestHex);
+            printf("[App] SHA-256: %s\n", digestHex);
+            info.chunkCount = 0;
+            info.hasDigest = TRUE;
+            memcpy(info.sha256, digest, SHA256_DIGEST_SIZE);
+            if (sendControlPacket(&link, CF_END, bytesSent, announcedName, &info) < 0) {
+                fprintf(stderr, "[App] Link lost, transfer aborted\n");
+                exit(1);
+            }
 
-            fclose(file);
+            if (file != stdin)
+                fclose(file);
             printf("[App] File transmission complete!\n");
             break;
         }
@@ -106,39 +533,102 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
             // -------------------
             // RECEIVER
             // -------------------
-            uint32_t fileSize = 0;
+            uint64_t fileSize = 0;
             char receivedFilename[MAX_FILENAME_SIZE + 1];
             uint8_t controlType;
-            uint8_t dataBuffer[DATA_BUFFER_SIZE];
+            const uint8_t *payload; // In the link's frame buffer, no copy
+            ControlInfo expected;
 
             // Wait for START control packet
             while (1) {
-                if (receivePacket(&controlType, dataBuffer, &fileSize, receivedFilename) == 0 &&
+                if (receivePacketInPlace(&link, &controlType, &payload, &fileSize, receivedFilename, &expected) == 0 &&
                     controlType == CF_START)
                     break;
             }
 
-            FILE *out = fopen(filename, "wb");
+            FILE *out = stream ? fdopen(dataFd, "wb") : fopen(filename, "wb");
             if (!out) {
                 perror("[App] Error creating output file");
                 exit(1);
             }
 
-            uint32_t bytesReceived = 0;
+            // In dedup mode the chunk list comes first, and DATA only
+            // carries the chunks missing from the store
+            ChunkAssembly chunks;
+            memset(&chunks, 0, sizeof(chunks));
+            bool dedup = expected.chunkCount > 0;
+            uint64_t bytesReceived = 0;
+            if (dedup) {
+                const char *store = options->chunkStore ? options->chunkStore : DEFAULT_CHUNK_STORE;
+                if (receiveChunkList(&link, &chunks, expected.chunkCount, store) < 0 ||
+                    writeStoredChunks(&chunks, out, &digestCtx, &bytesReceived) < 0)
+                    failed = TRUE;
+            }
+
             while (1) {
-                int len = receivePacket(&controlType, dataBuffer, &fileSize, receivedFilename);
+                long long receiveStart = traceNow(link.trace);
+                int len = receivePacketInPlace(&link, &controlType, &payload, &fileSize, receivedFilename, &expected);
+                traceSpan(link.trace, TRACE_APP, "receive packet", receiveStart, "bytes", len);
                 if (len < 0) continue;
 
+                long long writeStart = traceNow(link.trace);
+
                 if (controlType == CF_END) break;
-                if (controlType == CF_DATA) {
-                    fwrite(dataBuffer, 1, len, out);
+                if (controlType == CF_DATA && dedup) {
+                    if (!failed && receiveChunkData(&chunks, payload, len, out, &digestCtx, &bytesReceived) < 0)
+                        failed = TRUE;
+                }
+                else if (controlType == CF_DATA) {
+                    fwrite(payload, 1, len, out);
+                    sha256Update(&digestCtx, payload, len);
                     bytesReceived += len;
                 }
+                else if (controlType == CF_HOLE) {
+                    uint64_t holeSize;
+                    if (parseHole(payload, len, &holeSize) < 0 || sparseSkip(out, holeSize) < 0) {
+                        fprintf(stderr, "[App] ❌ Could not leave a hole in the output\n");
+                        failed = TRUE;
+                        continue;
+                    }
+                    sparseHashZeros(&digestCtx, holeSize);
+                    bytesReceived += holeSize;
+                }
+                // Hand stream data on right away
+                if (stream)
+                    fflush(out);
+                traceSpan(link.trace, TRACE_APP, "file write", writeStart, "bytes", len);
             }
 
+            // A hole at the end still counts towards the size
+            if (sparseFinish(out) < 0) {
+                perror("[App] Error writing output file");
+                failed = TRUE;
+            }
             fclose(out);
-            printf("[App] File received successfully: %u bytes written to %s\n",
-                   bytesReceived, receivedFilename);
+            freeChunkAssembly(&chunks);
+
+            // Check the file against the END packet before calling it a success
+            sha256Final(&digestCtx, digest);
+            sha256Hex(digest, digestHex);
+            printf("[App] SHA-256: %s\n", digestHex);
+            if (fileSize != FILE_SIZE_UNKNOWN && fileSize != bytesReceived) {
+                fprintf(stderr, "[App] ❌ Expected %" PRIu64 " bytes, received %" PRIu64 "\n",
+                        fileSize, bytesReceived);
+                failed = TRUE;
+            }
+            else if (!expected.hasDigest) {
+                printf("[App] Sender did not send a digest, file not verified\n");
+            }
+            else if (memcmp(expected.sha256, digest, SHA256_DIGEST_SIZE) != 0) {
+                sha256Hex(expected.sha256, digestHex);
+                fprintf(stderr, "[App] ❌ Digest mismatch, sender has %s\n", digestHex);
+                failed = TRUE;
+            }
+
+            if (!failed)
+                printf("[App] File received successfully: %" PRIu64 " bytes written to %s%s\n",
+                       bytesReceived, stream ? "stdout" : receivedFilename,
+                       expected.hasDigest ? " (digest verified)" : "");
             break;
         }
 
@@ -149,6 +639,24 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
 
     // Close connection
     printf("Closing connection...\n");
-    llclose(connectionParameters);
+    // A bonded transmitter still has packets queued when it closes
+    bool bonded = link.bond != NULL;
+    if (llclose_r(&link) < 0 && bonded && connectionParameters.role == LlTx) {
+        fprintf(stderr, "[App] Link lost, transfer aborted\n");
+        failed = TRUE;
+    }
     printf("Connection closed.\n");
+
+    if (options->histogramFile != NULL) {
+        FILE *csv = fopen(options->histogramFile, "w");
+        if (csv == NULL) {
+            perror(options->histogramFile);
+        } else {
+            llexportHistograms_r(&link, csv);
+            fclose(csv);
+        }
+    }
+
+    if (failed)
+        exit(1);
 }
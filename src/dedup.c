@@ -0,0 +1,194 @@
+// Chunk deduplication implementation
+
+#define _FILE_OFFSET_BITS 64
+
+#include "dedup.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////
+// CHUNKER
+////////////////////////////////////////////////
+
+// Gear hash: the hash shifts one bit per byte, so its top bits depend on
+// the last ~50 bytes only, and a cut is made when they are all zero.
+static uint64_t gear[256];
+
+static void gearInit(void)
+{
+    static bool ready = false;
+    if (ready)
+        return;
+
+    // Fixed seed: every build must cut the same data at the same places
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < 256; i++) {
+        x += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    ready = true;
+}
+
+// Size of the chunk starting at data, given len bytes available. len must
+// be at least CDC_MAX_SIZE unless the data ends there.
+static size_t cdcCut(const uint8_t *data, size_t len)
+{
+    if (len <= CDC_MIN_SIZE)
+        return len;
+    if (len > CDC_MAX_SIZE)
+        len = CDC_MAX_SIZE;
+
+    const uint64_t mask = ~0ULL << (64 - CDC_AVG_BITS);
+    uint64_t h = 0;
+    for (size_t i = 0; i < len; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (i >= CDC_MIN_SIZE && (h & mask) == 0)
+            return i + 1;
+    }
+    return len;
+}
+
+int cdcChunkFile(FILE *file, ChunkRef **chunks, uint8_t fileDigest[SHA256_DIGEST_SIZE])
+{
+    gearInit();
+
+    off_t start = ftello(file);
+    if (start == -1)
+        return -1;
+
+    uint8_t *buf = malloc(CDC_MAX_SIZE);
+    int capacity = 256, count = 0;
+    ChunkRef *list = malloc(capacity * sizeof(ChunkRef));
+    if (buf == NULL || list == NULL) {
+        free(buf);
+        free(list);
+        return -1;
+    }
+
+    Sha256 whole;
+    sha256Init(&whole);
+
+    uint64_t offset = (uint64_t)start;
+    size_t have = 0;
+    bool eof = false;
+    while (true) {
+        // Keep a full window so that cuts do not depend on read sizes
+        while (!eof && have < CDC_MAX_SIZE) {
+            size_t n = fread(buf + have, 1, CDC_MAX_SIZE - have, file);
+            if (n == 0)
+                eof = true;
+            have += n;
+        }
+        if (have == 0)
+            break;
+
+        size_t size = cdcCut(buf, have);
+
+        if (count == capacity) {
+            capacity *= 2;
+            ChunkRef *bigger = realloc(list, capacity * sizeof(ChunkRef));
+            if (bigger == NULL) {
+                free(buf);
+                free(list);
+                return -1;
+            }
+            list = bigger;
+        }
+
+        ChunkRef *c = &list[count++];
+        c->offset = offset;
+        c->size = size;
+        Sha256 ctx;
+        sha256Init(&ctx);
+        sha256Update(&ctx, buf, size);
+        sha256Final(&ctx, c->hash);
+        sha256Update(&whole, buf, size);
+
+        offset += size;
+        have -= size;
+        memmove(buf, buf + size, have);
+    }
+
+    free(buf);
+    if (ferror(file) || fseeko(file, start, SEEK_SET) != 0) {
+        free(list);
+        return -1;
+    }
+
+    sha256Final(&whole, fileDigest);
+    *chunks = list;
+    return count;
+}
+
+////////////////////////////////////////////////
+// CHUNK STORE
+////////////////////////////////////////////////
+
+static void chunkPath(const char *dir, const uint8_t hash[SHA256_DIGEST_SIZE], char *path, size_t size)
+{
+    char hex[2 * SHA256_DIGEST_SIZE + 1];
+    sha256Hex(hash, hex);
+    snprintf(path, size, "%s/%s", dir, hex);
+}
+
+int chunkStoreOpen(const char *dir)
+{
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    return 0;
+}
+
+int chunkStoreGet(const char *dir, const ChunkRef *chunk, uint8_t *data)
+{
+    char path[1024];
+    chunkPath(dir, chunk->hash, path, sizeof(path));
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    size_t n = fread(data, 1, chunk->size, f);
+    bool longer = fgetc(f) != EOF;
+    fclose(f);
+    if (n != chunk->size || longer)
+        return -1;
+
+    // A damaged chunk is as good as missing
+    uint8_t hash[SHA256_DIGEST_SIZE];
+    Sha256 ctx;
+    sha256Init(&ctx);
+    sha256Update(&ctx, data, chunk->size);
+    sha256Final(&ctx, hash);
+    return memcmp(hash, chunk->hash, SHA256_DIGEST_SIZE) == 0 ? 0 : -1;
+}
+
+int chunkStorePut(const char *dir, const ChunkRef *chunk, const uint8_t *data)
+{
+    char path[1024], tmp[1100];
+    chunkPath(dir, chunk->hash, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+    // Written aside and renamed, so a chunk file is always complete
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        perror(tmp);
+        return -1;
+    }
+    bool ok = fwrite(data, 1, chunk->size, f) == chunk->size;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        perror(path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
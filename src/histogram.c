@@ -0,0 +1,96 @@
+// Histogram implementation
+
+#include "histogram.h"
+
+#include <inttypes.h>
+
+#define HISTOGRAM_LIMIT ((1ULL << HISTOGRAM_MAX_BITS) - 1)
+
+// Values below HISTOGRAM_SUB_BUCKETS have a bucket each; above, a bucket
+// holds the values sharing their top HISTOGRAM_SUB_BITS + 1 bits.
+static int bucketOf(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (int)value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+static uint64_t bucketLow(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    return (uint64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+static uint64_t bucketHigh(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    return bucketLow(bucket) + (1ULL << (bucket / HISTOGRAM_SUB_BUCKETS - 1)) - 1;
+}
+
+void histogramRecord(Histogram *h, uint64_t value)
+{
+    if (value > HISTOGRAM_LIMIT)
+        value = HISTOGRAM_LIMIT;
+    h->counts[bucketOf(value)]++;
+    if (h->total == 0 || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->total++;
+    h->sum += value;
+}
+
+uint64_t histogramPercentile(const Histogram *h, double percentile)
+{
+    if (h->total == 0)
+        return 0;
+
+    // Rank of the value wanted, counting from 1
+    uint64_t rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return bucketHigh(i) < h->max ? bucketHigh(i) : h->max;
+    }
+    return h->max;
+}
+
+void histogramPrint(const Histogram *h, const char *name, const char *unit)
+{
+    if (h->total == 0)
+        return;
+    printf("%-22s n=%" PRIu64 " mean=%.1f min=%" PRIu64 " p50=%" PRIu64 " p90=%" PRIu64
+           " p99=%" PRIu64 " p99.9=%" PRIu64 " max=%" PRIu64 "%s%s\n",
+           name, h->total, (double)h->sum / h->total, h->min, histogramPercentile(h, 50),
+           histogramPercentile(h, 90), histogramPercentile(h, 99), histogramPercentile(h, 99.9), h->max,
+           *unit != '\0' ? " " : "", unit);
+}
+
+void histogramMerge(Histogram *h, const Histogram *from)
+{
+    if (from->total == 0)
+        return;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        h->counts[i] += from->counts[i];
+    if (h->total == 0 || from->min < h->min)
+        h->min = from->min;
+    if (from->max > h->max)
+        h->max = from->max;
+    h->total += from->total;
+    h->sum += from->sum;
+}
+
+void histogramExport(const Histogram *h, const char *name, FILE *out)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        if (h->counts[i] > 0)
+            fprintf(out, "%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", name, bucketLow(i), bucketHigh(i), h->counts[i]);
+}
@@ -0,0 +1,543 @@
+// Link aggregation implementation
+//
+// Every packet written to a bonded link gets a small header (type and a
+// 32-bit bond sequence number) and is sent on one of the member links. Each
+// member is an ordinary LinkContext, with its own stop-and-wait sequence
+// numbers, driven by its own thread. On the receiver, packets are put back
+// in bond order before llread_r returns them.
+//
+// A member takes the next queued packet only if no other member is expected
+// to finish sending it sooner, judging by each member's measured throughput.
+// Slow or noisy ports therefore carry proportionally less traffic instead of
+// holding back the faster ones.
+
+#include "link_bond.h"
+#include "link_layer.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BOND_DATA 0x00
+#define BOND_FIN  0x01 // Last frame a member sends before llclose
+
+#define BOND_RING_SIZE (BOND_QUEUE_SIZE + BOND_MAX_PORTS)
+
+typedef struct
+{
+    unsigned char *data; // packetCapacity bytes
+    int size;            // Including the bond header
+    uint32_t seq;
+} BondPacket;
+
+typedef struct
+{
+    LinkContext link;
+    struct LinkBond *bond;
+    pthread_t thread;
+    bool opened;         // llopen_r succeeded
+    bool alive;          // Still carrying traffic
+    bool finished;       // Thread is done (FIN sent / received)
+    double rate;         // Measured throughput in bytes/s (tx)
+    bool busy;           // Currently sending a packet (tx)
+    BondPacket pkt;      // Packet being sent (tx); buffers are swapped with the queue
+    uint32_t inFlight;   // Sequence number being sent (tx)
+    long long busyUntil; // Estimated completion of the current packet, ms (tx)
+    char traceFile[256]; // This member's trace, when the bond has one
+} BondMember;
+
+struct LinkBond
+{
+    LinkLayerRole role;
+    int packetCapacity;  // Largest packet including the bond header
+    BondMember members[BOND_MAX_PORTS];
+    int nMembers;
+    int nOpenDone;       // Members that returned from llopen_r
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    uint32_t nextSeq;    // tx: next sequence number to assign, rx: next to deliver
+    volatile bool closing; // tx: no more packets will be queued, rx: members stop waiting for SET
+
+    BondPacket *queue;   // tx: ring of packets waiting for a member
+    int qHead;
+    int qCount;
+
+    BondPacket *window;  // rx: reorder buffer indexed by seq % BOND_WINDOW
+    bool filled[BOND_WINDOW];
+};
+
+static long long nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void waitChanged(struct LinkBond *bond, int ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)ms * 1000000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&bond->changed, &bond->lock, &ts);
+}
+
+static void putHeader(unsigned char *p, unsigned char type, uint32_t seq)
+{
+    p[0] = type;
+    p[1] = (seq >> 24) & 0xFF;
+    p[2] = (seq >> 16) & 0xFF;
+    p[3] = (seq >> 8) & 0xFF;
+    p[4] = seq & 0xFF;
+}
+
+static bool anyAlive(const struct LinkBond *bond)
+{
+    for (int i = 0; i < bond->nMembers; i++)
+        if (bond->members[i].alive)
+            return TRUE;
+    return FALSE;
+}
+
+////////////////////////////////////////////////
+// TRANSMITTER
+////////////////////////////////////////////////
+
+// Lowest sequence number not yet acknowledged.
+static uint32_t oldestUnacked(const struct LinkBond *bond)
+{
+    uint32_t oldest = bond->qCount > 0 ? bond->queue[bond->qHead].seq : bond->nextSeq;
+    for (int i = 0; i < bond->nMembers; i++) {
+        const BondMember *o = &bond->members[i];
+        if (o->busy && (int32_t)(o->inFlight - oldest) < 0)
+            oldest = o->inFlight;
+    }
+    return oldest;
+}
+
+// Estimated time (ms) at which member "o" would finish sending "size" bytes
+// if it took them now.
+static double finishTime(const BondMember *o, int size, long long now)
+{
+    double start = now;
+    if (o->busy) {
+        // A member past its estimate is probably retransmitting; assume it
+        // needs at least as long again as it has already overrun.
+        start = o->busyUntil >= now ? o->busyUntil : now + (now - o->busyUntil);
+    }
+    return start + size * 1000.0 / o->rate;
+}
+
+// Whether member "m" should send the packet at the head of the queue.
+static bool shouldTake(const struct LinkBond *bond, const BondMember *m)
+{
+    if (bond->qCount == 0)
+        return FALSE;
+
+    const BondPacket *head = &bond->queue[bond->qHead];
+    if (head->seq - oldestUnacked(bond) >= BOND_WINDOW)
+        return FALSE;
+
+    long long now = nowMs();
+    double mine = finishTime(m, head->size, now);
+    for (int i = 0; i < bond->nMembers; i++) {
+        const BondMember *o = &bond->members[i];
+        if (o == m || !o->alive)
+            continue;
+        if (finishTime(o, head->size, now) < mine)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void *txMember(void *arg)
+{
+    BondMember *m = arg;
+    struct LinkBond *bond = m->bond;
+
+    pthread_mutex_lock(&bond->lock);
+    while (m->alive) {
+        while (!shouldTake(bond, m) && !(bond->closing && bond->qCount == 0))
+            waitChanged(bond, 20);
+
+        if (bond->qCount == 0)
+            break; // closing
+
+        BondPacket *slot = &bond->queue[bond->qHead];
+        BondPacket pkt = *slot;
+        slot->data = m->pkt.data; // The slot keeps our spare buffer
+        m->pkt = pkt;
+        bond->qHead = (bond->qHead + 1) % BOND_RING_SIZE;
+        bond->qCount--;
+        m->busy = TRUE;
+        m->inFlight = pkt.seq;
+        long long start = nowMs();
+        m->busyUntil = start + (long long)(pkt.size * 1000.0 / m->rate);
+        pthread_cond_broadcast(&bond->changed);
+        pthread_mutex_unlock(&bond->lock);
+
+        int r = llwrite_r(&m->link, pkt.data, pkt.size);
+        long long elapsed = nowMs() - start;
+
+        pthread_mutex_lock(&bond->lock);
+        m->busy = FALSE;
+        if (r < 0) {
+            // Hand the packet back to the other members
+            printf("[bond] %s failed, removing it from the bond\n", m->link.params.serialPort);
+            m->alive = FALSE;
+            bond->qHead = (bond->qHead + BOND_RING_SIZE - 1) % BOND_RING_SIZE;
+            slot = &bond->queue[bond->qHead];
+            unsigned char *spare = slot->data;
+            *slot = m->pkt;
+            m->pkt.data = spare;
+            bond->qCount++;
+        } else {
+            double sample = pkt.size * 1000.0 / (elapsed > 0 ? elapsed : 1);
+            m->rate = 0.75 * m->rate + 0.25 * sample;
+        }
+        pthread_cond_broadcast(&bond->changed);
+    }
+    pthread_mutex_unlock(&bond->lock);
+
+    if (m->alive) {
+        unsigned char fin[BOND_HEADER_SIZE];
+        putHeader(fin, BOND_FIN, 0);
+        llwrite_r(&m->link, fin, sizeof(fin));
+    }
+
+    pthread_mutex_lock(&bond->lock);
+    m->finished = TRUE;
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+    return NULL;
+}
+
+int bondWrite(struct LinkBond *bond, const struct iovec *iov, int iovcnt)
+{
+    int bufSize = 0;
+    for (int i = 0; i < iovcnt; i++)
+        bufSize += iov[i].iov_len;
+    if (bufSize + BOND_HEADER_SIZE > bond->packetCapacity)
+        return -1;
+
+    pthread_mutex_lock(&bond->lock);
+    while (bond->qCount >= BOND_QUEUE_SIZE && anyAlive(bond))
+        waitChanged(bond, 100);
+
+    if (!anyAlive(bond)) {
+        pthread_mutex_unlock(&bond->lock);
+        printf("[bond] No member link left\n");
+        return -1;
+    }
+
+    int tail = (bond->qHead + bond->qCount) % BOND_RING_SIZE;
+    BondPacket *pkt = &bond->queue[tail];
+    pkt->seq = bond->nextSeq++;
+    pkt->size = bufSize + BOND_HEADER_SIZE;
+    putHeader(pkt->data, BOND_DATA, pkt->seq);
+    unsigned char *data = pkt->data + BOND_HEADER_SIZE;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(data, iov[i].iov_base, iov[i].iov_len);
+        data += iov[i].iov_len;
+    }
+    bond->qCount++;
+
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+    return bufSize;
+}
+
+////////////////////////////////////////////////
+// RECEIVER
+////////////////////////////////////////////////
+
+static void *rxMember(void *arg)
+{
+    BondMember *m = arg;
+    struct LinkBond *bond = m->bond;
+    unsigned char frame[MAX_INFO_SIZE];
+
+    while (TRUE) {
+        int len = llread_r(&m->link, frame);
+        if (len < BOND_HEADER_SIZE)
+            continue; // Rejected or duplicate frame
+
+        if (frame[0] == BOND_FIN)
+            break;
+
+        uint32_t seq = ((uint32_t)frame[1] << 24) | (frame[2] << 16) | (frame[3] << 8) | frame[4];
+
+        // Don't get cancelled by bondClose while holding the lock
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(&bond->lock);
+        while (seq - bond->nextSeq >= BOND_WINDOW && (int32_t)(seq - bond->nextSeq) > 0)
+            waitChanged(bond, 100);
+
+        // Anything behind nextSeq was already delivered
+        if ((int32_t)(seq - bond->nextSeq) >= 0 && !bond->filled[seq % BOND_WINDOW]) {
+            BondPacket *slot = &bond->window[seq % BOND_WINDOW];
+            slot->seq = seq;
+            slot->size = len - BOND_HEADER_SIZE;
+            memcpy(slot->data, frame + BOND_HEADER_SIZE, slot->size);
+            bond->filled[seq % BOND_WINDOW] = TRUE;
+            pthread_cond_broadcast(&bond->changed);
+        }
+        pthread_mutex_unlock(&bond->lock);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    pthread_mutex_lock(&bond->lock);
+    m->finished = TRUE;
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+    return NULL;
+}
+
+int bondRead(struct LinkBond *bond, unsigned char *packet)
+{
+    pthread_mutex_lock(&bond->lock);
+    int slot = bond->nextSeq % BOND_WINDOW;
+    while (!bond->filled[slot]) {
+        bool allDone = TRUE;
+        for (int i = 0; i < bond->nMembers; i++)
+            if (bond->members[i].opened && !bond->members[i].finished)
+                allDone = FALSE;
+        if (allDone) {
+            pthread_mutex_unlock(&bond->lock);
+            printf("[bond] All member links finished, packet %u missing\n", bond->nextSeq);
+            return -1;
+        }
+        waitChanged(bond, 100);
+    }
+
+    int size = bond->window[slot].size;
+    memcpy(packet, bond->window[slot].data, size);
+    bond->filled[slot] = FALSE;
+    bond->nextSeq++;
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+    return size;
+}
+
+////////////////////////////////////////////////
+// OPEN / CLOSE
+////////////////////////////////////////////////
+
+static void *memberThread(void *arg)
+{
+    BondMember *m = arg;
+    struct LinkBond *bond = m->bond;
+
+    bool ok = llopen_r(&m->link, m->link.params) > 0 && m->link.connected;
+
+    pthread_mutex_lock(&bond->lock);
+    m->opened = ok;
+    // Too late to join a receiving bond that is being closed
+    m->alive = ok && !bond->closing;
+    m->finished = !m->alive;
+    bond->nOpenDone++;
+    pthread_cond_broadcast(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+
+    if (!m->alive)
+        return NULL;
+    return bond->role == LlTx ? txMember(m) : rxMember(m);
+}
+
+static void bondFree(struct LinkBond *bond)
+{
+    pthread_mutex_destroy(&bond->lock);
+    pthread_cond_destroy(&bond->changed);
+    for (int i = 0; i < BOND_MAX_PORTS; i++)
+        free(bond->members[i].pkt.data);
+    if (bond->queue != NULL)
+        for (int i = 0; i < BOND_RING_SIZE; i++)
+            free(bond->queue[i].data);
+    if (bond->window != NULL)
+        for (int i = 0; i < BOND_WINDOW; i++)
+            free(bond->window[i].data);
+    free(bond->queue);
+    free(bond->window);
+    free(bond);
+}
+
+// "trace.json" on /dev/ttyS0 becomes "trace.ttyS0.json"
+static void memberTraceFile(BondMember *m, const char *traceFile)
+{
+    const char *port = strrchr(m->link.params.serialPort, '/');
+    port = port != NULL ? port + 1 : m->link.params.serialPort;
+    const char *dir = strrchr(traceFile, '/');
+    const char *ext = strrchr(dir != NULL ? dir : traceFile, '.');
+    if (ext == NULL || ext == traceFile || ext == dir + 1)
+        ext = traceFile + strlen(traceFile);
+    snprintf(m->traceFile, sizeof(m->traceFile), "%.*s.%s%s",
+             (int)(ext - traceFile), traceFile, port, ext);
+    m->link.params.traceFile = m->traceFile;
+}
+
+static bool allocPackets(struct LinkBond *bond)
+{
+    int cap = bond->packetCapacity;
+    bool ok = TRUE;
+    for (int i = 0; i < BOND_RING_SIZE; i++)
+        ok &= (bond->queue[i].data = malloc(cap)) != NULL;
+    for (int i = 0; i < BOND_WINDOW; i++)
+        ok &= (bond->window[i].data = malloc(cap)) != NULL;
+    for (int i = 0; i < BOND_MAX_PORTS && bond->role == LlTx; i++)
+        ok &= (bond->members[i].pkt.data = malloc(cap)) != NULL;
+    return ok;
+}
+
+int llopenBonded(LinkContext *link, LinkLayer connectionParameters, const char *serialPorts)
+{
+    if (link->connected) return -1;
+    memset(link, 0, sizeof(*link));
+    link->params = connectionParameters;
+
+    struct LinkBond *bond = calloc(1, sizeof(*bond));
+    if (bond == NULL)
+        return -1;
+    bond->role = connectionParameters.role;
+    bond->packetCapacity = connectionParameters.maxInfo > 0 ? connectionParameters.maxInfo : DEFAULT_INFO_SIZE;
+    if (bond->packetCapacity > MAX_INFO_SIZE)
+        bond->packetCapacity = MAX_INFO_SIZE;
+    bond->queue = calloc(BOND_RING_SIZE, sizeof(BondPacket));
+    bond->window = calloc(BOND_WINDOW, sizeof(BondPacket));
+    pthread_mutex_init(&bond->lock, NULL);
+    pthread_cond_init(&bond->changed, NULL);
+    if (bond->queue == NULL || bond->window == NULL || !allocPackets(bond)) {
+        bondFree(bond);
+        return -1;
+    }
+
+    // Split the port list
+    const char *p = serialPorts;
+    while (*p != '\0' && bond->nMembers < BOND_MAX_PORTS) {
+        size_t len = strcspn(p, ",");
+        if (len > 0) {
+            BondMember *m = &bond->members[bond->nMembers++];
+            m->bond = bond;
+            m->link.params = connectionParameters;
+            m->link.params.recoveryTime = 0; // A dead member is dropped from the bond instead
+            m->link.params.cancelOpen = &bond->closing; // Receivers stop waiting for SET on close
+            snprintf(m->link.params.serialPort, sizeof(m->link.params.serialPort), "%.*s", (int)len, p);
+            if (connectionParameters.traceFile != NULL)
+                memberTraceFile(m, connectionParameters.traceFile); // One file per port
+            m->rate = connectionParameters.baudRate / 10.0; // 8-N-1, until measured
+        }
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+
+    if (bond->nMembers == 0) {
+        bondFree(bond);
+        return -1;
+    }
+
+    printf("[bond] Opening %d member links...\n", bond->nMembers);
+    pthread_mutex_lock(&bond->lock);
+    for (int i = 0; i < bond->nMembers; i++)
+        pthread_create(&bond->members[i].thread, NULL, memberThread, &bond->members[i]);
+    // A receiver's member waits for SET as long as it takes, so one whose
+    // cable is down would hold up the bond: start as soon as a member is up
+    // and let the others join when their SET arrives.
+    while (bond->nOpenDone < bond->nMembers && !(bond->role == LlRx && anyAlive(bond)))
+        pthread_cond_wait(&bond->changed, &bond->lock);
+    bool ok = anyAlive(bond);
+    if (!ok) {
+        pthread_mutex_unlock(&bond->lock);
+        printf("[bond] No member link could be opened\n");
+        for (int i = 0; i < bond->nMembers; i++)
+            pthread_join(bond->members[i].thread, NULL);
+        bondFree(bond);
+        return -1;
+    }
+
+    // Packets written to the bond must fit in every member's frames. A
+    // receiver's late members take packets sized by the transmitter, which
+    // waited for all of its members, so they fit too.
+    bool first = TRUE;
+    for (int i = 0; i < bond->nMembers; i++) {
+        const LinkCaps *caps = &bond->members[i].link.caps;
+        if (!bond->members[i].alive)
+            continue;
+        if (first || caps->maxInfo < link->caps.maxInfo + BOND_HEADER_SIZE)
+            link->caps = *caps;
+        first = FALSE;
+    }
+    pthread_mutex_unlock(&bond->lock);
+    link->caps.maxInfo -= BOND_HEADER_SIZE;
+
+    link->bond = bond;
+    link->connected = TRUE;
+    return 1;
+}
+
+int bondClose(struct LinkBond *bond, LinkHistograms *histograms)
+{
+    pthread_mutex_lock(&bond->lock);
+    bond->closing = TRUE;
+    pthread_cond_broadcast(&bond->changed);
+
+    if (bond->role == LlRx) {
+        // A member whose peer failed never gets its FIN; give up on it
+        // once the transmitter would have given up too.
+        long long limit = nowMs() + 1000LL * bond->members[0].link.params.timeout *
+                                     (bond->members[0].link.params.nRetransmissions + 1);
+        for (int i = 0; i < bond->nMembers; i++) {
+            BondMember *m = &bond->members[i];
+            if (!m->opened && !m->finished) {
+                // Still waiting for SET, which closing cuts short: every
+                // packet has arrived without it
+                printf("[bond] %s never came up, dropping it\n", m->link.params.serialPort);
+                while (!m->finished)
+                    waitChanged(bond, 100);
+                continue;
+            }
+            while (!m->finished && nowMs() < limit)
+                waitChanged(bond, 100);
+            if (!m->finished) {
+                printf("[bond] %s did not finish, dropping it\n", m->link.params.serialPort);
+                pthread_cancel(m->thread);
+                m->alive = FALSE;
+            }
+        }
+    }
+    pthread_mutex_unlock(&bond->lock);
+
+    int ret = 0;
+    printf("\n=== Bond statistics ===\n");
+    for (int i = 0; i < bond->nMembers; i++) {
+        BondMember *m = &bond->members[i];
+        pthread_join(m->thread, NULL);
+        if (bond->role == LlTx)
+            printf("%s: %s, %.0f bytes/s\n", m->link.params.serialPort,
+                   m->alive ? "up" : "down", m->rate);
+        if (m->alive && llclose_r(&m->link) < 0)
+            ret = -1;
+        else if (!m->alive && m->opened)
+            llabort_r(&m->link);
+
+        // Closing leaves them in place; a member that never opened has none
+        histogramMerge(&histograms->ackRtt, &m->link.histograms.ackRtt);
+        histogramMerge(&histograms->delivery, &m->link.histograms.delivery);
+        histogramMerge(&histograms->retransmissions, &m->link.histograms.retransmissions);
+        histogramMerge(&histograms->frameGap, &m->link.histograms.frameGap);
+    }
+
+    // Every member died with packets still to send
+    if (bond->role == LlTx && bond->qCount > 0) {
+        printf("[bond] %d packets could not be sent\n", bond->qCount);
+        ret = -1;
+    }
+
+    bondFree(bond);
+    return ret;
+}
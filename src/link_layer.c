@@ -1,14 +1,18 @@
 // Link layer protocol implementation
 #include "link_layer.h"
+#include "link_bond.h"
+#include "link_frame.h"
 #include "serial_port.h"
 #include "packet_helper.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
-#include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <termios.h>
 
 const unsigned char FLAG = 0x7E;
@@ -20,546 +24,1107 @@ const unsigned char BCC1 = A1 ^ C1;
 const unsigned char BCC2 = A1 ^ C2;
 const unsigned char DISC = 0x0B;
 
+// Messages about each frame received. The benchmark builds with
+// LL_QUIET_FRAMES so that what it measures is the deframing, not stdio.
+#ifdef LL_QUIET_FRAMES
+#define FRAME_LOG(...) ((void)0)
+#else
+#define FRAME_LOG(...) printf(__VA_ARGS__)
+#endif
+
 unsigned char BUFF_SET[BUF_SIZE] = {FLAG, A1, C1, BCC1, FLAG};
 unsigned char BUFF_UA[BUF_SIZE]  = {FLAG, A1, C2, BCC2, FLAG};
-unsigned char BUFF_DISC[BUF_SIZE] = {FLAG, A1, 0xFF, A1^DISC, FLAG};
+unsigned char BUFF_DISC[BUF_SIZE] = {FLAG, A1, DISC, A1^DISC, FLAG};
 
-typedef enum { START = 1, FLAG_RCV, A_RCV, C_RCV, BCC_OK } State;
+////////////////////////////////////////////////
+// TIMER
+////////////////////////////////////////////////
 
-volatile bool timeout = FALSE;
-volatile bool connected = FALSE;
+// Each link keeps its own deadline instead of sharing the process-wide
+// SIGALRM, and reads poll the port until that deadline.
+
+// Time comes from the port, so that a simulated line can run the link on
+// its virtual clock.
+static long long nowMs(const LinkContext *link)
+{
+    return serialPortNowNs(&link->port) / 1000000;
+}
 
-volatile int UA_received = 0;
-volatile bool DISC_received = FALSE;
-volatile int alarmCount = 0;
+static long long nowUs(const LinkContext *link)
+{
+    return serialPortNowNs(&link->port) / 1000;
+}
 
-////////////////////////////////////////////////
-// ALARM
-////////////////////////////////////////////////
+static void timerStartMs(LinkContext *link, int ms)
+{
+    link->timeout = FALSE;
+    link->deadline = nowMs(link) + ms;
+}
+
+// Start the timer once what was just written has left the port, so that a
+// frame still queued for output (large frames, slow lines) does not time
+// out before the peer could have received it
+static void timerStartSent(LinkContext *link, int ms)
+{
+    timerStartMs(link, ms + (int)(serialPortDrainNs(&link->port) / 1000000));
+}
 
-void alarmHandler(int signo)
+static void timerStop(LinkContext *link)
 {
-    timeout = TRUE;
-    alarmCount++;
-    printf("Timeout! Tentativa %d\n", alarmCount);
+    link->deadline = 0;
 }
 
+static void timerExpired(LinkContext *link)
+{
+    link->timeout = TRUE;
+    link->deadline = 0;
+    link->alarmCount++;
+    link->stats.timeouts++;
+    traceInstant(link->trace, TRACE_LINK, "timer expiry", "count", link->alarmCount);
+    printf("Timeout! Tentativa %d\n", link->alarmCount);
+}
+
+// Wait for input on the link's port and buffer it, at most until the link's
+// timer expires (forever if no timer is armed).
+// Returns the number of bytes buffered, 0 if none arrived.
+static int fillInput(LinkContext *link)
+{
+    if (link->inPos < link->inLen)
+        return link->inLen - link->inPos;
+
+    int waitMs = -1;
+    if (link->deadline != 0) {
+        long long left = link->deadline - nowMs(link);
+        if (left <= 0) {
+            timerExpired(link);
+            return 0;
+        }
+        waitMs = (int)left;
+    }
+
+    int r = serialPortRead(&link->port, link->inBuf, sizeof(link->inBuf), waitMs);
+    if (r <= 0) {
+        if (link->deadline != 0 && nowMs(link) >= link->deadline)
+            timerExpired(link);
+        return 0;
+    }
+    link->inPos = 0;
+    link->inLen = r;
+    return r;
+}
+
+static LlRxEvent receiveEvent(LinkContext *link, unsigned char *packet, int *len);
+static int readFrame(LinkContext *link, unsigned char *packet, int timeoutMs);
+
 ////////////////////////////////////////////////
-// STATE MACHINES
+// CAPABILITIES
 ////////////////////////////////////////////////
 
-bool stateMachine(unsigned char controll)
+// Capabilities travel as TLVs in the information field of SET and UA.
+// The SET carries what the transmitter supports, the UA what the receiver
+// selected. A plain 5-byte SET/UA means the peer predates this exchange.
+#define CAP_MAX_INFO 0x01 // L=2
+#define CAP_WINDOW   0x02 // L=1
+#define CAP_FCS      0x03 // L=1, LL_FCS_* mask
+#define CAP_FEATURES 0x04 // L=1, LL_FEAT_* mask
+// 0x05 was a preferred baud rate that was never applied; skipped if received
+#define CAP_RESUME   0x06 // L=9: Ns, then payload bytes acknowledged (see recoverLink)
+
+static int localMaxInfo(const LinkContext *link)
 {
-    unsigned char byte;
-    unsigned char state = 1;
+    int maxInfo = link->params.maxInfo;
+    if (maxInfo <= 0)
+        return DEFAULT_INFO_SIZE;
+    return maxInfo > MAX_INFO_SIZE ? MAX_INFO_SIZE : maxInfo;
+}
 
-    while ((!timeout && (controll == C2)) || (controll == C1))
-    {
-        int r = readByteSerialPort(&byte);
-        if (r <= 0) continue;
+// What this implementation supports
+static LinkCaps localCaps(const LinkContext *link)
+{
+    LinkCaps caps = {
+        .maxInfo = localMaxInfo(link),
+        .window = 1,
+        .fcs = LL_FCS_XOR8 | LL_FCS_CRC16,
+        .features = link->params.cobs || link->params.role == LlRx ? LL_FEAT_COBS : 0,
+    };
+    return caps;
+}
 
-        printf("Read byte: 0x%02X | Current state: %d\n", byte, state);
+// Configuration used with a peer that did not send capabilities
+static LinkCaps legacyCaps(const LinkContext *link)
+{
+    LinkCaps caps = localCaps(link);
+    caps.fcs = LL_FCS_XOR8;
+    caps.features = 0;
+    if (caps.maxInfo > DEFAULT_INFO_SIZE)
+        caps.maxInfo = DEFAULT_INFO_SIZE;
+    return caps;
+}
 
-        switch (state)
-        {
-            case 1: // START
-                if (byte == FLAG)
-                    state = 2;
-                break;
+static int encodeCaps(const LinkCaps *caps, unsigned char *out)
+{
+    int pos = 0;
+    out[pos++] = CAP_MAX_INFO;
+    out[pos++] = 2;
+    out[pos++] = (caps->maxInfo >> 8) & 0xFF;
+    out[pos++] = caps->maxInfo & 0xFF;
+    out[pos++] = CAP_WINDOW;
+    out[pos++] = 1;
+    out[pos++] = caps->window;
+    out[pos++] = CAP_FCS;
+    out[pos++] = 1;
+    out[pos++] = caps->fcs;
+    out[pos++] = CAP_FEATURES;
+    out[pos++] = 1;
+    out[pos++] = caps->features;
+    return pos;
+}
 
-            case 2: // FLAG_RCV
-                if (byte == A1)
-                    state = 3;
-                else if (byte != FLAG)
-                    state = 1;
-                break;
+static int encodeResume(unsigned char *out, int ns, unsigned long long offset)
+{
+    int pos = 0;
+    out[pos++] = CAP_RESUME;
+    out[pos++] = 9;
+    out[pos++] = ns;
+    for (int shift = 56; shift >= 0; shift -= 8)
+        out[pos++] = (offset >> shift) & 0xFF;
+    return pos;
+}
 
-            case 3: // A_RCV
-                if (byte == controll)
-                    state = 4;
-                else if (byte == FLAG)
-                    state = 2;
-                else
-                    state = 1;
-                break;
+// Value of the TLV of the given type and length, or NULL if absent
+static const unsigned char *findCap(const unsigned char *in, int n, unsigned char type, unsigned char len)
+{
+    int pos = 0;
+    while (pos + 2 <= n) {
+        unsigned char T = in[pos++];
+        unsigned char L = in[pos++];
+        if (pos + L > n)
+            break;
+        if (T == type && L == len)
+            return in + pos;
+        pos += L;
+    }
+    return NULL;
+}
 
-            case 4: // C_RCV
-                if (byte == (A1 ^ controll))
-                    state = 5;
-                else if (byte == FLAG)
-                    state = 2;
-                else
-                    state = 1;
-                break;
+static unsigned long long decodeOffset(const unsigned char *v)
+{
+    unsigned long long offset = 0;
+    for (int i = 0; i < 8; i++)
+        offset = (offset << 8) | v[i];
+    return offset;
+}
 
-            case 5: // BCC_OK
-                if (byte == FLAG)
-                {
-                    printf("✅ Valid frame detected!\n");
-                    return true;
-                }
-                else
-                    state = 1;
-                break;
-        }
+// Unknown TLVs are skipped so that newer peers can add fields.
+static void decodeCaps(const unsigned char *in, int n, LinkCaps *caps)
+{
+    int pos = 0;
+    while (pos + 2 <= n) {
+        unsigned char T = in[pos++];
+        unsigned char L = in[pos++];
+        if (pos + L > n)
+            break;
+        const unsigned char *v = in + pos;
+        if (T == CAP_MAX_INFO && L == 2) caps->maxInfo = (v[0] << 8) | v[1];
+        else if (T == CAP_WINDOW && L == 1) caps->window = v[0];
+        else if (T == CAP_FCS && L == 1) caps->fcs = v[0];
+        else if (T == CAP_FEATURES && L == 1) caps->features = v[0];
+        pos += L;
     }
+}
 
-    return FALSE;
+// Best configuration both sides support
+static LinkCaps selectCaps(const LinkCaps *a, const LinkCaps *b)
+{
+    LinkCaps caps;
+    caps.maxInfo = a->maxInfo < b->maxInfo ? a->maxInfo : b->maxInfo;
+    caps.window = a->window < b->window ? a->window : b->window;
+    if (caps.window < 1)
+        caps.window = 1;
+    unsigned char fcs = a->fcs & b->fcs;
+    caps.fcs = (fcs & LL_FCS_CRC16) ? LL_FCS_CRC16 : LL_FCS_XOR8;
+    caps.features = a->features & b->features;
+    return caps;
 }
 
-bool Close_stateMachine(unsigned char controll, LinkLayer connectionParameters)
+static void printCaps(const char *what, const LinkCaps *caps)
 {
-    unsigned char byte;
-    unsigned char state = 1;
+    printf("%s: max info %d, window %d, FCS %s, framing %s, features 0x%02X\n",
+           what, caps->maxInfo, caps->window, caps->fcs == LL_FCS_CRC16 ? "CRC-16" : "BCC2",
+           (caps->features & LL_FEAT_COBS) ? "COBS" : "byte stuffing", caps->features);
+}
 
+////////////////////////////////////////////////
+// HANDSHAKES
+////////////////////////////////////////////////
 
-    while (!timeout)
-    {
-        int r = readByteSerialPort(&byte);
-        if (r <= 0) continue;
+// SET/UA and DISC/DISC/UA retry on a millisecond timer: the first retry comes
+// shortly after the frames' round trip, and the wait doubles on every retry
+// up to the frame timeout. Giving up still takes nRetransmissions x timeout.
+#define HANDSHAKE_MARGIN_MS 50
+#define CLOSE_LINGER_MS 1000 // How long the receiver waits for the final UA
+#define OPEN_CANCEL_CHECK_MS 100 // How often a receiver waiting for SET looks at cancelOpen
 
-        printf("Read byte: 0x%02X | Current state: %d\n", byte, state);
+static int handshakeRto(const LinkContext *link)
+{
+    int baudRate = link->params.baudRate > 0 ? link->params.baudRate : 9600;
+    // A SET and a UA with capabilities, 10 bits per byte
+    return HANDSHAKE_MARGIN_MS + (int)(2LL * STUFFED_SIZE(32) * 10 * 1000 / baudRate);
+}
 
-        switch (state)
-        {
-            case 1: // START
-                if (byte == FLAG)
-                    state = 2;
-                break;
+static int handshakeBackoff(const LinkContext *link, int rtoMs)
+{
+    int maxMs = link->params.timeout * 1000;
+    rtoMs *= 2;
+    return rtoMs > maxMs && maxMs > 0 ? maxMs : rtoMs;
+}
 
-            case 2: // FLAG_RCV
-                if (byte == A1)
-                    state = 3;
-                else if (byte != FLAG)
-                    state = 1;
-                break;
+static long long handshakeDeadline(const LinkContext *link)
+{
+    return nowMs(link) + (long long)link->params.nRetransmissions * link->params.timeout * 1000;
+}
 
-            case 3: // A_RCV
-                if (byte == controll)
-                    state = 4;
-                else if (byte == FLAG)
-                    state = 2;
-                else
-                    state = 1;
-                break;
+// Send a SET (with capabilities if offer is not NULL) and wait for the UA,
+// retrying with backoff until the handshake deadline.
+// Returns TRUE once a UA arrives; link->caps then holds the configuration.
+static bool exchangeSetUa(LinkContext *link, const LinkCaps *offer)
+{
+    unsigned char frame[STUFFED_SIZE(32)];
+    unsigned char caps[32];
+    int capsLen = offer != NULL ? encodeCaps(offer, caps) : 0;
+
+    link->alarmCount = 0;
+    long long giveUp = handshakeDeadline(link);
+    int rto = handshakeRto(link);
+    for (int attempt = 0; nowMs(link) < giveUp; attempt++) {
+        // Alternate with a plain SET so that peers predating the capability
+        // exchange, which ignore the longer frame, still answer.
+        bool extended = offer != NULL && attempt % 2 == 0;
+        int size = extended ? buildFrame(frame, C1, caps, capsLen, LL_FCS_XOR8)
+                            : buildFrame(frame, C1, NULL, 0, 0);
+        serialPortWrite(&link->port, frame, size);
+        printf("SET frame sent%s\n", extended ? " (with capabilities)" : "");
+
+        timerStartSent(link, rto);
+        while (!link->timeout) {
+            int len;
+            if (receiveEvent(link, NULL, &len) == LL_RX_UA) {
+                timerStop(link);
+                return TRUE;
+            }
+        }
+        printf("Timeout reached, retrying...\n");
+        rto = handshakeBackoff(link, rto);
+    }
+    return FALSE;
+}
 
-            case 4: // C_RCV
-                if (byte == (A1 ^ controll))
-                    state = 5;
-                else if (byte == FLAG)
-                    state = 2;
-                else
-                    state = 1;
-                break;
+////////////////////////////////////////////////
+// BUFFERS
+////////////////////////////////////////////////
 
-            case 5: // BCC_OK
-                if (byte == FLAG)
-                {
-                    printf("Valid closing frame detected!\n");
-                    return true;
-                }
-                else
-                    state = 1;
-                break;
-        }
+// Allocate the frame buffers for the largest frame this side may send or
+// accept. The transmit buffer is only allocated up front for LlTx; a
+// receiver gets it the first time it sends data back.
+// Returns 0 on success or -1 if out of memory.
+static int allocBuffers(LinkContext *link, bool tx)
+{
+    int maxInfo = localMaxInfo(link);
+
+    if (link->rxFrame == NULL) {
+        link->rxCapacity = maxInfo + 5; // A, C, BCC1, data, 2-byte FCS
+        link->rxFrame = malloc(link->rxCapacity);
+    }
+    if (link->txFrame == NULL && tx) {
+        link->txCapacity = STUFFED_SIZE(maxInfo);
+        link->txFrame = malloc(link->txCapacity);
     }
 
-    return FALSE;
+    if (link->rxFrame == NULL || (tx && link->txFrame == NULL)) {
+        perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+static void freeBuffers(LinkContext *link)
+{
+    free(link->rxFrame);
+    free(link->txFrame);
+    link->rxFrame = NULL;
+    link->txFrame = NULL;
+    link->rxCapacity = 0;
+    link->txCapacity = 0;
+}
+
+void llabort_r(LinkContext *link)
+{
+    if (link->trace != NULL) {
+        char processName[64];
+        snprintf(processName, sizeof(processName), "%s %s", link->params.role == LlTx ? "tx" : "rx",
+                 link->params.serialPort);
+        if (traceWrite(link->trace, link->params.traceFile, processName) < 0)
+            perror(link->params.traceFile);
+        else
+            printf("Trace written to %s\n", link->params.traceFile);
+        traceFree(link->trace);
+        link->trace = NULL;
+    }
+    if (link->port.fd >= 0)
+        serialPortClose(&link->port);
+    link->connected = FALSE;
+    freeBuffers(link);
 }
 
 ////////////////////////////////////////////////
 // LLOPEN
 ////////////////////////////////////////////////
 
-LinkLayer conParams;
-int llopen(LinkLayer connectionParameters)
+int llopen_r(LinkContext *link, LinkLayer connectionParameters)
 {
-    if (connected) return -1;
+    if (link->connected) return -1;
+
+    memset(link, 0, sizeof(*link));
+    link->params = connectionParameters;
 
     // abrir porta
-    if (openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate) < 0) {
+    if (serialPortOpenConfig(&link->port, connectionParameters.serialPort, connectionParameters.baudRate,
+                             &connectionParameters.serial) < 0) {
         perror("openSerialPort");
         return -1;
     }
-    conParams = connectionParameters;
 
-    // configurar handler
-    struct sigaction act;
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = alarmHandler;
+    if (connectionParameters.traceFile != NULL) {
+        link->trace = traceCreate(TRACE_EVENTS, &link->port);
+        if (link->trace == NULL)
+            printf("Not enough memory for the trace, tracing disabled\n");
+    }
+    long long openStart = traceNow(link->trace);
+
+    SerialPortInfo portInfo;
+    serialPortInfo(&link->port, &portInfo);
+    link->overrunsAtOpen = portInfo.overruns;
+    if (portInfo.fifoSize > 0)
+        printf("UART FIFO: %d bytes\n", portInfo.fifoSize);
 
-    if (sigaction(SIGALRM, &act, NULL) == -1) {
-        perror("sigaction");
-        closeSerialPort();
+    if (allocBuffers(link, connectionParameters.role == LlTx) < 0) {
+        llabort_r(link);
         return -1;
     }
 
+    link->caps = legacyCaps(link);
+
     // protocolo de conexão
     if (connectionParameters.role == LlTx) {
         printf("Transmitter: sending SET frame...\n");
-        alarmCount = 0;
-        UA_received = 0;
-
-        while (alarmCount < connectionParameters.nRetransmissions && UA_received == 0) {
-            writeBytesSerialPort(BUFF_SET, BUF_SIZE);
-            printf("SET frame sent\n");
-
-            timeout = FALSE;
-            alarm(connectionParameters.timeout);
-
-            if (stateMachine(C2)) {
-                printf("UA frame received. Connection established!\n");
-                connected = true;
-                UA_received = 1;
-                alarm(0);
-            } else {
-                printf("Timeout reached, retrying...\n");
-            }
-
-            if (!UA_received)
-                printf("No UA received, retrying...\n");
-        }
+        LinkCaps offer = localCaps(link);
 
-        if (!UA_received) {
-            printf("Failed to receive UA after %d attempts.\n", alarmCount);
+        if (exchangeSetUa(link, &offer)) {
+            printf("UA frame received. Connection established!\n");
+            link->connected = TRUE;
+        } else {
+            printf("Failed to receive UA after %d attempts.\n", link->alarmCount);
+            llabort_r(link);
             return -1;
         }
     }
     else if (connectionParameters.role == LlRx) {
         printf("Receiver: waiting for SET frame...\n");
 
-        if (stateMachine(C1)) {
-            printf("SET frame received. Sending UA...\n");
-            writeBytesSerialPort(BUFF_UA, BUF_SIZE);
-            printf("UA sent. Connection established!\n");
-            connected = TRUE;
+        // Reads are cut short to look at cancelOpen now and then
+        const volatile bool *cancel = connectionParameters.cancelOpen;
+        while (!link->connected) {
+            if (cancel != NULL && *cancel) {
+                printf("Receiver: no SET received, giving up\n");
+                llabort_r(link);
+                return -1;
+            }
+            if (link->inPos == link->inLen) {
+                int r = serialPortRead(&link->port, link->inBuf, sizeof(link->inBuf),
+                                       cancel != NULL ? OPEN_CANCEL_CHECK_MS : -1);
+                if (r <= 0)
+                    continue;
+                link->inPos = 0;
+                link->inLen = r;
+            }
+            LlRxEvent event;
+            int len;
+            link->inPos += llrxPushBuffer(link, link->inBuf + link->inPos, link->inLen - link->inPos,
+                                          NULL, &len, &event);
         }
-        
+        printf("UA sent. Connection established!\n");
     }
 
+    traceSpan(link->trace, TRACE_LINK, "llopen", openStart, NULL, 0);
+    printCaps("Link configuration", &link->caps);
     return 1; // sucesso
 }
 
 ////////////////////////////////////////////////
-// LLWRITE — State Machine integrada
+// LLWRITE
 ////////////////////////////////////////////////
 
+// Probe interval while recovering a lost link, doubled after every probe
+#define RECOVERY_MIN_WAIT_MS 250
+#define RECOVERY_MAX_WAIT_MS 2000
+
+enum { RECOVER_FAILED = -1, RECOVER_RESEND, RECOVER_DELIVERED };
+
+// Called once llwrite has used up its retries on the frame in link->txFrame
+// (frameSize bytes, bufSize of payload): probe the peer with exponential
+// backoff until it answers or recoveryTime runs out.
+// A peer that took part in the capability exchange gets a SET carrying our
+// Ns and the payload bytes acknowledged so far, and answers with its own, so
+// both sides agree on whether the pending frame got through. Older peers are
+// probed with the pending I-frame itself.
+// Returns RECOVER_RESEND, RECOVER_DELIVERED or RECOVER_FAILED.
+static int recoverLink(LinkContext *link, int frameSize, int bufSize)
+{
+    long long giveUp = nowMs(link) + (long long)link->params.recoveryTime * 1000;
+    int waitMs = RECOVERY_MIN_WAIT_MS;
+
+    printf("[llwrite] Ligação perdida, a tentar recuperar durante %d s...\n", link->params.recoveryTime);
+
+    while (nowMs(link) < giveUp) {
+        if (link->extended) {
+            unsigned char info[32];
+            unsigned char frame[STUFFED_SIZE(32)];
+            int n = encodeCaps(&link->caps, info);
+            n += encodeResume(info + n, link->ns, link->stats.bytesSent);
+            serialPortWrite(&link->port, frame, buildFrame(frame, C1, info, n, LL_FCS_XOR8));
+        } else {
+            serialPortWrite(&link->port, link->txFrame, frameSize);
+        }
+        link->resumed = FALSE;
+
+        timerStartSent(link, waitMs);
+        int len;
+        LlRxEvent event;
+        do {
+            event = receiveEvent(link, NULL, &len);
+        } while (event != LL_RX_NONE && event != LL_RX_UA &&
+                 (link->extended || (event != LL_RX_RR && event != LL_RX_REJ)));
+
+        if (event != LL_RX_NONE) {
+            timerStop(link);
+            link->stats.recoveries++;
+            printf("[llwrite] ✅ Ligação recuperada\n");
+
+            if (event == LL_RX_RR)
+                return RECOVER_DELIVERED;
+            if (event == LL_RX_REJ || !link->resumed)
+                return RECOVER_RESEND; // the peer keeps its Ns, duplicates are discarded
+
+            unsigned long long acked = link->stats.bytesSent;
+            if (link->peerOffset == acked && link->peerExpectedNs == link->ns)
+                return RECOVER_RESEND;
+            if (link->peerOffset == acked + bufSize && link->peerExpectedNs == 1 - link->ns)
+                return RECOVER_DELIVERED;
+
+            printf("[llwrite] ❌ O recetor perdeu a sessão (tem %llu bytes, enviados %llu)\n",
+                   link->peerOffset, acked);
+            return RECOVER_FAILED;
+        }
 
-int llwrite(const unsigned char *buf, int bufSize)
+        waitMs *= 2;
+        if (waitMs > RECOVERY_MAX_WAIT_MS)
+            waitMs = RECOVERY_MAX_WAIT_MS;
+    }
+
+    printf("[llwrite] ❌ Ligação não recuperada em %d s.\n", link->params.recoveryTime);
+    return RECOVER_FAILED;
+}
+
+// Build I-frame Ns carrying the iovcnt segments of iov into link->txFrame,
+// with the FCS and framing in use. Returns the frame size.
+static int buildIFrame(LinkContext *link, int Ns, const struct iovec *iov, int iovcnt)
+{
+    // bit 6 = Ns, bit 5 = FCS é CRC-16, bit 4 = COBS
+    unsigned char C = (Ns ? C_I_NS : 0) | (link->caps.fcs == LL_FCS_CRC16 ? C_I_CRC : 0);
+    if (link->caps.features & LL_FEAT_COBS)
+        return buildCobsFrameV(link->txFrame, C | C_I_COBS, iov, iovcnt, link->caps.fcs);
+    return buildFrameV(link->txFrame, C, iov, iovcnt, link->caps.fcs);
+}
+
+int llwrite_r(LinkContext *link, const unsigned char *buf, int bufSize)
+{
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = bufSize > 0 ? bufSize : 0};
+    return llwritev_r(link, buf != NULL ? &iov : NULL, 1);
+}
+
+int llwritev_r(LinkContext *link, const struct iovec *iov, int iovcnt)
 {
-    if (buf == NULL || bufSize <= 0) {
+    int bufSize = 0;
+    for (int i = 0; iov != NULL && i < iovcnt; i++) {
+        if (iov[i].iov_base == NULL && iov[i].iov_len > 0)
+            iov = NULL;
+        else if (iov[i].iov_len > MAX_INFO_SIZE)
+            bufSize = MAX_INFO_SIZE + 1;
+        else
+            bufSize += iov[i].iov_len;
+    }
+    if (iov == NULL || bufSize <= 0 || bufSize > MAX_INFO_SIZE) {
         printf("[llwrite] Erro: buffer inválido.\n");
         return -1;
     }
 
-    static int Ns = 0; // número de sequência (0 ou 1)
+    if (link->bond != NULL)
+        return bondWrite(link->bond, iov, iovcnt);
 
-    unsigned char A = A1;
-    unsigned char C = (Ns << 6); // bit 6 = Ns
-    unsigned char BCC1 = A ^ C;
+    int Ns = link->ns; // número de sequência (0 ou 1)
 
-    unsigned char BCC2 = 0x00;
-    for (int i = 0; i < bufSize; i++)
-        BCC2 ^= buf[i];
+    if (bufSize > link->caps.maxInfo) {
+        printf("[llwrite] Erro: %d bytes excede o máximo negociado (%d).\n", bufSize, link->caps.maxInfo);
+        return -1;
+    }
 
     //////////////////////////////////////////////////////////////
     // Construção do frame com byte stuffing
     //////////////////////////////////////////////////////////////
 
-    unsigned char stuffedData[2 * MAX_PACKET_SIZE];
-    int stuffedIndex = 0;
-
-    stuffedData[stuffedIndex++] = FLAG;
-
-    // A
-    if (A == FLAG) { stuffedData[stuffedIndex++] = 0x7D; stuffedData[stuffedIndex++] = 0x5E; }
-    else if (A == 0x7D) { stuffedData[stuffedIndex++] = 0x7D; stuffedData[stuffedIndex++] = 0x5D; }
-    else stuffedData[stuffedIndex++] = A;
-
-    // C
-    if (C == FLAG) { stuffedData[stuffedIndex++] = 0x7D; stuffedData[stuffedIndex++] = 0x5E; }
-    else if (C == 0x7D) { stuffedData[stuffedIndex++] = 0x7D; stuffedData[stuffedIndex++] = 0x5D; }
-    else stuffedData[stuffedIndex++] = C;
-
-    // BCC1
-    if (BCC1 == FLAG) { stuffedData[stuffedIndex++] = 0x7D; stuffedData[stuffedIndex++] = 0x5E; }
-    else if (BCC1 == 0x7D) { stuffedData[stuffedIndex++] = 0x7D; stuffedData[stuffedIndex++] = 0x5D; }
-    else stuffedData[stuffedIndex++] = BCC1;
-
-    // Dados (com stuffing)
-    for (int i = 0; i < bufSize; i++) {
-        if (buf[i] == FLAG) {
-            stuffedData[stuffedIndex++] = 0x7D;
-            stuffedData[stuffedIndex++] = 0x5E;
-        } else if (buf[i] == 0x7D) {
-            stuffedData[stuffedIndex++] = 0x7D;
-            stuffedData[stuffedIndex++] = 0x5D;
-        } else {
-            stuffedData[stuffedIndex++] = buf[i];
-        }
-    }
-
-    // BCC2
-    if (BCC2 == FLAG) { stuffedData[stuffedIndex++] = 0x7D; stuffedData[stuffedIndex++] = 0x5E; }
-    else if (BCC2 == 0x7D) { stuffedData[stuffedIndex++] = 0x7D; stuffedData[stuffedIndex++] = 0x5D; }
-    else stuffedData[stuffedIndex++] = BCC2;
+    if (link->txFrame == NULL && allocBuffers(link, TRUE) < 0)
+        return -1;
 
-    
-    stuffedData[stuffedIndex++] = FLAG;
+    unsigned char *stuffedData = link->txFrame;
+    long long buildStart = traceNow(link->trace);
+    int stuffedIndex = buildIFrame(link, Ns, iov, iovcnt);
+    traceSpan(link->trace, TRACE_LINK, "frame build", buildStart, "bytes", bufSize);
 
     //////////////////////////////////////////////////////////////
     // Envio e retransmissão
     //////////////////////////////////////////////////////////////
-    alarmCount = 0;
+    int attempts = 0;
     bool ackReceived = FALSE;
-    timeout = FALSE;
+    link->alarmCount = 0;
+    link->timeout = FALSE;
+    long long firstSentUs = nowUs(link), sentUs = -1;
+    unsigned long retransmissionsBefore = link->stats.retransmissions;
 
     printf("[llwrite] Frame I(%d) pronto (%d bytes após stuffing)\n", Ns, stuffedIndex);
 
-    while (alarmCount < conParams.nRetransmissions && !ackReceived)
+    while (!ackReceived)
     {
-        writeBytesSerialPort(stuffedData, stuffedIndex);
-        printf("[llwrite] I-frame (Ns=%d) enviado (tentativa %d)\n", Ns, alarmCount + 1);
-
-        timeout = FALSE;
-        alarm(conParams.timeout);
-
-        //--------------------------------------------------
-        // INLINE STATE MACHINE 
-        //--------------------------------------------------
+        if (attempts >= link->params.nRetransmissions) {
+            int result = link->params.recoveryTime > 0 ? recoverLink(link, stuffedIndex, bufSize)
+                                                       : RECOVER_FAILED;
+            if (result == RECOVER_FAILED)
+                break;
+            if (result == RECOVER_DELIVERED) {
+                sentUs = -1; // Acknowledged by the resynchronisation: no RTT
+                ackReceived = TRUE;
+                break;
+            }
 
-        unsigned char byte, ctrl = 0;
-        int state = 0;
+            // Back in session: the retry budget starts over, with the FCS
+            // and framing agreed again in the resynchronisation
+            buildStart = traceNow(link->trace);
+            stuffedIndex = buildIFrame(link, Ns, iov, iovcnt);
+            traceSpan(link->trace, TRACE_LINK, "frame build", buildStart, "bytes", bufSize);
+            attempts = 0;
+            link->alarmCount = 0;
+        }
 
-        while (!timeout && !ackReceived)
+        if (attempts > 0)
+            traceInstant(link->trace, TRACE_LINK, "retransmission", "attempt", attempts + 1);
+        long long writeStart = traceNow(link->trace);
+        serialPortWrite(&link->port, stuffedData, stuffedIndex);
+        traceSpan(link->trace, TRACE_LINK, "serial write", writeStart, "bytes", stuffedIndex);
+        link->stats.framesSent++;
+        if (attempts > 0)
+            link->stats.retransmissions++;
+        printf("[llwrite] I-frame (Ns=%d) enviado (tentativa %d)\n", Ns, attempts + 1);
+
+        // Timer and RTT run from when the frame has left the port
+        long long drainNs = serialPortDrainNs(&link->port);
+        sentUs = nowUs(link) + drainNs / 1000;
+        timerStartMs(link, link->params.timeout * 1000 + (int)(drainNs / 1000000));
+        long long waitStart = traceNow(link->trace);
+
+        while (!link->timeout && !ackReceived)
         {
-            int r = readByteSerialPort(&byte);
-            if (r <= 0) continue;
-
-            switch (state)
-            {
-                case 0: // START
-                    if (byte == FLAG) state = 1;
-                    break;
-
-                case 1: // FLAG_RCV
-                    if (byte == A1) state = 2;
-                    else if (byte != FLAG) state = 0;
-                    break;
-
-                case 2: // A_RCV
-                    if (byte == 0x05 || byte == 0x85 ||  // RR(0)/RR(1)
-                        byte == 0x01 || byte == 0x81 ||  // REJ(0)/REJ(1)
-                        byte == 0x07)                    // UA
-                    {
-                        ctrl = byte;
-                        state = 3;
-                    }
-                    else if (byte == FLAG)
-                        state = 1;
-                    else
-                        state = 0;
-                    break;
-
-                case 3: // C_RCV
-                    if (byte == (A1 ^ ctrl))
-                        state = 4;
-                    else if (byte == FLAG)
-                        state = 1;
-                    else
-                        state = 0;
-                    break;
-
-                case 4: // BCC_OK
-                    if (byte == FLAG) {
-                        
-                        alarm(0);
-                        printf("[llwrite] Supervisão recebida (C=0x%02X)\n", ctrl);
-
-                        if (ctrl == 0x05 || ctrl == 0x85) { // RR(0) / RR(1)
-                            printf("[llwrite] ✅ RR recebido — ACK OK\n");
-                            ackReceived = TRUE;
-                        }
-                        else if (ctrl == 0x01 || ctrl == 0x81) { // REJ(0) / REJ(1)
-                            printf("[llwrite] ⚠️ REJ recebido — reenviando frame\n");
-                            ackReceived = FALSE;
-                        }
-                        else if (ctrl == 0x07) { // UA
-                            printf("[llwrite] ✅ UA recebido — ligação confirmada\n");
-                            ackReceived = TRUE;
-                        }
-                        state = 5;
-                    } else state = 0;
-                    break;
+            // No packet buffer: when the peer also sends data, a repeated
+            // I-frame (our RR got lost) is answered again so it moves on.
+            int len;
+            LlRxEvent event = receiveEvent(link, NULL, &len);
+
+            if (event == LL_RX_RR) {
+                timerStop(link);
+                printf("[llwrite] ✅ RR recebido — ACK OK\n");
+                ackReceived = TRUE;
+            }
+            else if (event == LL_RX_REJ) {
+                timerStop(link);
+                printf("[llwrite] ⚠️ REJ recebido — reenviando frame\n");
+                link->stats.rejReceived++;
+                traceInstant(link->trace, TRACE_LINK, "REJ received", "Ns", Ns);
+                break;
             }
-
-            if (state == 5) break;
         }
-        //--------------------------------------------------
+        traceSpan(link->trace, TRACE_LINK, "ack wait", waitStart, "Ns", Ns);
 
         if (!ackReceived)
             printf("[llwrite] ⏱️ Timeout ou REJ — reenviando...\n");
 
-        alarmCount++;
+        attempts++;
     }
 
     if (!ackReceived) {
-        printf("[llwrite] ❌ Falha após %d tentativas — sem ACK.\n", alarmCount);
+        printf("[llwrite] ❌ Falha após %d tentativas — sem ACK.\n", attempts);
         return -1;
     }
 
-    Ns = 1 - Ns; 
+    long long ackedUs = nowUs(link);
+    // The RR may beat the estimate of when the frame left (a faster line)
+    if (sentUs >= 0)
+        histogramRecord(&link->histograms.ackRtt, ackedUs > sentUs ? ackedUs - sentUs : 0);
+    histogramRecord(&link->histograms.delivery, ackedUs - firstSentUs);
+    histogramRecord(&link->histograms.retransmissions, link->stats.retransmissions - retransmissionsBefore);
+
+    link->ns = 1 - Ns;
+    link->stats.bytesSent += bufSize;
     printf("[llwrite] ✅ Envio concluído com sucesso (%d bytes payload)\n", bufSize);
     return bufSize;
 }
 
 
 ////////////////////////////////////////////////
-// LLREAD — State Machine integrada
+// LLREAD
 ////////////////////////////////////////////////
 
-typedef enum {
-    STATE_START,
-    STATE_FLAG_RCV,
-    STATE_A_RCV,
-    STATE_C_RCV,
-    STATE_BCC1_OK,
-    STATE_DATA,
-    STATE_DATA_ESC,
-    STATE_STOP
-} FrameState;
+// Packet buffer of llreadInPlace_r: the data stays in link->rxFrame
+static unsigned char inPlace;
+#define IN_PLACE (&inPlace)
 
-int llread(unsigned char *packet)
+static void sendSupervision(LinkContext *link, unsigned char C)
 {
-    if (packet == NULL) {
-        printf("[llread] Erro: ponteiro nulo.\n");
-        return -1;
+    unsigned char frame[5] = {FLAG, A1, C, A1 ^ C, FLAG};
+    serialPortWrite(&link->port, frame, 5);
+}
+
+// Handle a complete, destuffed frame (A, C, BCC1[, data, FCS]) sitting in
+// link->rxFrame. bcc and crc are what the deframer accumulated over the data
+// field including its FCS, so either is 0 when that kind of FCS checks out.
+static LlRxEvent processFrame(LinkContext *link, int n, unsigned char bcc, unsigned short crcResidue,
+                              unsigned char *packet, int *len)
+{
+    unsigned char *frame = link->rxFrame;
+
+    if (n < 3 || frame[0] != A1 || frame[2] != (frame[0] ^ frame[1]))
+        return LL_RX_NONE; // cabeçalho inválido, ignorar
+
+    unsigned char C = frame[1];
+
+    // SET and UA may carry capabilities, protected by a BCC2
+    const unsigned char *caps = frame + 3;
+    int capsLen = n - 4;
+    if ((C == C1 || C == C_UA) && n > 3 && (capsLen <= 0 || bcc != 0))
+        return LL_RX_NONE;
+
+    if (C == C1) { // SET
+        // Unless it resumes the session, a SET starts a new one, also on a
+        // connected link: its transmitter may have died without a DISC and
+        // a new one started, which begins at Ns = 0
+        const unsigned char *resume = n > 3 ? findCap(caps, capsLen, CAP_RESUME, 9) : NULL;
+        if (resume == NULL) {
+            link->expectedNs = 0;
+            link->ns = 0;
+            link->caps = legacyCaps(link);
+            link->extended = FALSE;
+            link->stats.bytesReceived = 0; // What a later resume is checked against
+        }
+
+        if (n > 3) {
+            LinkCaps offer = legacyCaps(link);
+            decodeCaps(caps, capsLen, &offer);
+            LinkCaps local = localCaps(link);
+            link->caps = selectCaps(&offer, &local);
+            link->extended = TRUE;
+
+            unsigned char reply[32];
+            unsigned char ua[STUFFED_SIZE(32)];
+            int replyLen = encodeCaps(&link->caps, reply);
+
+            // A transmitter recovering from an outage asks where we are
+            if (resume != NULL) {
+                replyLen += encodeResume(reply + replyLen, link->expectedNs, link->stats.bytesReceived);
+                printf("[llread] Pedido de retoma (emissor em %llu bytes, nós em %lu)\n",
+                       decodeOffset(resume + 1), link->stats.bytesReceived);
+            }
+            serialPortWrite(&link->port, ua, buildFrame(ua, C_UA, reply, replyLen, LL_FCS_XOR8));
+            printf("[llread] SET com capacidades recebido, UA enviado\n");
+        } else {
+            sendSupervision(link, C2);
+            printf("[llread] SET recebido, UA enviado\n");
+        }
+        link->connected = TRUE;
+        link->disconnecting = FALSE;
+        return resume != NULL ? LL_RX_RESUMED : LL_RX_SET;
     }
 
-    unsigned char byte;
-    unsigned char frame[2 * MAX_PACKET_SIZE]; 
-    int frameIndex = 0;
+    if (C == C_UA) {
+        if (link->disconnecting) {
+            printf("[llread] UA recebido, ligação terminada\n");
+            link->connected = FALSE;
+            link->disconnecting = FALSE;
+            return LL_RX_CLOSED;
+        }
+        if (n > 3) {
+            LinkCaps selected = link->caps;
+            decodeCaps(caps, capsLen, &selected);
+            link->caps = selected;
+            link->extended = TRUE;
+
+            const unsigned char *resume = findCap(caps, capsLen, CAP_RESUME, 9);
+            if (resume != NULL) {
+                link->resumed = TRUE;
+                link->peerExpectedNs = resume[0] & 0x01;
+                link->peerOffset = decodeOffset(resume + 1);
+            }
+        }
+        return LL_RX_UA;
+    }
 
-    FrameState state = STATE_START;
-    unsigned char A = 0, C = 0;
+    if (n == 3) {
+        switch (C) {
+            case C_RR(0):
+            case C_RR(1):
+                return LL_RX_RR;
+            case C_REJ(0):
+            case C_REJ(1):
+                return LL_RX_REJ;
+        }
 
-    printf("[llread] Aguardando I-frame...\n");
+        if (C != DISC)
+            return LL_RX_NONE;
 
-    while (state != STATE_STOP) {
-        int r = readByteSerialPort(&byte);
-        if (r <= 0) continue;
+        // The transmitter sent the first DISC, this is the answer
+        if (link->params.role == LlTx)
+            return LL_RX_DISC;
+        sendSupervision(link, DISC);
+        printf("[llread] DISC recebido, DISC enviado\n");
+        link->disconnecting = TRUE;
+        return LL_RX_DISC;
+    }
 
-        switch (state) {
-            case STATE_START:
-                if (byte == FLAG)
-                    state = STATE_FLAG_RCV;
-                break;
+    // I-frame: bit 6 = Ns, bit 5 = FCS é CRC-16, bit 4 = COBS
+    if ((C & ~0x70) != 0 || !link->connected)
+        return LL_RX_NONE;
+    bool crc = (C & C_I_CRC) != 0;
 
-            case STATE_FLAG_RCV:
-                if (byte == A1) {
-                    A = byte;
-                    state = STATE_A_RCV;
-                } else if (byte != FLAG)
-                    state = STATE_START;
-                break;
+    int frameIndex = n - 3;
+    frame += 3;
 
-            case STATE_A_RCV:
-                if (byte == 0x00 || byte == 0x40) {
-                    C = byte;
-                    state = STATE_C_RCV;
-                } else if (byte == FLAG)
-                    state = STATE_FLAG_RCV;
-                else
-                    state = STATE_START;
-                break;
+    FRAME_LOG("[llread] Frame completo recebido (%d bytes úteis)\n", frameIndex);
 
-            case STATE_C_RCV:
-                if (byte == (A ^ C))
-                    state = STATE_BCC1_OK;
-                else if (byte == FLAG)
-                    state = STATE_FLAG_RCV;
-                else
-                    state = STATE_START;
-                break;
+    int fcsLen = crc ? 2 : 1;
+    if (frameIndex < fcsLen + 1) {
+        FRAME_LOG("[llread] Frame demasiado curto.\n");
+        return LL_RX_REJECTED;
+    }
+
+    int dataLen = frameIndex - fcsLen;
+    // The buffer leaves room for a CRC-16, so an XOR8 frame could carry one
+    // byte more than the packet buffers of llread_r callers hold
+    if (dataLen > localMaxInfo(link)) {
+        FRAME_LOG("[llread] Frame demasiado longo.\n");
+        return LL_RX_REJECTED;
+    }
+    bool bcc2_ok = crc ? crcResidue == 0 : bcc == 0;
+
+    int Ns = (C & C_I_NS) != 0;
+    int expectedNs = link->expectedNs;
+
+    // Without a packet buffer (llwrite waiting for its RR) only duplicates
+    // are answered; new frames are left for the peer to retransmit.
+    if (packet == NULL && (!bcc2_ok || Ns == expectedNs))
+        return LL_RX_NONE;
+
+    if (bcc2_ok && Ns == expectedNs) {
+        FRAME_LOG("[llread] ✅ Frame válido, BCC2 OK, Ns=%d\n", Ns);
+        
+        if (packet != IN_PLACE)
+            memcpy(packet, frame, dataLen);
+        
+        sendSupervision(link, C_RR(1 - expectedNs));
+        FRAME_LOG("[llread] RR enviado (espera Ns=%d)\n", 1 - expectedNs);
+
+        link->expectedNs = 1 - expectedNs;
+        link->stats.framesReceived++;
+        link->stats.bytesReceived += dataLen;
+        long long now = serialPortNowNs(&link->port);
+        if (link->lastDataNs != 0)
+            histogramRecord(&link->histograms.frameGap, (now - link->lastDataNs) / 1000);
+        link->lastDataNs = now;
+        *len = dataLen;
+        return LL_RX_DATA;
+    }
+    else if (!bcc2_ok) {
+        if (crc)
+            FRAME_LOG("[llread] ❌ Erro em CRC-16 (esperado 0x%04X, obtido 0x%04X)\n",
+                      crc16(frame, dataLen), (frame[dataLen] << 8) | frame[dataLen + 1]);
+        else
+            FRAME_LOG("[llread] ❌ Erro em BCC2 (esperado 0x%02X, obtido 0x%02X)\n",
+                      xor8(frame, dataLen), frame[dataLen]);
+        sendSupervision(link, C_REJ(expectedNs));
+        link->stats.rejSent++;
+        traceInstant(link->trace, TRACE_LINK, "REJ sent", "Ns", expectedNs);
+        FRAME_LOG("[llread] REJ enviado (Ns=%d)\n", expectedNs);
+        return LL_RX_REJECTED;
+    }
+    else {
+        
+        FRAME_LOG("[llread] ⚠️ Frame duplicado Ns=%d, reenviando RR(%d)\n", Ns, expectedNs);
+        sendSupervision(link, C_RR(expectedNs));
+        link->stats.duplicates++;
+        traceInstant(link->trace, TRACE_LINK, "duplicate", "Ns", Ns);
+        return LL_RX_DUPLICATE;
+    }
+}
+
+////////////////////////////////////////////////
+// DEFRAMER
+////////////////////////////////////////////////
+
+// A single transition table drives reception of every frame type (I, S and
+// U): it finds the flags, undoes the byte stuffing (or the COBS encoding of
+// an I-frame's data field) and accumulates both kinds of FCS in the same
+// pass, leaving processFrame a finished frame.
+
+enum { BC_OTHER, BC_ESCAPED, BC_ESC, BC_FLAG, BC_COUNT };               // Byte classes
+enum { DF_DATA, DF_ESC, DF_DISCARD, DF_COBS, DF_COUNT };                 // States
+enum { DA_NONE, DA_STORE, DA_STORE_ESCAPED, DA_END, DA_ABORT, DA_BAD_ESCAPE, DA_COBS }; // Actions
+
+static const unsigned char byteClass[256] = {
+    [0x5D] = BC_ESCAPED, // 0x7D ^ 0x20
+    [0x5E] = BC_ESCAPED, // 0x7E ^ 0x20
+    [0x7D] = BC_ESC,
+    [0x7E] = BC_FLAG,
+};
+
+typedef struct
+{
+    unsigned char next;
+    unsigned char action;
+} Transition;
+
+// A flag always ends the current frame. A bad escape (line noise) marks the
+// frame as damaged: it is still handed on, failing its FCS, so that an
+// I-frame gets a REJ rather than a timeout. A frame too long for the buffer
+// is skipped up to the next flag.
+static const Transition deframeTable[DF_COUNT][BC_COUNT] = {
+    //                OTHER                         ESCAPED                        ESC                           FLAG
+    [DF_DATA]    = {{DF_DATA, DA_STORE},         {DF_DATA, DA_STORE},          {DF_ESC, DA_NONE},            {DF_DATA, DA_END}},
+    [DF_ESC]     = {{DF_DATA, DA_BAD_ESCAPE},    {DF_DATA, DA_STORE_ESCAPED},  {DF_ESC, DA_BAD_ESCAPE},      {DF_DATA, DA_ABORT}},
+    [DF_DISCARD] = {{DF_DISCARD, DA_NONE},       {DF_DISCARD, DA_NONE},        {DF_DISCARD, DA_NONE},        {DF_DATA, DA_ABORT}},
+    [DF_COBS]    = {{DF_COBS, DA_COBS},          {DF_COBS, DA_COBS},           {DF_COBS, DA_COBS},           {DF_DATA, DA_END}},
+};
+
+// Header of an I-frame whose data field is COBS-encoded
+static bool isCobsHeader(const unsigned char *frame)
+{
+    return frame[0] == A1 && (frame[1] & ~(C_I_NS | C_I_CRC | C_I_COBS)) == 0 && (frame[1] & C_I_COBS) != 0 &&
+           frame[2] == (frame[0] ^ frame[1]);
+}
+
+// Decode one byte of a COBS data field. Returns FALSE if it produces no
+// data (a code byte), else TRUE with the data byte in *byte.
+static bool cobsDecode(LinkContext *link, unsigned char *byte)
+{
+    unsigned char b = *byte ^ COBS_MASK;
+    if (link->rxCobsLeft > 0) {
+        link->rxCobsLeft--;
+        *byte = b;
+        return TRUE;
+    }
+
+    // A code byte: the block before it ended in a zero unless it was full.
+    // The zero after the last block is not part of the data.
+    bool zero = link->rxCobsZero;
+    link->rxCobsLeft = b - 1;
+    link->rxCobsZero = b != COBS_BLOCK;
+    *byte = 0x00;
+    return zero;
+}
+
+int llrxPushBuffer(LinkContext *link, const unsigned char *buf, int n,
+                   unsigned char *packet, int *len, LlRxEvent *event)
+{
+    *event = LL_RX_NONE;
+    if (link->rxFrame == NULL && allocBuffers(link, FALSE) < 0)
+        return n;
+
+    // Work on locals, written back before returning
+    unsigned char *frame = link->rxFrame;
+    int index = link->rxIndex;
+    unsigned char state = link->rxState;
+    unsigned char bcc = link->rxBcc;
+    unsigned short crc = link->rxCrc;
+
+    int i = 0;
+    while (i < n && *event == LL_RX_NONE) {
+        unsigned char byte = buf[i++];
+        const Transition *t = &deframeTable[state][byteClass[byte]];
+        state = t->next;
+
+        switch (t->action) {
+            case DA_COBS:
+            case DA_STORE_ESCAPED:
+            case DA_STORE:
+                if (t->action == DA_STORE_ESCAPED)
+                    byte ^= 0x20;
+                else if (t->action == DA_COBS && !cobsDecode(link, &byte))
+                    break;
+
+                if (index >= link->rxCapacity) {
+                    FRAME_LOG("[llread] Erro: frame demasiado longo, descartado.\n");
+                    state = DF_DISCARD;
+                    break;
+                }
+                if (index == 0 && link->trace != NULL)
+                    link->rxStartNs = traceNow(link->trace);
+                // The FCS covers the data field, which starts after BCC1
+                if (index >= 3) {
+                    if (index == 3) {
+                        bcc = 0x00;
+                        crc = 0xFFFF;
+                    }
+                    bcc ^= byte;
+                    crc = (crc << 8) ^ crc16Table[((crc >> 8) ^ byte) & 0xFF];
+                }
+                frame[index++] = byte;
 
-            case STATE_BCC1_OK:
-                if (byte == FLAG)
-                    state = STATE_START; 
-                else if (byte == 0x7D)
-                    state = STATE_DATA_ESC; 
-                else {
-                    frame[frameIndex++] = byte;
-                    state = STATE_DATA;
+                // The data field of a COBS I-frame follows its header
+                if (index == 3 && state == DF_DATA && isCobsHeader(frame)) {
+                    state = DF_COBS;
+                    link->rxCobsLeft = 0;
+                    link->rxCobsZero = FALSE;
                 }
                 break;
 
-            case STATE_DATA:
-                if (byte == FLAG)
-                    state = STATE_STOP;
-                else if (byte == 0x7D)
-                    state = STATE_DATA_ESC;
-                else
-                    frame[frameIndex++] = byte;
+            case DA_END:
+                // A COBS frame cut short in the middle of a block is damaged
+                if (link->rxCobsLeft > 0)
+                    link->rxDamaged = TRUE;
+                link->rxCobsLeft = 0;
+
+                // A damaged frame fails whichever FCS it carries; without a
+                // data field there is nothing to reject
+                if (link->rxDamaged && index > 3)
+                    *event = processFrame(link, index, 0x01, 0x0001, packet, len);
+                else if (!link->rxDamaged && index > 0)
+                    *event = processFrame(link, index, bcc, crc, packet, len);
+                // Frames with a data field, from their first byte on, so
+                // the time on the line is included
+                if (index > 3 && *event != LL_RX_NONE)
+                    traceSpan(link->trace, TRACE_LINK, "frame assembly", link->rxStartNs, "bytes", index);
+                index = 0;
+                link->rxDamaged = FALSE;
                 break;
 
-            case STATE_DATA_ESC:
-                if (byte == 0x5E) frame[frameIndex++] = 0x7E;
-                else if (byte == 0x5D) frame[frameIndex++] = 0x7D;
-                else {
-                    printf("[llread] Erro: sequência de stuffing inválida (0x%02X)\n", byte);
-                    state = STATE_START;
-                    frameIndex = 0;
-                }
-                state = STATE_DATA;
+            case DA_ABORT:
+                index = 0;
+                link->rxDamaged = FALSE;
+                link->rxCobsLeft = 0;
                 break;
 
-            default:
+            case DA_BAD_ESCAPE:
+                FRAME_LOG("[llread] Erro: sequência de stuffing inválida (0x%02X)\n", byte);
+                link->rxDamaged = TRUE;
                 break;
         }
     }
 
-    printf("[llread] Frame completo recebido (%d bytes úteis)\n", frameIndex);
+    link->rxIndex = index;
+    link->rxState = state;
+    link->rxBcc = bcc;
+    link->rxCrc = crc;
+    return i;
+}
 
-    if (frameIndex < 2) {
-        printf("[llread] Frame demasiado curto.\n");
-        return -1;
-    }
+LlRxEvent llrxPush(LinkContext *link, unsigned char byte, unsigned char *packet, int *len)
+{
+    LlRxEvent event;
+    llrxPushBuffer(link, &byte, 1, packet, len, &event);
+    return event;
+}
 
-    unsigned char BCC2 = frame[frameIndex - 1];
-    unsigned char calcBCC2 = 0x00;
-    for (int i = 0; i < frameIndex - 1; i++)
-        calcBCC2 ^= frame[i];
+// Wait for the next frame event, feeding the link's buffered input to the
+// deframer. Returns LL_RX_NONE only once the armed timer expires.
+static LlRxEvent receiveEvent(LinkContext *link, unsigned char *packet, int *len)
+{
+    while (TRUE) {
+        if (fillInput(link) == 0) {
+            if (link->timeout)
+                return LL_RX_NONE;
+            continue;
+        }
 
-    bool bcc2_ok = (BCC2 == calcBCC2);
- 
-    int Ns = (C >> 6) & 0x01;
-    static int expectedNs = 0;
+        LlRxEvent event;
+        link->inPos += llrxPushBuffer(link, link->inBuf + link->inPos, link->inLen - link->inPos,
+                                      packet, len, &event);
+        if (event != LL_RX_NONE)
+            return event;
+    }
+}
 
-    if (bcc2_ok && Ns == expectedNs) {
-        printf("[llread] ✅ Frame válido, BCC2 OK, Ns=%d\n", Ns);
-        
-        memcpy(packet, frame, frameIndex - 1);
-        
-        unsigned char RR[5] = {FLAG, A1, (expectedNs ? 0x05 : 0x85), A1 ^ (expectedNs ? 0x05 : 0x85), FLAG};
-        writeBytesSerialPort(RR, 5);
-        printf("[llread] RR enviado (espera Ns=%d)\n", 1 - expectedNs);
+int llread_r(LinkContext *link, unsigned char *packet)
+{
+    return llreadTimeout_r(link, packet, -1);
+}
 
-        expectedNs = 1 - expectedNs;
-        return frameIndex - 1;
+int llreadTimeout_r(LinkContext *link, unsigned char *packet, int timeoutMs)
+{
+    if (packet == NULL) {
+        printf("[llread] Erro: ponteiro nulo.\n");
+        return -1;
     }
-    else if (!bcc2_ok) {
-        printf("[llread] ❌ Erro em BCC2 (esperado 0x%02X, obtido 0x%02X)\n", calcBCC2, BCC2);
-        unsigned char REJ[5] = {FLAG, A1, (expectedNs ? 0x81 : 0x01), A1 ^ (expectedNs ? 0x81 : 0x01), FLAG};
-        writeBytesSerialPort(REJ, 5);
-        printf("[llread] REJ enviado (Ns=%d)\n", expectedNs);
+
+    if (link->bond != NULL)
+        return bondRead(link->bond, packet);
+
+    return readFrame(link, packet, timeoutMs);
+}
+
+int llreadInPlace_r(LinkContext *link, const unsigned char **data, int timeoutMs)
+{
+    if (link->rxFrame == NULL && allocBuffers(link, FALSE) < 0)
         return -1;
+
+    // The bond reassembles its packets elsewhere: one copy is left
+    if (link->bond != NULL) {
+        *data = link->rxFrame;
+        return bondRead(link->bond, link->rxFrame);
     }
-    else {
-        
-        printf("[llread] ⚠️ Frame duplicado Ns=%d, reenviando RR(%d)\n", Ns, expectedNs);
-        unsigned char RR[5] = {FLAG, A1, (expectedNs ? 0x85 : 0x05), A1 ^ (expectedNs ? 0x85 : 0x05), FLAG};
-        writeBytesSerialPort(RR, 5);
-        return 0;
+
+    *data = link->rxFrame + 3; // After A, C, BCC1
+    return readFrame(link, IN_PLACE, timeoutMs);
+}
+
+// llread on a single link; packet may be IN_PLACE
+static int readFrame(LinkContext *link, unsigned char *packet, int timeoutMs)
+{
+    printf("[llread] Aguardando I-frame...\n");
+
+    link->timeout = FALSE;
+    link->deadline = timeoutMs >= 0 ? nowMs(link) + timeoutMs : 0;
+
+    while (TRUE) {
+        int len = 0;
+        switch (receiveEvent(link, packet, &len)) {
+            case LL_RX_NONE:
+                return -1; // timeout
+            case LL_RX_DATA:
+                timerStop(link);
+                return len;
+            case LL_RX_DUPLICATE:
+                timerStop(link);
+                return 0;
+            case LL_RX_REJECTED:
+                timerStop(link);
+                return -1;
+            default:
+                break;
+        }
     }
 }
 
@@ -568,66 +1133,178 @@ int llread(unsigned char *packet)
 // LLCLOSE
 ////////////////////////////////////////////////
 
-int llclose(LinkLayer connectionParameters)
+void llexportHistograms_r(const LinkContext *link, FILE *out)
+{
+    const LinkHistograms *h = &link->histograms;
+    histogramExport(&h->ackRtt, "ack_rtt_us", out);
+    histogramExport(&h->delivery, "delivery_us", out);
+    histogramExport(&h->retransmissions, "retransmissions", out);
+    histogramExport(&h->frameGap, "frame_gap_us", out);
+}
+
+// Tails of the latencies, to size timeouts
+static void printHistograms(const LinkHistograms *h)
 {
-    if (!connected) {
+    histogramPrint(&h->ackRtt, "Ack RTT:", "us");
+    histogramPrint(&h->delivery, "Frame delivery:", "us");
+    histogramPrint(&h->retransmissions, "Retransmissions/frame:", "");
+    histogramPrint(&h->frameGap, "Inter-frame gap:", "us");
+}
+
+int llclose_r(LinkContext *link)
+{
+    if (!link->connected) {
         printf("No connection open.\n");
         return -1;
     }
 
+    if (link->bond != NULL) {
+        int ret = bondClose(link->bond, &link->histograms);
+        link->bond = NULL;
+        link->connected = FALSE;
+        printf("\n=== Bond latencies (all ports) ===\n");
+        printHistograms(&link->histograms);
+        return ret;
+    }
+
+    LinkLayer connectionParameters = link->params;
+    link->alarmCount = 0;
+    int ret = 0;
+    long long closeStart = traceNow(link->trace);
+    long long giveUp = handshakeDeadline(link);
+    int rto = handshakeRto(link);
+
     if (connectionParameters.role == LlTx) {
         printf("Transmitter: sending DISC frame...\n");
 
-        alarmCount = 0;
-
-        while (alarmCount < connectionParameters.nRetransmissions && connected) {
-            writeBytesSerialPort(BUFF_DISC, BUF_SIZE);
+        while (link->connected && nowMs(link) < giveUp) {
+            serialPortWrite(&link->port, BUFF_DISC, BUF_SIZE);
             printf("DISC frame sent\n");
 
-            timeout = FALSE;
-            alarm(connectionParameters.timeout);
+            timerStartSent(link, rto);
 
-            if (Close_stateMachine(DISC, connectionParameters)) {
+            int len;
+            LlRxEvent event;
+            do {
+                event = receiveEvent(link, NULL, &len);
+            } while (event != LL_RX_DISC && event != LL_RX_NONE);
+
+            if (event == LL_RX_DISC) {
                 printf("DISC received. Sending UA...\n");
-                writeBytesSerialPort(BUFF_UA, BUF_SIZE);
-                connected = FALSE;
-                alarm(0);
+                serialPortWrite(&link->port, BUFF_UA, BUF_SIZE);
+                link->connected = FALSE;
+                timerStop(link);
             } else {
                 printf("Timeout reached. Retrying...\n");
+                rto = handshakeBackoff(link, rto);
             }
         }
 
-        if (connected) {
-            printf("Failed to close after %d attempts.\n", alarmCount);
-            return -1;
+        if (link->connected) {
+            printf("Failed to close after %d attempts.\n", link->alarmCount);
+            ret = -1;
         }
     } 
 
     else if (connectionParameters.role == LlRx) {
 
+        // Once the DISC is answered the receiver only lingers a little for
+        // the final UA, sending its DISC again in case it got lost
         printf("Receiver: waiting for DISC...\n");
-        while (alarmCount < connectionParameters.nRetransmissions && connected) { 
+        if (link->disconnecting)
+            giveUp = nowMs(link) + CLOSE_LINGER_MS;
+
+        while (link->connected && nowMs(link) < giveUp) {
+            timerStartMs(link, link->disconnecting ? rto : (int)(giveUp - nowMs(link)));
+
+            // The DISC is answered as it arrives; the final UA closes the link
+            int len;
+            switch (receiveEvent(link, NULL, &len)) {
+                case LL_RX_DISC:
+                    printf("DISC received. Sending DISC back...\n");
+                    printf("Waiting for UA...\n");
+                    giveUp = nowMs(link) + CLOSE_LINGER_MS;
+                    break;
+                case LL_RX_CLOSED:
+                    timerStop(link);
+                    break;
+                case LL_RX_NONE:
+                    if (link->disconnecting) {
+                        serialPortWrite(&link->port, BUFF_DISC, BUF_SIZE);
+                        printf("UA not received, DISC sent again\n");
+                        rto = handshakeBackoff(link, rto);
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
 
-            timeout = FALSE;
-            alarm(connectionParameters.timeout);
+        if (link->connected) {
+            if (link->disconnecting) {
+                printf("UA not received, closing anyway.\n");
+            } else {
+                printf("DISC not received.\n");
+                ret = -1;
+            }
+            link->connected = FALSE;
+        }
+    }
 
-            if (Close_stateMachine(DISC, connectionParameters)) {
+    traceSpan(link->trace, TRACE_LINK, "llclose", closeStart, NULL, 0);
 
-                printf("DISC received. Sending DISC back...\n");
-                writeBytesSerialPort(BUFF_DISC, BUF_SIZE);
+    const LinkStats *st = &link->stats;
+    printf("\n=== Link statistics (%s) ===\n", connectionParameters.serialPort);
+    if (connectionParameters.role == LlTx) {
+        printf("I-frames sent:        %lu\n", st->framesSent);
+        printf("Retransmissions:      %lu\n", st->retransmissions);
+        printf("REJ received:         %lu\n", st->rejReceived);
+        printf("Payload bytes sent:   %lu\n", st->bytesSent);
+        if (st->recoveries > 0)
+            printf("Link recoveries:      %lu\n", st->recoveries);
+    } else {
+        printf("I-frames accepted:    %lu\n", st->framesReceived);
+        printf("Duplicates discarded: %lu\n", st->duplicates);
+        printf("REJ sent:             %lu\n", st->rejSent);
+        printf("Payload bytes read:   %lu\n", st->bytesReceived);
+    }
+    printf("Timeouts:             %lu\n", st->timeouts);
 
-                printf("Waiting for UA...\n");
-                Close_stateMachine(C_UA, connectionParameters);
+    // Bytes the UART or driver dropped show up as FCS errors above
+    SerialPortInfo portInfo;
+    serialPortInfo(&link->port, &portInfo);
+    if (portInfo.overruns >= 0 && link->overrunsAtOpen >= 0)
+        printf("Port overruns:        %d\n", portInfo.overruns - link->overrunsAtOpen);
 
-                connected = FALSE;
-                alarm(0);
+    printHistograms(&link->histograms);
 
-            } else {
-                printf("Timeout reached. Retrying...\n");
-            }
-        }    
-    }
+    llabort_r(link);
+    return ret;
+}
 
-    closeSerialPort();
-    return 0;
-}
\ No newline at end of file
+
+////////////////////////////////////////////////
+// DEFAULT LINK
+////////////////////////////////////////////////
+
+static LinkContext defaultLink;
+
+int llopen(LinkLayer connectionParameters)
+{
+    return llopen_r(&defaultLink, connectionParameters);
+}
+
+int llwrite(const unsigned char *buf, int bufSize)
+{
+    return llwrite_r(&defaultLink, buf, bufSize);
+}
+
+int llread(unsigned char *packet)
+{
+    return llread_r(&defaultLink, packet);
+}
+
+int llclose(void)
+{
+    return llclose_r(&defaultLink);
+}
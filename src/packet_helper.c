@@ -1,27 +1,32 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/uio.h>
 #include "link_layer.h"   // where llwrite and llread are declared
 #include "packet_helper.h"
 
 // ==========================================================
 //  SEND CONTROL PACKET (START or END)
 // ==========================================================
-int sendControlPacket(uint8_t controlType, uint32_t fileSize, const char *filename)
+int buildControlPacket(uint8_t *packet, uint8_t controlType, uint64_t fileSize, const char *filename,
+                       const ControlInfo *info)
 {
-    uint8_t packet[MAX_PACKET_SIZE];
     int pos = 0;
 
     packet[pos++] = controlType;  // C = 1 (start) or 3 (end)
 
     // ---- TLV: File Size ----
-    packet[pos++] = TLV_FILESIZE_T; // T
-    packet[pos++] = 4;              // L
-    packet[pos++] = (fileSize >> 24) & 0xFF;
-    packet[pos++] = (fileSize >> 16) & 0xFF;
-    packet[pos++] = (fileSize >> 8) & 0xFF;
-    packet[pos++] = fileSize & 0xFF;
+    // 4 bytes like older receivers expect, 8 once the size needs it.
+    // Left out when streaming data of unknown length.
+    if (fileSize != FILE_SIZE_UNKNOWN) {
+        int sizeLen = fileSize > UINT32_MAX ? 8 : 4;
+        packet[pos++] = TLV_FILESIZE_T; // T
+        packet[pos++] = sizeLen;        // L
+        for (int i = sizeLen - 1; i >= 0; i--)
+            packet[pos++] = (fileSize >> (8 * i)) & 0xFF;
+    }
 
     // ---- TLV: File Name ----
     int nameLen = strlen(filename);
@@ -33,10 +38,40 @@ int sendControlPacket(uint8_t controlType, uint32_t fileSize, const char *filena
     memcpy(packet + pos, filename, nameLen);
     pos += nameLen;
 
-    printf("[App] Sending CONTROL packet (type=%d, size=%u, name=%s)\n",
-           controlType, fileSize, filename);
+    // ---- TLV: Digest ----
+    if (info != NULL && info->hasDigest) {
+        packet[pos++] = TLV_DIGEST_T;       // T
+        packet[pos++] = SHA256_DIGEST_SIZE; // L
+        memcpy(packet + pos, info->sha256, SHA256_DIGEST_SIZE);
+        pos += SHA256_DIGEST_SIZE;
+    }
 
-    int bytes = llwrite(packet, pos);
+    // ---- TLV: Chunk count ----
+    if (info != NULL && info->chunkCount > 0) {
+        packet[pos++] = TLV_CHUNKS_T; // T
+        packet[pos++] = 4;            // L
+        for (int i = 3; i >= 0; i--)
+            packet[pos++] = (info->chunkCount >> (8 * i)) & 0xFF;
+    }
+    return pos;
+}
+
+int sendControlPacket(LinkContext *link, uint8_t controlType, uint64_t fileSize, const char *filename,
+                      const ControlInfo *info)
+{
+    uint8_t packet[MAX_CONTROL_PACKET_SIZE];
+    int pos = buildControlPacket(packet, controlType, fileSize, filename, info);
+    if (pos < 0)
+        return -1;
+
+    if (fileSize == FILE_SIZE_UNKNOWN)
+        printf("[App] Sending CONTROL packet (type=%d, size=unknown, name=%s)\n",
+               controlType, filename);
+    else
+        printf("[App] Sending CONTROL packet (type=%d, size=%" PRIu64 ", name=%s)\n",
+               controlType, fileSize, filename);
+
+    int bytes = llwrite_r(link, packet, pos);
     return bytes;
 }
 
@@ -44,83 +79,302 @@ int sendControlPacket(uint8_t controlType, uint32_t fileSize, const char *filena
 // ==========================================================
 //  SEND DATA PACKET
 // ==========================================================
-int sendDataPacket(const uint8_t *data, uint16_t dataSize)
+int buildDataPacket(uint8_t *packet, const uint8_t *data, uint16_t dataSize)
 {
-    if (dataSize > MAX_PACKET_SIZE - 3) {
+    if (dataSize > MAX_PACKET_SIZE - 3) { // C L2 L1
         fprintf(stderr, "[sendDataPacket] dataSize too large: %u\n", dataSize);
         return -1;
     }
 
-    uint8_t packet[MAX_PACKET_SIZE];
-    if (dataSize > 65535)
-        return -1; // size too large
-
     int pos = 0;
     packet[pos++] = CF_DATA;        // C
     packet[pos++] = (dataSize >> 8) & 0xFF;  // L2
     packet[pos++] = dataSize & 0xFF;         // L1
     memcpy(packet + pos, data, dataSize);
     pos += dataSize;
+    return pos;
+}
+
+// The header goes with the data as it is, without copying them together
+int sendDataPacket(LinkContext *link, const uint8_t *data, uint16_t dataSize)
+{
+    if (dataSize > MAX_PACKET_SIZE - 3) {
+        fprintf(stderr, "[sendDataPacket] dataSize too large: %u\n", dataSize);
+        return -1;
+    }
+
+    uint8_t header[3] = {CF_DATA, (dataSize >> 8) & 0xFF, dataSize & 0xFF}; // C L2 L1
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = sizeof(header)},
+        {.iov_base = (void *)data, .iov_len = dataSize},
+    };
 
     printf("[App] Sending DATA packet (%d bytes)\n", dataSize);
 
-    int bytes = llwrite(packet, pos);
+    int bytes = llwritev_r(link, iov, 2);
     return bytes;
 }
 
 
 // ==========================================================
-//  RECEIVE PACKET (BLOCKING)
+//  PARSE PACKET
 //  Handles both CONTROL and DATA types
 // ==========================================================
-int receivePacket(uint8_t *controlType,
-                  uint8_t *dataBuffer,
-                  uint32_t *fileSize,
-                  char *filename)
+int parsePacketInPlace(const uint8_t *packet,
+                       int len,
+                       uint8_t *controlType,
+                       const uint8_t **payload,
+                       uint64_t *fileSize,
+                       char *filename,
+                       ControlInfo *info)
 {
-    uint8_t packet[MAX_PACKET_SIZE];
-    int len = llread(packet);
-
-    if (len <= 0) {
-        printf("[App] ❌ llread() failed\n");
+    *payload = NULL;
+    if (len <= 0)
         return -1;
-    }
 
     *controlType = packet[0];
 
     if (*controlType == CF_DATA) {
-        uint16_t dataLen = len; // llread returns payload size without BCC2
-        memcpy(dataBuffer, packet, dataLen);
+        if (len < 3)
+            return -1;
+        uint16_t dataLen = (packet[1] << 8) | packet[2]; // L2 L1
+        if (dataLen > len - 3)
+            return -1;
+        *payload = packet + 3;
         printf("[App] Received DATA packet (%d bytes)\n", dataLen);
         return dataLen;
     }
 
     else if (*controlType == CF_START || *controlType == CF_END) {
         // Control packet (parse TLV)
+        // No size TLV means a stream of unknown length
+        *fileSize = FILE_SIZE_UNKNOWN;
+        ControlInfo ignored;
+        if (info == NULL)
+            info = &ignored;
+        info->hasDigest = FALSE;
+        info->chunkCount = 0;
         int pos = 1;
-        while (pos < len) {
+        while (pos + 2 <= len) {
             uint8_t T = packet[pos++];
             uint8_t L = packet[pos++];
-            if (T == TLV_FILESIZE_T && L == 4) {
-                *fileSize = (packet[pos] << 24) |
-                            (packet[pos + 1] << 16) |
-                            (packet[pos + 2] << 8) |
-                            packet[pos + 3];
-                pos += 4;
+            if (pos + L > len)
+                return -1;
+            if (T == TLV_FILESIZE_T && L >= 1 && L <= 8) {
+                // Big-endian, 4 or 8 bytes
+                *fileSize = 0;
+                for (int i = 0; i < L; i++)
+                    *fileSize = (*fileSize << 8) | packet[pos + i];
+                pos += L;
             } else if (T == TLV_FILENAME_T) {
                 memcpy(filename, packet + pos, L);
                 filename[L] = '\0';
                 pos += L;
+            } else if (T == TLV_DIGEST_T && L == SHA256_DIGEST_SIZE) {
+                memcpy(info->sha256, packet + pos, SHA256_DIGEST_SIZE);
+                info->hasDigest = TRUE;
+                pos += L;
+            } else if (T == TLV_CHUNKS_T && L == 4) {
+                info->chunkCount = (uint32_t)packet[pos] << 24 | packet[pos + 1] << 16 |
+                                   packet[pos + 2] << 8 | packet[pos + 3];
+                pos += L;
             } else {
                 pos += L; // skip unknown
             }
         }
 
-        printf("[App] Received CONTROL packet (type=%d, size=%u, name=%s)\n",
-               *controlType, *fileSize, filename);
+        if (*fileSize == FILE_SIZE_UNKNOWN)
+            printf("[App] Received CONTROL packet (type=%d, size=unknown, name=%s)\n",
+                   *controlType, filename);
+        else
+            printf("[App] Received CONTROL packet (type=%d, size=%" PRIu64 ", name=%s)\n",
+                   *controlType, *fileSize, filename);
         return 0;
     }
 
+    else if (*controlType == CF_MANIFEST || *controlType == CF_HAVE || *controlType == CF_HOLE) {
+        *payload = packet + 1;
+        return len - 1;
+    }
+
     printf("[App] ⚠️ Unknown packet type: 0x%02X\n", *controlType);
     return -1;
-}
\ No newline at end of file
+}
+
+int parsePacket(const uint8_t *packet,
+                int len,
+                uint8_t *controlType,
+                uint8_t *dataBuffer,
+                uint64_t *fileSize,
+                char *filename,
+                ControlInfo *info)
+{
+    const uint8_t *payload;
+    int n = parsePacketInPlace(packet, len, controlType, &payload, fileSize, filename, info);
+    if (n > 0)
+        memcpy(dataBuffer, payload, n);
+    return n;
+}
+
+
+// ==========================================================
+//  RECEIVE PACKET (BLOCKING)
+// ==========================================================
+int receivePacketInPlace(LinkContext *link,
+                         uint8_t *controlType,
+                         const uint8_t **payload,
+                         uint64_t *fileSize,
+                         char *filename,
+                         ControlInfo *info)
+{
+    const uint8_t *packet;
+    int len = llreadInPlace_r(link, &packet, -1);
+
+    if (len <= 0) {
+        printf("[App] ❌ llread() failed\n");
+        return -1;
+    }
+
+    return parsePacketInPlace(packet, len, controlType, payload, fileSize, filename, info);
+}
+
+int receivePacket(LinkContext *link,
+                  uint8_t *controlType,
+                  uint8_t *dataBuffer,
+                  uint64_t *fileSize,
+                  char *filename,
+                  ControlInfo *info)
+{
+    const uint8_t *payload;
+    int n = receivePacketInPlace(link, controlType, &payload, fileSize, filename, info);
+    if (n > 0)
+        memcpy(dataBuffer, payload, n);
+    return n;
+}
+
+
+// ==========================================================
+//  DEDUP: MANIFEST AND HAVE PACKETS
+// ==========================================================
+
+// Room for the payload of one packet on this link
+static int packetRoom(const LinkContext *link)
+{
+    int room = link->caps.maxInfo < MAX_PACKET_SIZE ? link->caps.maxInfo : MAX_PACKET_SIZE;
+    return room - 1; // C
+}
+
+// MANIFEST: C, then per chunk: size (2 bytes), SHA-256
+int sendManifestPacket(LinkContext *link, const ChunkRef *chunks, int count)
+{
+    int perPacket = packetRoom(link) / MANIFEST_ENTRY_SIZE;
+    if (perPacket < 1)
+        return -1; // Would never get anywhere
+    if (count > perPacket)
+        count = perPacket;
+
+    // Sized for the negotiated frames rather than MAX_PACKET_SIZE
+    uint8_t *packet = malloc(1 + count * MANIFEST_ENTRY_SIZE);
+    if (packet == NULL)
+        return -1;
+    int pos = 0;
+    packet[pos++] = CF_MANIFEST;
+    for (int i = 0; i < count; i++) {
+        packet[pos++] = (chunks[i].size >> 8) & 0xFF;
+        packet[pos++] = chunks[i].size & 0xFF;
+        memcpy(packet + pos, chunks[i].hash, SHA256_DIGEST_SIZE);
+        pos += SHA256_DIGEST_SIZE;
+    }
+
+    printf("[App] Sending MANIFEST packet (%d chunks)\n", count);
+    int ret = llwrite_r(link, packet, pos) < 0 ? -1 : count;
+    free(packet);
+    return ret;
+}
+
+int parseManifest(const uint8_t *payload, int len, ChunkRef *chunks, int maxChunks)
+{
+    int count = len / MANIFEST_ENTRY_SIZE;
+    if (count > maxChunks)
+        count = maxChunks;
+
+    for (int i = 0; i < count; i++) {
+        const uint8_t *entry = payload + i * MANIFEST_ENTRY_SIZE;
+        chunks[i].offset = 0;
+        chunks[i].size = (entry[0] << 8) | entry[1];
+        memcpy(chunks[i].hash, entry + 2, SHA256_DIGEST_SIZE);
+    }
+    return count;
+}
+
+// HAVE: C, index of the first chunk (4 bytes), one bit per chunk (MSB first)
+int sendHavePacket(LinkContext *link, uint32_t first, const bool *have, int count)
+{
+    int perPacket = (packetRoom(link) - 4) * 8;
+    if (perPacket < 1)
+        return -1;
+    if (count > perPacket)
+        count = perPacket;
+
+    uint8_t *packet = malloc(1 + 4 + (count + 7) / 8);
+    if (packet == NULL)
+        return -1;
+    int pos = 0;
+    packet[pos++] = CF_HAVE;
+    for (int i = 3; i >= 0; i--)
+        packet[pos++] = (first >> (8 * i)) & 0xFF;
+    memset(packet + pos, 0, (count + 7) / 8);
+    for (int i = 0; i < count; i++)
+        if (have[i])
+            packet[pos + i / 8] |= 0x80 >> (i % 8);
+    pos += (count + 7) / 8;
+
+    printf("[App] Sending HAVE packet (chunks %u to %u)\n", first, first + count - 1);
+    int ret = llwrite_r(link, packet, pos) < 0 ? -1 : count;
+    free(packet);
+    return ret;
+}
+
+// Mark the chunks the packet covers in have. Returns how many it covered.
+int parseHave(const uint8_t *payload, int len, bool *have, int nChunks)
+{
+    if (len < 4)
+        return 0;
+    uint32_t first = (uint32_t)payload[0] << 24 | payload[1] << 16 | payload[2] << 8 | payload[3];
+
+    int covered = 0;
+    for (int i = 0; i < (len - 4) * 8 && first + i < (uint32_t)nChunks; i++) {
+        have[first + i] = (payload[4 + i / 8] & (0x80 >> (i % 8))) != 0;
+        covered++;
+    }
+    return covered;
+}
+
+
+// ==========================================================
+//  SPARSE FILES: HOLE PACKETS
+// ==========================================================
+
+// HOLE: C, length of the hole (8 bytes)
+int sendHolePacket(LinkContext *link, uint64_t length)
+{
+    uint8_t packet[9];
+    int pos = 0;
+    packet[pos++] = CF_HOLE;
+    for (int i = 7; i >= 0; i--)
+        packet[pos++] = (length >> (8 * i)) & 0xFF;
+
+    printf("[App] Sending HOLE packet (%" PRIu64 " bytes)\n", length);
+    return llwrite_r(link, packet, pos);
+}
+
+int parseHole(const uint8_t *payload, int len, uint64_t *length)
+{
+    if (len != 8)
+        return -1;
+    *length = 0;
+    for (int i = 0; i < 8; i++)
+        *length = (*length << 8) | payload[i];
+    printf("[App] Received HOLE packet (%" PRIu64 " bytes)\n", *length);
+    return 0;
+}
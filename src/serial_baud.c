@@ -0,0 +1,44 @@
+// Arbitrary baud rates (Linux termios2)
+// Kept apart from serial_port.c: <asm/termbits.h> redefines struct termios
+// and cannot be included together with <termios.h>.
+
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+// Tolerance between the requested rate and what the driver reports, in
+// percent; UARTs divide a fixed clock and rarely hit a rate exactly.
+#define BAUD_TOLERANCE 3
+
+int serialPortSetBaudRate(int fd, int baudRate)
+{
+    struct termios2 tio;
+    if (ioctl(fd, TCGETS2, &tio) == -1) {
+        perror("TCGETS2");
+        return -1;
+    }
+
+    // Same rate in both directions
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = baudRate;
+    tio.c_ospeed = baudRate;
+    if (ioctl(fd, TCSETS2, &tio) == -1) {
+        perror("TCSETS2");
+        return -1;
+    }
+
+    // Drivers round to what they can do, or fall back to another rate
+    if (ioctl(fd, TCGETS2, &tio) == -1) {
+        perror("TCGETS2");
+        return -1;
+    }
+    long diff = (long)tio.c_ospeed - baudRate;
+    if (diff < 0)
+        diff = -diff;
+    if (diff * 100 > (long)baudRate * BAUD_TOLERANCE) {
+        fprintf(stderr, "Baud rate %d rejected by the driver (it set %u)\n", baudRate, tio.c_ospeed);
+        return -1;
+    }
+    return tio.c_ospeed;
+}
@@ -0,0 +1,98 @@
+// In-process serial line
+// The two ends of a socketpair, handed out by name: the first open of
+// "mem:NAME" gets one end and the next open of the same name the other, so
+// two links in one process talk at memory speed, with no tty or cable.
+
+#include "serial_transport.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MEM_MAX_CHANNELS 32
+
+typedef struct
+{
+    char name[64];
+    int fds[2];
+    int opened; // Ends handed out (0: free slot)
+    int closed; // Ends closed again; the slot is freed when both are
+} MemChannel;
+
+static MemChannel channels[MEM_MAX_CHANNELS];
+static pthread_mutex_t channelsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int memOpen(SerialPort *port, const char *address, int baudRate, const SerialConfig *config)
+{
+    (void)baudRate;
+    (void)config;
+    port->fd = -1;
+
+    pthread_mutex_lock(&channelsLock);
+
+    // The other end of a channel waiting for its peer...
+    MemChannel *ch = NULL;
+    for (int i = 0; i < MEM_MAX_CHANNELS && ch == NULL; i++)
+        if (channels[i].opened == 1 && channels[i].closed == 0 && strcmp(channels[i].name, address) == 0)
+            ch = &channels[i];
+
+    if (ch != NULL) {
+        port->fd = ch->fds[1];
+        ch->opened = 2;
+    } else {
+        // ...or a new channel
+        for (int i = 0; i < MEM_MAX_CHANNELS && ch == NULL; i++)
+            if (channels[i].opened == 0)
+                ch = &channels[i];
+        if (ch == NULL) {
+            fprintf(stderr, "mem:%s: too many in-process channels\n", address);
+        } else if (socketpair(AF_UNIX, SOCK_STREAM, 0, ch->fds) == -1) {
+            perror("socketpair");
+            ch = NULL;
+        } else {
+            snprintf(ch->name, sizeof(ch->name), "%s", address);
+            ch->opened = 1;
+            ch->closed = 0;
+            port->fd = ch->fds[0];
+        }
+    }
+
+    pthread_mutex_unlock(&channelsLock);
+    port->backend = ch;
+    return port->fd;
+}
+
+static int memClose(SerialPort *port)
+{
+    MemChannel *ch = port->backend;
+    int ret = close(port->fd);
+    port->fd = -1;
+
+    pthread_mutex_lock(&channelsLock);
+    // Closing one end gives the other end-of-file, like a hangup
+    if (++ch->closed == ch->opened)
+        memset(ch, 0, sizeof(*ch));
+    pthread_mutex_unlock(&channelsLock);
+    return ret;
+}
+
+static int memWrite(SerialPort *port, const unsigned char *bytes, int nBytes)
+{
+    // Bytes for an end already closed are lost, as on an unplugged cable,
+    // instead of raising SIGPIPE
+    int r = send(port->fd, bytes, nBytes, MSG_NOSIGNAL);
+    if (r == -1 && errno == EPIPE)
+        return nBytes;
+    return r;
+}
+
+const SerialTransport serialMemTransport = {
+    .prefix = "mem:",
+    .open = memOpen,
+    .close = memClose,
+    .read = serialFdRead,
+    .write = memWrite,
+};
@@ -2,29 +2,109 @@
 // DO NOT CHANGE THIS FILE
 
 #include "serial_port.h"
+#include "serial_transport.h"
 
 #include <fcntl.h>
+#include <linux/serial.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
-int fd = -1;           // File descriptor for open serial port
-struct termios oldtio; // Serial port settings to restore on closing
+// Port used by the legacy single-port functions below
+static SerialPort defaultPort = {.fd = -1};
+
+// Output a tty may have queued before writes wait for it to go out, so that
+// what is written later (an RR, a retransmission) is not stuck behind it
+#define TTY_MAX_QUEUED_NS 50000000LL // 50 ms
+
+static long long nowNs(void);
+
+////////////////////////////////////////////////
+// TTY TRANSPORT
+////////////////////////////////////////////////
+
+// USB adapters (FTDI and alike) buffer received bytes for up to their
+// latency timer, 16 ms by default, before passing them on.
+static void setLatencyTimer(SerialPort *port, const char *serialPort, int ms)
+{
+    char *real = realpath(serialPort, NULL);
+    if (real == NULL)
+        return;
+    const char *name = strrchr(real, '/') ? strrchr(real, '/') + 1 : real;
+    snprintf(port->latencyPath, sizeof(port->latencyPath), "/sys/class/tty/%s/device/latency_timer", name);
+    free(real);
+
+    FILE *f = fopen(port->latencyPath, "r+");
+    if (f == NULL)
+        return; // Not a USB adapter with a latency timer
+    int old;
+    if (fscanf(f, "%d", &old) == 1 && old != ms) {
+        rewind(f);
+        if (fprintf(f, "%d\n", ms) > 0 && fflush(f) == 0)
+            port->oldLatencyTimer = old;
+        else
+            fprintf(stderr, "%s: cannot set the latency timer\n", port->latencyPath);
+    }
+    fclose(f);
+}
+
+static void restoreLatencyTimer(SerialPort *port)
+{
+    if (port->oldLatencyTimer < 0)
+        return;
+    FILE *f = fopen(port->latencyPath, "w");
+    if (f != NULL) {
+        fprintf(f, "%d\n", port->oldLatencyTimer);
+        fclose(f);
+    }
+    port->oldLatencyTimer = -1;
+}
+
+// Ask the driver to push received bytes to the reader immediately instead of
+// batching them. Not every driver has the flag (e.g. ptys).
+static void setLowLatency(SerialPort *port, const char *serialPort)
+{
+    struct serial_struct serial;
+    if (ioctl(port->fd, TIOCGSERIAL, &serial) == -1) {
+        printf("%s: low latency mode not supported by the driver\n", serialPort);
+        return;
+    }
+    if (serial.flags & ASYNC_LOW_LATENCY)
+        return;
+
+    int oldFlags = serial.flags;
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(port->fd, TIOCSSERIAL, &serial) == -1)
+        perror("TIOCSSERIAL");
+    else
+        port->oldSerialFlags = oldFlags;
+}
 
 // Open and configure the serial port.
 // Returns -1 on error.
-int openSerialPort(const char *serialPort, int baudRate)
+static int ttyOpen(SerialPort *port, const char *serialPort, int baudRate, const SerialConfig *config)
 {
+    port->oldSerialFlags = -1;
+    port->oldLatencyTimer = -1;
+    port->baudRate = baudRate;
+    port->txBusyUntil = 0;
+
     // Open with O_NONBLOCK to avoid hanging when CLOCAL
     // is not yet set on the serial port (changed later)
     int oflags = O_RDWR | O_NOCTTY | O_NONBLOCK;
-    fd = open(serialPort, oflags);
+    int fd = open(serialPort, oflags);
+    port->fd = fd;
     if (fd < 0)
     {
         perror(serialPort);
@@ -32,7 +112,7 @@ int openSerialPort(const char *serialPort, int baudRate)
     }
 
     // Save current port settings
-    if (tcgetattr(fd, &oldtio) == -1)
+    if (tcgetattr(fd, &port->oldtio) == -1)
     {
         perror("tcgetattr");
         return -1;
@@ -46,7 +126,9 @@ int openSerialPort(const char *serialPort, int baudRate)
         br = B##baudrate;       \
         break;
 
-    tcflag_t br;
+    // Other rates are set with termios2 once the port is configured
+    tcflag_t br = B38400;
+    bool custom = false;
     switch (baudRate)
     {
         CASE_BAUDRATE(1200);
@@ -59,8 +141,15 @@ int openSerialPort(const char *serialPort, int baudRate)
         CASE_BAUDRATE(57600);
         CASE_BAUDRATE(115200);
     default:
-        fprintf(stderr, "Unsupported baud rate (must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200)\n");
-        return -1;
+        if (baudRate < SERIAL_MIN_BAUDRATE || baudRate > SERIAL_MAX_BAUDRATE)
+        {
+            fprintf(stderr, "Unsupported baud rate %d (must be between %d and %d)\n",
+                    baudRate, SERIAL_MIN_BAUDRATE, SERIAL_MAX_BAUDRATE);
+            close(fd);
+            port->fd = -1;
+            return -1;
+        }
+        custom = true;
     }
 #undef CASE_BAUDRATE
 
@@ -69,13 +158,21 @@ int openSerialPort(const char *serialPort, int baudRate)
     memset(&newtio, 0, sizeof(newtio));
 
     newtio.c_cflag = br | CS8 | CLOCAL | CREAD;
+    if (config->rtsCts)
+        newtio.c_cflag |= CRTSCTS;
     newtio.c_iflag = IGNPAR;
     newtio.c_oflag = 0;
 
     // Set input mode (non-canonical, no echo,...)
+    // Reads are only made once poll reports data, so a larger VMIN lets the
+    // driver gather bytes into fewer reads; VTIME bounds the wait for them.
+    int vmin = config->vmin > 0 ? config->vmin : 1;
+    int vtime = config->vtime;
+    if (vmin > 1 && vtime == 0)
+        vtime = 1;
     newtio.c_lflag = 0;
-    newtio.c_cc[VTIME] = 0; // Block reading
-    newtio.c_cc[VMIN] = 1;  // Byte by byte
+    newtio.c_cc[VTIME] = vtime > 255 ? 255 : vtime;
+    newtio.c_cc[VMIN] = vmin > 255 ? 255 : vmin;
 
     tcflush(fd, TCIOFLUSH);
 
@@ -87,6 +184,21 @@ int openSerialPort(const char *serialPort, int baudRate)
         return -1;
     }
 
+    if (custom && serialPortSetBaudRate(fd, baudRate) < 0)
+    {
+        fprintf(stderr, "%s: cannot use %d baud\n", serialPort, baudRate);
+        tcsetattr(fd, TCSANOW, &port->oldtio);
+        close(fd);
+        port->fd = -1;
+        return -1;
+    }
+
+    if (config->lowLatency)
+    {
+        setLowLatency(port, serialPort);
+        setLatencyTimer(port, serialPort, 1);
+    }
+
     // Clear O_NONBLOCK flag to ensure blocking reads
     oflags ^= O_NONBLOCK;
     if (fcntl(fd, F_SETFL, oflags) == -1)
@@ -101,31 +213,329 @@ int openSerialPort(const char *serialPort, int baudRate)
 
 // Restore original port settings and close the serial port.
 // Returns 0 on success and -1 on error.
-int closeSerialPort()
+static int ttyClose(SerialPort *port)
 {
+    if (port->oldSerialFlags >= 0)
+    {
+        struct serial_struct serial;
+        if (ioctl(port->fd, TIOCGSERIAL, &serial) == 0)
+        {
+            serial.flags = port->oldSerialFlags;
+            ioctl(port->fd, TIOCSSERIAL, &serial);
+        }
+        port->oldSerialFlags = -1;
+    }
+    restoreLatencyTimer(port);
+
     // Restore the old port settings
-    if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
+    if (tcsetattr(port->fd, TCSANOW, &port->oldtio) == -1)
     {
         perror("tcsetattr");
         return -1;
     }
 
-    return close(fd);
+    int ret = close(port->fd);
+    port->fd = -1;
+    return ret;
+}
+
+// Wait up to timeoutMs milliseconds for data received on the port's file
+// descriptor (forever if timeoutMs is negative) and read up to nBytes of it.
+// Returns -1 on error, otherwise the number of bytes read (0 on timeout).
+int serialFdRead(SerialPort *port, unsigned char *bytes, int nBytes, int timeoutMs)
+{
+    if (timeoutMs >= 0)
+    {
+        struct pollfd pfd = {.fd = port->fd, .events = POLLIN};
+        int r = poll(&pfd, 1, timeoutMs);
+        if (r <= 0)
+            return r;
+    }
+
+    return read(port->fd, bytes, nBytes);
+}
+
+int serialFdWrite(SerialPort *port, const unsigned char *bytes, int nBytes)
+{
+    return write(port->fd, bytes, nBytes);
+}
+
+// 10 bits per byte, like 8-N-1
+static long long ttyByteNs(const SerialPort *port)
+{
+    return 10 * 1000000000LL / (port->baudRate > 0 ? port->baudRate : 9600);
+}
+
+// The larger of what the driver reports queued and what the bytes written
+// take at the baud rate; ptys report nothing queued.
+static long long ttyDrain(SerialPort *port)
+{
+    long long left = port->txBusyUntil - nowNs();
+    int queued;
+    if (ioctl(port->fd, TIOCOUTQ, &queued) == 0 && queued * ttyByteNs(port) > left)
+        left = queued * ttyByteNs(port);
+    return left > 0 ? left : 0;
+}
+
+// Hand the bytes to the driver as they go out, keeping no more than
+// TTY_MAX_QUEUED_NS of them queued
+static int ttyWrite(SerialPort *port, const unsigned char *bytes, int nBytes)
+{
+    long long byteNs = ttyByteNs(port);
+    int done = 0;
+    while (done < nBytes) {
+        long long queued = ttyDrain(port);
+        int room = (int)((TTY_MAX_QUEUED_NS - queued) / byteNs);
+        // Below 200 baud a byte takes longer than the limit: one at a time
+        if (room < 1 && queued < byteNs)
+            room = 1;
+        if (room <= 0) {
+            // Until half the limit is left, and at least a byte has gone
+            long long wait = queued - TTY_MAX_QUEUED_NS / 2;
+            if (wait < byteNs)
+                wait = byteNs;
+            struct timespec ts = {wait / 1000000000, wait % 1000000000};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        int w = write(port->fd, bytes + done, room < nBytes - done ? room : nBytes - done);
+        if (w < 0)
+            return done > 0 ? done : -1;
+        long long now = nowNs();
+        if (port->txBusyUntil < now)
+            port->txBusyUntil = now;
+        port->txBusyUntil += w * byteNs;
+        done += w;
+    }
+    return done;
+}
+
+static const SerialTransport ttyTransport = {
+    .prefix = NULL,
+    .open = ttyOpen,
+    .close = ttyClose,
+    .read = serialFdRead,
+    .write = ttyWrite,
+    .drain = ttyDrain,
+};
+
+////////////////////////////////////////////////
+// SHAPING
+////////////////////////////////////////////////
+
+// "?rate=N&loss=P&error=P" after the address of an emulated port
+static int parseShaping(SerialShaping *shaping, const char *query)
+{
+    memset(shaping, 0, sizeof(*shaping));
+    shaping->seed = (unsigned long long)time(NULL) << 20 ^ (unsigned long long)getpid();
+
+    while (query != NULL && *query != '\0') {
+        int len = strcspn(query, "&");
+        if (sscanf(query, "rate=%d", &shaping->rate) != 1 &&
+            sscanf(query, "loss=%lf", &shaping->loss) != 1 &&
+            sscanf(query, "error=%lf", &shaping->error) != 1 &&
+            sscanf(query, "seed=%llu", &shaping->seed) != 1) {
+            fprintf(stderr, "Unknown port option \"%.*s\" (rate=, loss=, error=, seed=)\n", len, query);
+            return -1;
+        }
+        query += len;
+        if (*query == '&')
+            query++;
+    }
+    if (shaping->seed == 0)
+        shaping->seed = 1;
+    return 0;
+}
+
+// Uniform in [0, 1)
+static double shapingRandom(SerialShaping *sh)
+{
+    sh->seed ^= sh->seed >> 12;
+    sh->seed ^= sh->seed << 25;
+    sh->seed ^= sh->seed >> 27;
+    return (sh->seed * 0x2545F4914F6CDD1DULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long long nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Write through the port's shaping: bytes leave no faster than the rate (10
+// bits each, like 8-N-1), and some are dropped or get a bit flipped. Every
+// byte counts as written, as on a real line.
+static int shapedWrite(SerialPort *port, const unsigned char *bytes, int nBytes)
+{
+    SerialShaping *sh = &port->shaping;
+
+    if (sh->rate > 0) {
+        long long now = nowNs();
+        if (sh->busyUntil < now)
+            sh->busyUntil = now;
+        sh->busyUntil += (long long)nBytes * 10 * 1000000000 / sh->rate;
+        struct timespec until = {sh->busyUntil / 1000000000, sh->busyUntil % 1000000000};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0)
+            ;
+    }
+
+    if (sh->loss <= 0 && sh->error <= 0)
+        return port->transport->write(port, bytes, nBytes);
+
+    unsigned char out[1024];
+    for (int i = 0; i < nBytes;) {
+        int n = 0;
+        for (; i < nBytes && n < (int)sizeof(out); i++) {
+            if (sh->loss > 0 && shapingRandom(sh) < sh->loss)
+                continue;
+            out[n] = bytes[i];
+            if (sh->error > 0 && shapingRandom(sh) < sh->error)
+                out[n] ^= 1 << (int)(shapingRandom(sh) * 8);
+            n++;
+        }
+        for (int done = 0; done < n;) {
+            int w = port->transport->write(port, out + done, n - done);
+            if (w < 0)
+                return -1;
+            done += w;
+        }
+    }
+    return nBytes;
 }
 
-// Wait up to 0.1 second (VTIME) for a byte received from the serial port.
-// Must check whether a byte was actually received from the return value.
+////////////////////////////////////////////////
+// PORT INTERFACE
+////////////////////////////////////////////////
+
+static const SerialTransport *const transports[] = {&serialMemTransport, &serialUdpTransport,
+                                                    &serialSimTransport};
+
+int serialPortOpen(SerialPort *port, const char *serialPort, int baudRate)
+{
+    return serialPortOpenConfig(port, serialPort, baudRate, NULL);
+}
+
+int serialPortOpenConfig(SerialPort *port, const char *serialPort, int baudRate,
+                         const SerialConfig *config)
+{
+    SerialConfig defaults = {.vmin = 1};
+    if (config == NULL)
+        config = &defaults;
+    memset(&port->shaping, 0, sizeof(port->shaping));
+    port->backend = NULL;
+
+    for (size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); i++) {
+        const SerialTransport *t = transports[i];
+        size_t prefixLen = strlen(t->prefix);
+        if (strncmp(serialPort, t->prefix, prefixLen) != 0)
+            continue;
+
+        // The address, then the shaping options
+        char address[128];
+        snprintf(address, sizeof(address), "%s", serialPort + prefixLen);
+        char *query = strchr(address, '?');
+        if (query != NULL)
+            *query++ = '\0';
+        if (parseShaping(&port->shaping, query) < 0)
+            return -1;
+
+        port->transport = t;
+        return t->open(port, address, baudRate, config);
+    }
+
+    port->transport = &ttyTransport;
+    return ttyOpen(port, serialPort, baudRate, config);
+}
+
+int serialPortClose(SerialPort *port)
+{
+    if (port->transport == NULL)
+        return -1;
+    return port->transport->close(port);
+}
+
+// Wait up to timeoutMs milliseconds for a byte received from the serial port
+// (forever if timeoutMs is negative).
 // Save the received byte in the "byte" pointer.
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
-int readByteSerialPort(unsigned char *byte)
+int serialPortReadByte(SerialPort *port, unsigned char *byte, int timeoutMs)
 {
-    return read(fd, byte, 1);
+    return port->transport->read(port, byte, 1, timeoutMs);
+}
+
+// Wait up to timeoutMs milliseconds for data received from the serial port
+// (forever if timeoutMs is negative) and read up to nBytes of it.
+// Returns -1 on error, otherwise the number of bytes read (0 on timeout).
+int serialPortRead(SerialPort *port, unsigned char *bytes, int nBytes, int timeoutMs)
+{
+    return port->transport->read(port, bytes, nBytes, timeoutMs);
+}
+
+void serialPortInfo(SerialPort *port, SerialPortInfo *info)
+{
+    info->fifoSize = info->inQueued = info->outQueued = info->overruns = -1;
+
+    struct serial_struct serial;
+    if (ioctl(port->fd, TIOCGSERIAL, &serial) == 0)
+        info->fifoSize = serial.xmit_fifo_size;
+
+    int n;
+    if (ioctl(port->fd, FIONREAD, &n) == 0)
+        info->inQueued = n;
+    if (ioctl(port->fd, TIOCOUTQ, &n) == 0)
+        info->outQueued = n;
+
+    struct serial_icounter_struct icount;
+    if (ioctl(port->fd, TIOCGICOUNT, &icount) == 0)
+        info->overruns = icount.overrun + icount.buf_overrun;
+}
+
+long long serialPortDrainNs(SerialPort *port)
+{
+    if (port->transport == NULL || port->transport->drain == NULL)
+        return 0;
+    return port->transport->drain(port);
+}
+
+long long serialPortNowNs(const SerialPort *port)
+{
+    if (port->transport != NULL && port->transport->now != NULL)
+        return port->transport->now(port);
+    return nowNs();
 }
 
 // Write up to numBytes from the "bytes" array to the serial port.
 // Must check how many were actually written in the return value.
 // Returns -1 on error, otherwise the number of bytes written.
+int serialPortWrite(SerialPort *port, const unsigned char *bytes, int nBytes)
+{
+    if (port->transport != &ttyTransport)
+        return shapedWrite(port, bytes, nBytes);
+    return port->transport->write(port, bytes, nBytes);
+}
+
+////////////////////////////////////////////////
+// Single-port interface (default port)
+////////////////////////////////////////////////
+
+int openSerialPort(const char *serialPort, int baudRate)
+{
+    return serialPortOpen(&defaultPort, serialPort, baudRate);
+}
+
+int closeSerialPort()
+{
+    return serialPortClose(&defaultPort);
+}
+
+int readByteSerialPort(unsigned char *byte)
+{
+    return serialPortReadByte(&defaultPort, byte, -1);
+}
+
 int writeBytesSerialPort(const unsigned char *bytes, int nBytes)
 {
-    return write(fd, bytes, nBytes);
+    return serialPortWrite(&defaultPort, bytes, nBytes);
 }
\ No newline at end of file
@@ -0,0 +1,317 @@
+// Simulated serial line
+// Discrete-event model of the cable between two "sim:NAME" ports. Writes
+// never block: each byte is stamped with the time it reaches the other end
+// and queued there. A read that finds nothing due waits, and once every
+// thread of the simulation is waiting the clock jumps to the earliest byte
+// arrival or read timeout.
+
+#include "serial_sim.h"
+#include "serial_transport.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Where the virtual clock starts; link timers treat a deadline of 0 as unset
+#define SIM_EPOCH 1000000000LL
+
+// Bytes in flight in one direction, in order of arrival
+typedef struct
+{
+    unsigned char *bytes;
+    long long *arrival;
+    int head;
+    int tail;
+    int capacity;
+    long long busyUntil; // When the last byte written has left the sender
+    unsigned long long random;
+} SimLine;
+
+typedef struct
+{
+    bool waiting;
+    long long wakeAt; // Read timeout of a waiting end (LLONG_MAX: none)
+    SimLine *in;
+    SimLine *out;
+} SimEnd;
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t tick; // Time moved or a thread finished
+    SimChannel channel;
+    long long byteTime;  // ns per byte on the line
+    double byteError;    // Probability that a byte is hit
+    long long now;
+    int threads;         // Threads taking part and not done
+    int waiting;         // Of those, how many are blocked in a read
+    bool stalled;
+    SimEnd ends[2];
+    int nEnds;
+    SimLine lines[2];
+} sim = {.lock = PTHREAD_MUTEX_INITIALIZER, .tick = PTHREAD_COND_INITIALIZER, .now = SIM_EPOCH};
+
+static double simRandom(SimLine *line)
+{
+    line->random ^= line->random >> 12;
+    line->random ^= line->random << 25;
+    line->random ^= line->random >> 27;
+    return (line->random * 0x2545F4914F6CDD1DULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Arrival of the next byte on a line, LLONG_MAX if none is in flight
+static long long nextArrival(const SimLine *line)
+{
+    return line->head < line->tail ? line->arrival[line->head] : LLONG_MAX;
+}
+
+static long long wakeTime(const SimEnd *end)
+{
+    long long arrival = nextArrival(end->in);
+    return arrival < end->wakeAt ? arrival : end->wakeAt;
+}
+
+// Called with the lock held whenever a thread blocks or leaves: once all
+// remaining threads are waiting, jump to the earliest event among them and
+// wake whoever it is for.
+static void advance(void)
+{
+    if (sim.waiting < sim.threads)
+        return;
+
+    long long next = LLONG_MAX;
+    for (int i = 0; i < sim.nEnds; i++)
+        if (sim.ends[i].waiting && wakeTime(&sim.ends[i]) < next)
+            next = wakeTime(&sim.ends[i]);
+
+    if (next == LLONG_MAX)
+        sim.stalled = sim.threads > 0;
+    else if (next > sim.now)
+        sim.now = next;
+    pthread_cond_broadcast(&sim.tick);
+}
+
+static bool inOutage(long long t)
+{
+    t -= SIM_EPOCH;
+    for (int i = 0; i < sim.channel.nOutages; i++)
+        if (t >= sim.channel.outages[i].start && t < sim.channel.outages[i].start + sim.channel.outages[i].length)
+            return true;
+    return false;
+}
+
+void simStart(const SimChannel *channel, int nThreads)
+{
+    pthread_mutex_lock(&sim.lock);
+    for (int i = 0; i < 2; i++) {
+        free(sim.lines[i].bytes);
+        free(sim.lines[i].arrival);
+    }
+    memset(sim.lines, 0, sizeof(sim.lines));
+    memset(sim.ends, 0, sizeof(sim.ends));
+    sim.nEnds = 0;
+    sim.channel = *channel;
+    sim.byteTime = 10 * 1000000000LL / channel->baudRate;
+
+    // At most one bit flipped per byte, as in the cable
+    double ok = 1.0 - channel->ber;
+    ok *= ok;
+    ok *= ok;
+    ok *= ok;
+    sim.byteError = 1.0 - ok;
+
+    sim.now = SIM_EPOCH;
+    sim.threads = nThreads;
+    sim.waiting = 0;
+    sim.stalled = false;
+    pthread_mutex_unlock(&sim.lock);
+}
+
+void simThreadDone(void)
+{
+    pthread_mutex_lock(&sim.lock);
+    sim.threads--;
+    advance();
+    pthread_mutex_unlock(&sim.lock);
+}
+
+bool simWait(void)
+{
+    pthread_mutex_lock(&sim.lock);
+    while (sim.threads > 0 && !sim.stalled)
+        pthread_cond_wait(&sim.tick, &sim.lock);
+    bool done = sim.threads == 0;
+    pthread_mutex_unlock(&sim.lock);
+    return done;
+}
+
+long long simElapsed(void)
+{
+    pthread_mutex_lock(&sim.lock);
+    long long t = sim.now - SIM_EPOCH;
+    pthread_mutex_unlock(&sim.lock);
+    return t;
+}
+
+static int simOpen(SerialPort *port, const char *address, int baudRate, const SerialConfig *config)
+{
+    (void)baudRate;
+    (void)config;
+    port->fd = -1;
+
+    pthread_mutex_lock(&sim.lock);
+    if (sim.nEnds == 2) {
+        pthread_mutex_unlock(&sim.lock);
+        fprintf(stderr, "sim:%s: the simulated line has two ends only\n", address);
+        return -1;
+    }
+    int index = sim.nEnds++;
+    SimEnd *end = &sim.ends[index];
+    end->in = &sim.lines[index];
+    end->out = &sim.lines[1 - index];
+
+    // The errors of a direction depend on the seed and the name of the end
+    // writing to it, not on which end happened to open first
+    unsigned long long hash = 14695981039346656037ULL;
+    for (const char *c = address; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    end->out->random = (sim.channel.seed ^ hash) | 1;
+    pthread_mutex_unlock(&sim.lock);
+
+    // Links take a port with a descriptor for an open one; nothing is ever
+    // read from it
+    port->fd = eventfd(0, EFD_CLOEXEC);
+    if (port->fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    port->backend = end;
+    return port->fd;
+}
+
+// Bytes still reaching a closed end are never read, as on a cable with
+// nobody listening
+static int simClose(SerialPort *port)
+{
+    int ret = close(port->fd);
+    port->fd = -1;
+    return ret;
+}
+
+static void unlockSim(void *arg)
+{
+    (void)arg;
+    pthread_mutex_unlock(&sim.lock);
+}
+
+static int simRead(SerialPort *port, unsigned char *bytes, int nBytes, int timeoutMs)
+{
+    SimEnd *end = port->backend;
+    SimLine *in = end->in;
+
+    pthread_mutex_lock(&sim.lock);
+    pthread_cleanup_push(unlockSim, NULL);
+    end->wakeAt = timeoutMs < 0 ? LLONG_MAX : sim.now + timeoutMs * 1000000LL;
+    while (nextArrival(in) > sim.now && sim.now < end->wakeAt) {
+        end->waiting = true;
+        sim.waiting++;
+        advance();
+        // A stalled simulation stays here until the thread is cancelled
+        while (sim.stalled)
+            pthread_cond_wait(&sim.tick, &sim.lock);
+        if (nextArrival(in) > sim.now && sim.now < end->wakeAt)
+            pthread_cond_wait(&sim.tick, &sim.lock);
+        end->waiting = false;
+        sim.waiting--;
+    }
+    pthread_cleanup_pop(0);
+
+    int n = 0;
+    while (n < nBytes && nextArrival(in) <= sim.now)
+        bytes[n++] = in->bytes[in->head++];
+    if (in->head == in->tail)
+        in->head = in->tail = 0;
+    pthread_mutex_unlock(&sim.lock);
+    return n;
+}
+
+static int simWrite(SerialPort *port, const unsigned char *bytes, int nBytes)
+{
+    SimEnd *end = port->backend;
+    SimLine *out = end->out;
+
+    pthread_mutex_lock(&sim.lock);
+    if (out->tail + nBytes > out->capacity && out->head > 0) {
+        // Drop what was already read
+        memmove(out->bytes, out->bytes + out->head, out->tail - out->head);
+        memmove(out->arrival, out->arrival + out->head, (out->tail - out->head) * sizeof(long long));
+        out->tail -= out->head;
+        out->head = 0;
+    }
+    if (out->tail + nBytes > out->capacity) {
+        int capacity = out->capacity > 0 ? out->capacity : 4096;
+        while (out->tail + nBytes > capacity)
+            capacity *= 2;
+        unsigned char *b = realloc(out->bytes, capacity);
+        if (b != NULL)
+            out->bytes = b;
+        long long *a = realloc(out->arrival, capacity * sizeof(long long));
+        if (a != NULL)
+            out->arrival = a;
+        if (b == NULL || a == NULL) {
+            pthread_mutex_unlock(&sim.lock);
+            perror("sim: realloc");
+            return -1;
+        }
+        out->capacity = capacity;
+    }
+
+    if (out->busyUntil < sim.now)
+        out->busyUntil = sim.now;
+    for (int i = 0; i < nBytes; i++) {
+        out->busyUntil += sim.byteTime;
+        if (inOutage(out->busyUntil))
+            continue;
+        unsigned char byte = bytes[i];
+        if (sim.byteError > 0 && simRandom(out) < sim.byteError)
+            byte ^= 1 << (int)(simRandom(out) * 8);
+        out->bytes[out->tail] = byte;
+        out->arrival[out->tail] = out->busyUntil + sim.channel.propDelay;
+        out->tail++;
+    }
+    pthread_mutex_unlock(&sim.lock);
+    return nBytes;
+}
+
+// Until the last byte written has left; the line is never faster
+static long long simDrain(SerialPort *port)
+{
+    SimEnd *end = port->backend;
+    pthread_mutex_lock(&sim.lock);
+    long long left = end->out->busyUntil - sim.now;
+    pthread_mutex_unlock(&sim.lock);
+    return left > 0 ? left : 0;
+}
+
+static long long simNow(const SerialPort *port)
+{
+    (void)port;
+    pthread_mutex_lock(&sim.lock);
+    long long t = sim.now;
+    pthread_mutex_unlock(&sim.lock);
+    return t;
+}
+
+const SerialTransport serialSimTransport = {
+    .prefix = "sim:",
+    .open = simOpen,
+    .close = simClose,
+    .read = simRead,
+    .write = simWrite,
+    .now = simNow,
+    .drain = simDrain,
+};
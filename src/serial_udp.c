@@ -0,0 +1,129 @@
+// UDP serial line
+// "udp:LOCAL:REMOTE" sends what is written as datagrams to localhost:REMOTE
+// and reads those arriving on LOCAL, so two processes can be linked without
+// a tty; "udp:LOCAL:HOST:REMOTE" reaches another host.
+
+#include "serial_transport.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define UDP_DATAGRAM_SIZE 4096 // Largest datagram written
+
+// A datagram has to be read whole, so what the caller did not take yet is
+// kept here.
+typedef struct
+{
+    unsigned char buf[UDP_DATAGRAM_SIZE];
+    int pos;
+    int len;
+} UdpState;
+
+static int udpOpen(SerialPort *port, const char *address, int baudRate, const SerialConfig *config)
+{
+    (void)baudRate;
+    (void)config;
+    port->fd = -1;
+
+    char host[64], local[16], remote[16];
+    if (sscanf(address, "%15[0-9]:%63[^:]:%15[0-9]", local, host, remote) == 3) {
+        // udp:LOCAL:HOST:REMOTE
+    } else if (sscanf(address, "%15[0-9]:%15[0-9]", local, remote) == 2) {
+        strcpy(host, "127.0.0.1");
+    } else {
+        fprintf(stderr, "udp:%s: expected udp:LOCAL:REMOTE or udp:LOCAL:HOST:REMOTE\n", address);
+        return -1;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *peer;
+    int err = getaddrinfo(host, remote, &hints, &peer);
+    if (err != 0) {
+        fprintf(stderr, "udp:%s: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+
+    UdpState *state = calloc(1, sizeof(UdpState));
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in me = {.sin_family = AF_INET, .sin_port = htons(atoi(local))};
+    me.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (state == NULL || fd == -1 || bind(fd, (struct sockaddr *)&me, sizeof(me)) == -1 ||
+        connect(fd, peer->ai_addr, peer->ai_addrlen) == -1) {
+        perror(address);
+        if (fd != -1)
+            close(fd);
+        free(state);
+        freeaddrinfo(peer);
+        return -1;
+    }
+    freeaddrinfo(peer);
+
+    port->fd = fd;
+    port->backend = state;
+    return fd;
+}
+
+static int udpClose(SerialPort *port)
+{
+    free(port->backend);
+    port->backend = NULL;
+    int ret = close(port->fd);
+    port->fd = -1;
+    return ret;
+}
+
+static int udpRead(SerialPort *port, unsigned char *bytes, int nBytes, int timeoutMs)
+{
+    UdpState *state = port->backend;
+
+    if (state->pos == state->len) {
+        if (timeoutMs >= 0) {
+            struct pollfd pfd = {.fd = port->fd, .events = POLLIN};
+            int r = poll(&pfd, 1, timeoutMs);
+            if (r <= 0)
+                return r;
+        }
+        // Nobody listening on the other side yet shows up as ECONNREFUSED
+        int r = recv(port->fd, state->buf, sizeof(state->buf), 0);
+        if (r <= 0)
+            return r;
+        state->pos = 0;
+        state->len = r;
+    }
+
+    int n = state->len - state->pos;
+    if (n > nBytes)
+        n = nBytes;
+    memcpy(bytes, state->buf + state->pos, n);
+    state->pos += n;
+    return n;
+}
+
+static int udpWrite(SerialPort *port, const unsigned char *bytes, int nBytes)
+{
+    for (int done = 0; done < nBytes;) {
+        int n = nBytes - done;
+        if (n > UDP_DATAGRAM_SIZE)
+            n = UDP_DATAGRAM_SIZE;
+        // A peer that is not there yet loses the bytes, like an unplugged cable
+        send(port->fd, bytes + done, n, 0);
+        done += n;
+    }
+    return nBytes;
+}
+
+const SerialTransport serialUdpTransport = {
+    .prefix = "udp:",
+    .open = udpOpen,
+    .close = udpClose,
+    .read = udpRead,
+    .write = udpWrite,
+};
@@ -0,0 +1,105 @@
+// Sparse file implementation
+
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE, fallocate
+#define _FILE_OFFSET_BITS 64
+
+#include "sparse.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define ZERO_BLOCK 65536
+
+static const uint8_t zeros[ZERO_BLOCK];
+
+int sparseNextData(int fd, uint64_t offset, uint64_t end, uint64_t *dataStart, uint64_t *dataEnd)
+{
+    *dataStart = *dataEnd = end;
+    if (offset >= end)
+        return 0;
+
+    off_t data = lseek(fd, (off_t)offset, SEEK_DATA);
+    if (data == -1 && errno == ENXIO)
+        return 0; // Only a hole up to the end of the file
+    if (data == -1) {
+        if (errno != EINVAL && errno != EOPNOTSUPP)
+            return -1;
+        // No hole support here: all of it is data
+        *dataStart = offset;
+        return 0;
+    }
+    if ((uint64_t)data >= end)
+        return 0;
+
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if (hole == -1)
+        return -1;
+    *dataStart = (uint64_t)data;
+    if ((uint64_t)hole < end)
+        *dataEnd = (uint64_t)hole;
+    return 0;
+}
+
+bool sparseIsZero(const uint8_t *data, size_t len)
+{
+    // Compare the buffer with itself shifted by one: all equal to the first
+    // byte, and that is zero
+    return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+void sparseHashZeros(Sha256 *ctx, uint64_t len)
+{
+    while (len > 0) {
+        size_t n = len < ZERO_BLOCK ? (size_t)len : ZERO_BLOCK;
+        sha256Update(ctx, zeros, n);
+        len -= n;
+    }
+}
+
+static int writeZeros(FILE *out, uint64_t len)
+{
+    while (len > 0) {
+        size_t n = len < ZERO_BLOCK ? (size_t)len : ZERO_BLOCK;
+        if (fwrite(zeros, 1, n, out) != n)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+int sparseSkip(FILE *out, uint64_t len)
+{
+    struct stat st;
+    off_t pos = ftello(out);
+    if (pos == -1 || fflush(out) != 0 || fstat(fileno(out), &st) != 0 || !S_ISREG(st.st_mode))
+        return writeZeros(out, len);
+
+    // The output may already have data there (e.g. stdout opened on an
+    // existing image); punch it out, or overwrite it where that fails
+    if (pos < st.st_size) {
+        uint64_t overlap = (uint64_t)(st.st_size - pos);
+        if (overlap > len)
+            overlap = len;
+        if (fallocate(fileno(out), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, (off_t)overlap) != 0 &&
+            writeZeros(out, overlap) != 0)
+            return -1;
+    }
+    return fseeko(out, pos + (off_t)len, SEEK_SET);
+}
+
+int sparseFinish(FILE *out)
+{
+    struct stat st;
+    if (fflush(out) != 0)
+        return -1;
+    off_t pos = ftello(out);
+    if (pos == -1 || fstat(fileno(out), &st) != 0 || !S_ISREG(st.st_mode))
+        return 0;
+    if (pos > st.st_size && ftruncate(fileno(out), pos) != 0)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Event trace implementation
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct
+{
+    const char *name;
+    const char *argName; // NULL: no argument
+    long long arg;
+    long long startNs;
+    long long durationNs; // -1: instant event
+    TraceTrack track;
+} TraceEvent;
+
+struct Trace
+{
+    const SerialPort *clock;
+    TraceEvent *events;
+    int capacity;
+    int count;
+    long dropped;
+};
+
+static const char *trackNames[] = {
+    [TRACE_APP] = "application",
+    [TRACE_LINK] = "link",
+};
+
+Trace *traceCreate(int capacity, const SerialPort *clock)
+{
+    Trace *trace = calloc(1, sizeof(Trace));
+    if (trace == NULL)
+        return NULL;
+    trace->events = malloc(capacity * sizeof(TraceEvent));
+    if (trace->events == NULL) {
+        free(trace);
+        return NULL;
+    }
+    trace->clock = clock;
+    trace->capacity = capacity;
+    return trace;
+}
+
+long long traceNow(const Trace *trace)
+{
+    return trace != NULL ? serialPortNowNs(trace->clock) : 0;
+}
+
+static void record(Trace *trace, TraceTrack track, const char *name, long long startNs, long long durationNs,
+                   const char *argName, long long arg)
+{
+    if (trace->count == trace->capacity) {
+        trace->dropped++;
+        return;
+    }
+    TraceEvent *e = &trace->events[trace->count++];
+    e->name = name;
+    e->argName = argName;
+    e->arg = arg;
+    e->startNs = startNs;
+    e->durationNs = durationNs;
+    e->track = track;
+}
+
+void traceSpan(Trace *trace, TraceTrack track, const char *name, long long startNs,
+               const char *argName, long long arg)
+{
+    if (trace != NULL)
+        record(trace, track, name, startNs, traceNow(trace) - startNs, argName, arg);
+}
+
+void traceInstant(Trace *trace, TraceTrack track, const char *name, const char *argName, long long arg)
+{
+    if (trace != NULL)
+        record(trace, track, name, traceNow(trace), -1, argName, arg);
+}
+
+// Write s as the contents of a JSON string
+static void writeEscaped(FILE *out, const char *s)
+{
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', out);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, out);
+    }
+}
+
+int traceWrite(const Trace *trace, const char *path, const char *processName)
+{
+    if (trace == NULL)
+        return 0;
+
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+        return -1;
+
+    // The pid keeps the events of both ends apart when their traces are
+    // merged; they share the monotonic clock
+    int pid = (int)getpid();
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(out, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"", pid);
+    writeEscaped(out, processName);
+    fprintf(out, "\"}}");
+    for (int track = TRACE_APP; track <= TRACE_LINK; track++)
+        fprintf(out, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                pid, track, trackNames[track]);
+
+    // Timestamps and durations are in microseconds
+    for (int i = 0; i < trace->count; i++) {
+        const TraceEvent *e = &trace->events[i];
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%lld.%03lld",
+                e->name, trackNames[e->track], pid, e->track, e->startNs / 1000, e->startNs % 1000);
+        if (e->durationNs >= 0)
+            fprintf(out, ",\"ph\":\"X\",\"dur\":%lld.%03lld", e->durationNs / 1000, e->durationNs % 1000);
+        else
+            fprintf(out, ",\"ph\":\"i\",\"s\":\"t\"");
+        if (e->argName != NULL)
+            fprintf(out, ",\"args\":{\"%s\":%lld}", e->argName, e->arg);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n]}\n");
+
+    if (trace->dropped > 0)
+        printf("Trace buffer full, %ld events dropped\n", trace->dropped);
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+void traceFree(Trace *trace)
+{
+    if (trace != NULL)
+        free(trace->events);
+    free(trace);
+}